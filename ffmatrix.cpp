@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "threadpool.h"
+#include "ffmatrix.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FM_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+#define MAX_DELTA       65535   // Largest index difference of an entry.
+#define CHUNK_ROWS      256     // Number of rows encoded by each task.
+#define HALF_BIAS       ((127 - 15) << 23)  // Difference of the float and half exponent biases.
+
+
+// Header of a cache file. It is followed by the arrays rowStart[], rowScales[], deltas[] and values[].
+typedef struct FM_FileHeader {
+    char magic[8];
+    unsigned long long key;
+    int numRows;
+    int numCols;
+    unsigned long long numEntries;
+}
+FM_FileHeader;
+
+static const char fileMagic[8] = { 'R', 'A', 'D', 'F', 'F', 'M', '0', '1' };
+
+
+
+static inline unsigned short EncodeHalf(float v)
+// Round a value in [0, 1] to a half-precision float. Values too small for a normalized
+// half-precision float are rounded to 0 or to the smallest one, so no subnormal values are stored.
+{
+    const float MIN_NORMAL = 1.0f / 16384.0f;
+    if (v < 0.5f * MIN_NORMAL) return 0;
+    if (v < MIN_NORMAL) return 0x0400;
+
+    unsigned int bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (unsigned short)((bits - HALF_BIAS + 0x1000) >> 13);
+}
+
+
+static inline float DecodeHalf(unsigned short h)
+{
+    if (h == 0) return 0.0f;
+    unsigned int bits = ((unsigned int)h << 13) + HALF_BIAS;
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+
+
+FM_Builder FM_BuilderInit(int numRows, int numCols)
+{
+    FM_Builder b;
+    b.numRows = numRows;
+    b.numCols = numCols;
+    b.colCounts = (int *)CheckedMalloc(sizeof(int) * (numCols > 0 ? numCols : 1));
+    b.colRows = (int **)CheckedMalloc(sizeof(int *) * (numCols > 0 ? numCols : 1));
+    b.colValues = (float **)CheckedMalloc(sizeof(float *) * (numCols > 0 ? numCols : 1));
+    for (int c = 0; c < numCols; c++)
+    {
+        b.colCounts[c] = 0;
+        b.colRows[c] = NULL;
+        b.colValues[c] = NULL;
+    }
+    return b;
+}
+
+
+void FM_BuilderCleanUp(FM_Builder *b)
+{
+    if (b == NULL || b->colCounts == NULL) return;
+    for (int c = 0; c < b->numCols; c++)
+    {
+        free(b->colRows[c]);
+        free(b->colValues[c]);
+    }
+    free(b->colCounts);
+    free(b->colRows);
+    free(b->colValues);
+    b->colCounts = NULL;
+    b->colRows = NULL;
+    b->colValues = NULL;
+}
+
+
+void FM_BuilderAddColumn(FM_Builder *b, int col, const FF_Row *row)
+// Store the form factors from shooter col to the gatherers of a form factor row.
+{
+    int n = row->numEntries;
+    b->colCounts[col] = n;
+    b->colRows[col] = (int *)CheckedMalloc(sizeof(int) * (n > 0 ? n : 1));
+    b->colValues[col] = (float *)CheckedMalloc(sizeof(float) * (n > 0 ? n : 1));
+    memcpy(b->colRows[col], row->gatherers, sizeof(int) * n);
+    memcpy(b->colValues[col], row->formFactors, sizeof(float) * n);
+}
+
+
+
+FM_Matrix FM_BuilderFinish(const FM_Builder *b)
+// Encode the columns that have been added into a compressed matrix.
+{
+    FM_Matrix mat;
+    mat.numRows = b->numRows;
+    mat.numCols = b->numCols;
+    mat.mapping = NULL;
+    mat.mappingBytes = 0;
+
+    // Transpose the columns into rows, with the columns of each row in increasing order.
+    size_t *start = (size_t *)CheckedMalloc(sizeof(size_t) * (b->numRows + 1));
+    for (int r = 0; r <= b->numRows; r++) start[r] = 0;
+    for (int c = 0; c < b->numCols; c++)
+        for (int i = 0; i < b->colCounts[c]; i++) start[b->colRows[c][i] + 1]++;
+    for (int r = 0; r < b->numRows; r++) start[r + 1] += start[r];
+
+    size_t numPairs = start[b->numRows];
+    int *pairCols = (int *)CheckedMalloc(sizeof(int) * (numPairs > 0 ? numPairs : 1));
+    float *pairValues = (float *)CheckedMalloc(sizeof(float) * (numPairs > 0 ? numPairs : 1));
+    size_t *fill = (size_t *)CheckedMalloc(sizeof(size_t) * (b->numRows > 0 ? b->numRows : 1));
+    for (int r = 0; r < b->numRows; r++) fill[r] = start[r];
+    for (int c = 0; c < b->numCols; c++)
+        for (int i = 0; i < b->colCounts[c]; i++)
+        {
+            size_t k = fill[b->colRows[c][i]]++;
+            pairCols[k] = c;
+            pairValues[k] = b->colValues[c][i];
+        }
+    free(fill);
+
+    // Count the entries of each row, with the padding.
+    mat.rowStart = (size_t *)CheckedMalloc(sizeof(size_t) * (b->numRows + 1));
+    int numChunks = (b->numRows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_ROWS, b->numRows);
+        for (int r = chunk * CHUNK_ROWS; r < end; r++)
+        {
+            size_t count = 0;
+            int prevCol = 0;
+            for (size_t k = start[r]; k < start[r + 1]; k++)
+            {
+                int delta = pairCols[k] - prevCol;
+                count += 1 + ((delta > 0) ? (delta - 1) / MAX_DELTA : 0);
+                prevCol = pairCols[k];
+            }
+            mat.rowStart[r + 1] = (count + FM_ROW_ALIGN - 1) / FM_ROW_ALIGN * FM_ROW_ALIGN;
+        }
+    });
+    mat.rowStart[0] = 0;
+    for (int r = 0; r < b->numRows; r++) mat.rowStart[r + 1] += mat.rowStart[r];
+
+    mat.numEntries = mat.rowStart[b->numRows];
+    mat.deltas = (unsigned short *)CheckedMalloc(sizeof(unsigned short) * (mat.numEntries > 0 ? mat.numEntries : 1));
+    mat.values = (unsigned short *)CheckedMalloc(sizeof(unsigned short) * (mat.numEntries > 0 ? mat.numEntries : 1));
+    mat.rowScales = (float *)CheckedMalloc(sizeof(float) * (b->numRows > 0 ? b->numRows : 1));
+
+    // Encode the rows.
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_ROWS, b->numRows);
+        for (int r = chunk * CHUNK_ROWS; r < end; r++)
+        {
+            float scale = 0.0f;
+            for (size_t k = start[r]; k < start[r + 1]; k++) scale = Max2(scale, pairValues[k]);
+            mat.rowScales[r] = scale;
+            float invScale = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+
+            size_t e = mat.rowStart[r];
+            int prevCol = 0;
+            for (size_t k = start[r]; k < start[r + 1]; k++)
+            {
+                int delta = pairCols[k] - prevCol;
+                for (; delta > MAX_DELTA; delta -= MAX_DELTA, e++)
+                {
+                    mat.deltas[e] = MAX_DELTA;
+                    mat.values[e] = 0;
+                }
+                mat.deltas[e] = (unsigned short)delta;
+                mat.values[e] = EncodeHalf(Min2(pairValues[k] * invScale, 1.0f));
+                e++;
+                prevCol = pairCols[k];
+            }
+            for (; e < mat.rowStart[r + 1]; e++)
+            {
+                mat.deltas[e] = 0;
+                mat.values[e] = 0;
+            }
+        }
+    });
+
+    free(start);
+    free(pairCols);
+    free(pairValues);
+    return mat;
+}
+
+
+void FM_MatrixCleanUp(FM_Matrix *mat)
+{
+    if (mat == NULL) return;
+    if (mat->mapping != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(mat->mapping);
+#else
+        munmap(mat->mapping, mat->mappingBytes);
+#endif
+    }
+    else
+    {
+        free(mat->rowStart);
+        free(mat->deltas);
+        free(mat->values);
+        free(mat->rowScales);
+    }
+    mat->mapping = NULL;
+    mat->mappingBytes = 0;
+    mat->rowStart = NULL;
+    mat->deltas = NULL;
+    mat->values = NULL;
+    mat->rowScales = NULL;
+    mat->numRows = mat->numCols = 0;
+    mat->numEntries = 0;
+}
+
+
+static size_t FileBytes(int numRows, size_t numEntries)
+// Returns the size of a cache file, or 0 if it does not fit in a size_t.
+{
+    size_t rowBytes = sizeof(FM_FileHeader) + sizeof(size_t) * (numRows + 1) + sizeof(float) * numRows;
+    if (numEntries > ((size_t)-1 - rowBytes) / (2 * sizeof(unsigned short))) return 0;
+    return rowBytes + 2 * sizeof(unsigned short) * numEntries;
+}
+
+
+static bool ValidRows(const FM_Matrix *mat)
+// Returns whether the rows of a mapped matrix stay within its entries and columns, so that a
+// corrupted cache file cannot make FM_MultiplyRow() read out of bounds.
+{
+    if (mat->rowStart[0] != 0 || mat->rowStart[mat->numRows] != mat->numEntries) return false;
+
+    for (int r = 0; r < mat->numRows; r++)
+    {
+        size_t begin = mat->rowStart[r], end = mat->rowStart[r + 1];
+        if (end < begin || end > mat->numEntries || (end - begin) % FM_ROW_ALIGN != 0) return false;
+
+        size_t col = 0;
+        for (size_t e = begin; e < end; e++)
+        {
+            col += mat->deltas[e];
+            if (col >= (size_t)mat->numCols) return false;
+        }
+    }
+    return true;
+}
+
+
+void FM_MatrixSave(const FM_Matrix *mat, const char *filename, unsigned long long key)
+// Write the matrix and its key to a cache file. The file is written under a temporary name and
+// then renamed over the cache file, so that other processes that have the old file mapped keep
+// reading it intact.
+{
+    char tempFilename[1024];
+#ifdef _WIN32
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp.%lu", filename, (unsigned long)GetCurrentProcessId());
+#else
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp.%ld", filename, (long)getpid());
+#endif
+
+    FILE *fp = fopen(tempFilename, "wb");
+    if (fp == NULL)
+    {
+        ShowWarning(__FILE__, __LINE__, "Cannot open file \"%s\" for output", tempFilename);
+        return;
+    }
+
+    FM_FileHeader header;
+    memcpy(header.magic, fileMagic, sizeof(header.magic));
+    header.key = key;
+    header.numRows = mat->numRows;
+    header.numCols = mat->numCols;
+    header.numEntries = mat->numEntries;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(mat->rowStart, sizeof(size_t), mat->numRows + 1, fp) == (size_t)(mat->numRows + 1) &&
+              fwrite(mat->rowScales, sizeof(float), mat->numRows, fp) == (size_t)mat->numRows &&
+              fwrite(mat->deltas, sizeof(unsigned short), mat->numEntries, fp) == mat->numEntries &&
+              fwrite(mat->values, sizeof(unsigned short), mat->numEntries, fp) == mat->numEntries;
+    if (fclose(fp) != 0) ok = false;
+
+    // A partly written file would not match its size, but do not leave it behind.
+    if (!ok)
+    {
+        ShowWarning(__FILE__, __LINE__, "Error writing to file \"%s\"", tempFilename);
+        remove(tempFilename);
+        return;
+    }
+
+#ifdef _WIN32
+    ok = MoveFileExA(tempFilename, filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = rename(tempFilename, filename) == 0;
+#endif
+    if (!ok)
+    {
+        ShowWarning(__FILE__, __LINE__, "Cannot replace file \"%s\"", filename);
+        remove(tempFilename);
+    }
+}
+
+
+bool FM_MatrixMap(FM_Matrix *mat, const char *filename, unsigned long long key, int numRows, int numCols)
+// Map a cache file written by FM_MatrixSave() into memory read-only.
+{
+    void *mapping = NULL;
+    size_t numBytes = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(file, &fileSize) && (unsigned long long)fileSize.QuadPart >= sizeof(FM_FileHeader) &&
+        (unsigned long long)fileSize.QuadPart <= (size_t)-1)
+    {
+        HANDLE fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (fileMapping != NULL)
+        {
+            mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+            numBytes = (size_t)fileSize.QuadPart;
+            CloseHandle(fileMapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FM_FileHeader))
+    {
+        numBytes = (size_t)st.st_size;
+        mapping = mmap(NULL, numBytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) mapping = NULL;
+    }
+    close(fd);
+#endif
+    if (mapping == NULL) return false;
+
+    const FM_FileHeader *header = (const FM_FileHeader *)mapping;
+    if (memcmp(header->magic, fileMagic, sizeof(fileMagic)) != 0 || header->key != key ||
+        header->numRows != numRows || header->numCols != numCols ||
+        numBytes != FileBytes(numRows, (size_t)header->numEntries))
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(mapping);
+#else
+        munmap(mapping, numBytes);
+#endif
+        return false;
+    }
+
+    // The arrays follow the header, each aligned to its element size.
+    char *p = (char *)mapping + sizeof(FM_FileHeader);
+    FM_Matrix mapped;
+    mapped.numRows = numRows;
+    mapped.numCols = numCols;
+    mapped.numEntries = (size_t)header->numEntries;
+    mapped.rowStart = (size_t *)p;
+    p += sizeof(size_t) * (numRows + 1);
+    mapped.rowScales = (float *)p;
+    p += sizeof(float) * numRows;
+    mapped.deltas = (unsigned short *)p;
+    p += sizeof(unsigned short) * mapped.numEntries;
+    mapped.values = (unsigned short *)p;
+    mapped.mapping = mapping;
+    mapped.mappingBytes = numBytes;
+
+    if (!ValidRows(&mapped))
+    {
+        FM_MatrixCleanUp(&mapped);
+        return false;
+    }
+    *mat = mapped;
+    return true;
+}
+
+
+size_t FM_MatrixBytes(const FM_Matrix *mat)
+{
+    return mat->numEntries * 2 * sizeof(unsigned short) + (mat->numRows + 1) * sizeof(size_t) +
+           mat->numRows * sizeof(float);
+}
+
+
+
+void FM_MultiplyRow(const FM_Matrix *mat, int row, const float (*x)[4], float y[4])
+// Compute the dot product of a row with a vector of RGB values.
+{
+    size_t begin = mat->rowStart[row], end = mat->rowStart[row + 1];
+    const unsigned short *deltas = mat->deltas;
+    int col = 0;
+
+#ifdef FM_USE_SSE2
+    // Each entry adds its value times the (r, g, b, unused) values of its column.
+    __m128 sum = _mm_setzero_ps();
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = begin; i < end; i += FM_ROW_ALIGN)
+    {
+        __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)&mat->values[i]), zero);
+        __m128i bits = _mm_add_epi32(_mm_slli_epi32(h, 13), _mm_set1_epi32(HALF_BIAS));
+        __m128 v = _mm_castsi128_ps(_mm_andnot_si128(_mm_cmpeq_epi32(h, zero), bits));
+
+        col += deltas[i];
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(v, v, 0x00), _mm_loadu_ps(x[col])));
+        col += deltas[i + 1];
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(v, v, 0x55), _mm_loadu_ps(x[col])));
+        col += deltas[i + 2];
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(v, v, 0xAA), _mm_loadu_ps(x[col])));
+        col += deltas[i + 3];
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(v, v, 0xFF), _mm_loadu_ps(x[col])));
+    }
+    float result[4];
+    _mm_storeu_ps(result, _mm_mul_ps(sum, _mm_set1_ps(mat->rowScales[row])));
+    y[0] = result[0];
+    y[1] = result[1];
+    y[2] = result[2];
+#else
+    float sum[3] = { 0.0f, 0.0f, 0.0f };
+    for (size_t i = begin; i < end; i++)
+    {
+        col += deltas[i];
+        float v = DecodeHalf(mat->values[i]);
+        sum[0] += v * x[col][0];
+        sum[1] += v * x[col][1];
+        sum[2] += v * x[col][2];
+    }
+    for (int c = 0; c < 3; c++) y[c] = sum[c] * mat->rowScales[row];
+#endif
+}
+
+
+
+void FM_AccumulateRow(const FM_Matrix *mat, int row, float sums[])
+// Add the form factor of each entry of a row to sums[] at its column. Padding entries add 0.
+{
+    const unsigned short *deltas = mat->deltas;
+    float scale = mat->rowScales[row];
+    int col = 0;
+    for (size_t i = mat->rowStart[row]; i < mat->rowStart[row + 1]; i++)
+    {
+        col += deltas[i];
+        sums[col] += scale * DecodeHalf(mat->values[i]);
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef _FFMATRIX_H_
+#define _FFMATRIX_H_
+
+#include <stddef.h>
+#include "formfactor.h"
+
+// Compressed sparse form factor matrix.
+// Row g holds the form factors from every shooter quad to gatherer quad g, so that one
+// bounce of light is gathered by each gatherer from its own row, and the rows can be
+// processed in parallel.
+// Each entry takes 4 bytes: the difference between its shooter index and that of the previous
+// entry of the row as 16 bits, and the form factor as a 16-bit half-precision float scaled by
+// the largest form factor of the row. Larger index gaps are bridged by padding entries of
+// value 0, and each row is padded to a multiple of 4 entries so that the values can be
+// converted 4 at a time with SSE2.
+// A matrix can be saved to a file together with a key that identifies the geometry and the
+// form factor settings it was computed for, and mapped back into memory by a later run.
+
+
+#define FM_ROW_ALIGN    4       // The number of entries of each row is a multiple of this.
+
+
+typedef struct FM_Matrix {
+    int numRows;            // Number of gatherer quads.
+    int numCols;            // Number of shooter quads.
+    size_t numEntries;      // Number of stored entries, including padding.
+    size_t *rowStart;       // Entries of row g are rowStart[g] to (rowStart[g + 1] - 1).
+    unsigned short *deltas; // Shooter index of each entry minus that of the previous entry of the row.
+    unsigned short *values; // Half-precision form factor of each entry, relative to the row scale.
+    float *rowScales;       // Scale of the values of each row.
+    void *mapping;          // Mapped cache file that holds the arrays, or NULL if they are allocated.
+    size_t mappingBytes;
+}
+FM_Matrix;
+
+
+typedef struct FM_Builder {
+    int numRows;
+    int numCols;
+    int *colCounts;         // Number of form factors added to each column.
+    int **colRows;          // Rows of the form factors of each column, in the order they were added.
+    float **colValues;
+}
+FM_Builder;
+
+
+
+extern FM_Builder FM_BuilderInit(int numRows, int numCols);
+extern void FM_BuilderCleanUp(FM_Builder *b);
+
+extern void FM_BuilderAddColumn(FM_Builder *b, int col, const FF_Row *row);
+// Store the form factors from shooter col to the gatherers of a form factor row.
+// Each column must be added at most once. Different columns can be added concurrently.
+
+extern FM_Matrix FM_BuilderFinish(const FM_Builder *b);
+// Encode the columns that have been added into a compressed matrix, in parallel on the thread pool.
+
+extern void FM_MatrixCleanUp(FM_Matrix *mat);
+
+extern void FM_MatrixSave(const FM_Matrix *mat, const char *filename, unsigned long long key);
+// Write the matrix and its key to a cache file. Shows a warning if the file cannot be written.
+
+extern bool FM_MatrixMap(FM_Matrix *mat, const char *filename, unsigned long long key, int numRows, int numCols);
+// Map a cache file written by FM_MatrixSave() into memory read-only, if it exists and has
+// the given key and size. Returns false, leaving mat unchanged, if it cannot be used.
+
+extern size_t FM_MatrixBytes(const FM_Matrix *mat);
+// Returns the memory used by the matrix.
+
+extern void FM_MultiplyRow(const FM_Matrix *mat, int row, const float (*x)[4], float y[4]);
+// Compute the dot product of a row with a vector of RGB values, stored as (r, g, b, unused)
+// for each column, and store it in y[0] to y[2].
+
+extern void FM_AccumulateRow(const FM_Matrix *mat, int row, float sums[]);
+// Add the form factor of each entry of a row to sums[] at its column.
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "common.h"
+#include "vector3.h"
+#include "threadpool.h"
+#include "formfactor.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FF_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define BAND_ROWS           32      // Number of pixel rows reduced by each task.
+#define COPLANAR_EPSILON    1e-5f   // Relative height below which a polygon is coplanar with a point.
+
+
+
+FF_Row FF_RowInit(void)
+{
+    FF_Row row;
+    row.numEntries = 0;
+    row.capacity = 0;
+    row.gatherers = NULL;
+    row.formFactors = NULL;
+    return row;
+}
+
+
+void FF_RowCleanUp(FF_Row *row)
+{
+    if (row == NULL) return;
+    free(row->gatherers);
+    free(row->formFactors);
+    *row = FF_RowInit();
+}
+
+
+void FF_RowClear(FF_Row *row)
+// Make the row empty, keeping its memory.
+{
+    row->numEntries = 0;
+}
+
+
+void FF_RowAppend(FF_Row *row, int gatherer, float formFactor)
+{
+    if (row->numEntries == row->capacity)
+    {
+        int newCapacity = (row->capacity > 0) ? 2 * row->capacity : 256;
+        int *newGatherers = (int *)CheckedMalloc(sizeof(int) * newCapacity);
+        float *newFormFactors = (float *)CheckedMalloc(sizeof(float) * newCapacity);
+        CopyArrayN(newGatherers, row->gatherers, row->numEntries);
+        CopyArrayN(newFormFactors, row->formFactors, row->numEntries);
+        free(row->gatherers);
+        free(row->formFactors);
+        row->gatherers = newGatherers;
+        row->formFactors = newFormFactors;
+        row->capacity = newCapacity;
+    }
+    row->gatherers[row->numEntries] = gatherer;
+    row->formFactors[row->numEntries] = formFactor;
+    row->numEntries++;
+}
+
+
+
+FF_Reducer FF_ReducerInit(int numItems)
+// Allocate an accumulator for every worker of the thread pool.
+{
+    FF_Reducer r;
+    r.numItems = numItems;
+    r.numWorkers = TP_NumWorkers();
+    r.sums = (float **)CheckedMalloc(sizeof(float *) * r.numWorkers);
+    for (int w = 0; w < r.numWorkers; w++)
+    {
+        r.sums[w] = (float *)CheckedMalloc(sizeof(float) * (numItems > 0 ? numItems : 1));
+        for (int i = 0; i < numItems; i++) r.sums[w][i] = 0.0f;
+    }
+    return r;
+}
+
+
+void FF_ReducerCleanUp(FF_Reducer *r)
+{
+    if (r == NULL) return;
+    for (int w = 0; w < r->numWorkers; w++) free(r->sums[w]);
+    free(r->sums);
+    r->sums = NULL;
+    r->numWorkers = 0;
+    r->numItems = 0;
+}
+
+
+
+void FF_ComputeRowPrefixSums(double prefixSums[], const float deltaFormFactors[], int width, int height)
+// Compute the prefix sums of each row of a (width x height) table of delta form factors.
+{
+    for (int y = 0; y < height; y++)
+    {
+        double *prefix = &prefixSums[y * (width + 1)];
+        const float *dFF = &deltaFormFactors[y * width];
+        prefix[0] = 0.0;
+        for (int x = 0; x < width; x++) prefix[x + 1] = prefix[x] + dFF[x];
+    }
+}
+
+
+
+static inline int FindRunEnd(const unsigned int items[], int begin, int end)
+// Returns the index of the first item after begin that differs from items[begin], or end.
+{
+    unsigned int item = items[begin];
+    int i = begin + 1;
+
+#ifdef FF_USE_SSE2
+    __m128i itemVec = _mm_set1_epi32((int)item);
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128i same = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&items[i]), itemVec);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(same));
+        if (mask != 0xF)
+        {
+            // Find the first lane that differs.
+            int lane = 0;
+            while (mask & (1 << lane)) lane++;
+            return i + lane;
+        }
+    }
+#endif
+    while (i < end && items[i] == item) i++;
+    return i;
+}
+
+
+
+void FF_ReduceItemBuffers(const FF_Reducer *r, FF_Row *row, int numBuffers,
+                          const unsigned int *const itemBufs[], const double *const rowPrefixSums[],
+                          const int widths[], const int heights[])
+// Sum the delta form factors of each item seen in the item buffers into row.
+{
+    // Cut the buffers into bands of rows.
+    std::vector<int> bandBuffer, bandFirstRow;
+    for (int b = 0; b < numBuffers; b++)
+        for (int y = 0; y < heights[b]; y += BAND_ROWS)
+        {
+            bandBuffer.push_back(b);
+            bandFirstRow.push_back(y);
+        }
+
+    int numBands = (int)bandBuffer.size();
+    std::vector< std::vector<int> > bandItems(numBands);
+    std::vector< std::vector<float> > bandSums(numBands);
+
+    // Phase 1: reduce each band into a sparse list, using the worker's dense accumulator.
+    TP_ParallelFor(numBands, [&](int band, int worker) {
+        float *sums = r->sums[worker];
+        int b = bandBuffer[band];
+        int width = widths[b];
+        int lastRow = Min2(bandFirstRow[band] + BAND_ROWS, heights[b]);
+        std::vector<int> &seen = bandItems[band];
+
+        for (int y = bandFirstRow[band]; y < lastRow; y++)
+        {
+            const unsigned int *items = &itemBufs[b][y * width];
+            const double *prefix = &rowPrefixSums[b][y * (width + 1)];
+
+            // Decode the row into runs of the same item.
+            for (int x = 0; x < width; )
+            {
+                int runEnd = FindRunEnd(items, x, width);
+                unsigned int g = items[x];
+                if (g < (unsigned int)r->numItems)
+                {
+                    if (sums[g] == 0.0f) seen.push_back((int)g);
+                    sums[g] += (float)(prefix[runEnd] - prefix[x]);
+                }
+                x = runEnd;
+            }
+        }
+
+        bandSums[band].resize(seen.size());
+        for (size_t j = 0; j < seen.size(); j++)
+        {
+            bandSums[band][j] = sums[seen[j]];
+            sums[seen[j]] = 0.0f;
+        }
+    });
+
+    // Phase 2: merge the bands in order.
+    float *sums = r->sums[TP_CurrentWorker()];
+    FF_RowClear(row);
+
+    for (int band = 0; band < numBands; band++)
+        for (size_t j = 0; j < bandItems[band].size(); j++)
+        {
+            int g = bandItems[band][j];
+            if (sums[g] == 0.0f) FF_RowAppend(row, g, 0.0f);
+            sums[g] += bandSums[band][j];
+        }
+
+    for (int e = 0; e < row->numEntries; e++)
+    {
+        row->formFactors[e] = sums[row->gatherers[e]];
+        sums[row->gatherers[e]] = 0.0f;
+    }
+}
+
+
+
+float FF_PolygonToPointFormFactor(const float point[3], const float normal[3], int numVerts, const float verts[][3])
+// The exact unoccluded form factor from a differential area at point to a planar convex polygon.
+{
+    // The point must be in front of the polygon. A polygon coplanar with the point can fall a
+    // rounding error in front of it, and would then get a spurious form factor from the clipping
+    // below, so the point must be in front by more than a tolerance relative to both the distance
+    // and the magnitude of the coordinates, which bounds the rounding error of the vertices.
+    float e1[3], e2[3], polyNormal[3], r0[3];
+    VecDiff(e1, verts[1], verts[0]);
+    VecDiff(e2, verts[2], verts[0]);
+    VecCrossProd(polyNormal, e1, e2);
+    VecDiff(r0, verts[0], point);
+    float pointLen = VecLen(point);
+    if (VecDotProd(polyNormal, r0) >= -COPLANAR_EPSILON * VecLen(polyNormal) * (VecLen(r0) + pointLen))
+        return 0.0f;
+
+    // Vertices relative to point, clipped to the half-space above the differential area.
+    // The polygon must also rise above the plane of the differential area by more than the
+    // tolerance, or it is coplanar with it.
+    double r[5][3];
+    int n = 0;
+    bool above = false;
+    for (int i = 0; i < numVerts; i++)
+    {
+        const float *a = verts[i], *b = verts[(i + 1) % numVerts];
+        double ra[3] = { a[0] - point[0], a[1] - point[1], a[2] - point[2] };
+        double rb[3] = { b[0] - point[0], b[1] - point[1], b[2] - point[2] };
+        double ha = ra[0] * normal[0] + ra[1] * normal[1] + ra[2] * normal[2];
+        double hb = rb[0] * normal[0] + rb[1] * normal[1] + rb[2] * normal[2];
+        if (ha > COPLANAR_EPSILON * (sqrt(ra[0] * ra[0] + ra[1] * ra[1] + ra[2] * ra[2]) + pointLen)) above = true;
+
+        if (ha >= 0.0 && n < 5)
+        {
+            r[n][0] = ra[0]; r[n][1] = ra[1]; r[n][2] = ra[2];
+            n++;
+        }
+        if ((ha >= 0.0) != (hb >= 0.0) && n < 5)
+        {
+            double t = ha / (ha - hb);
+            for (int k = 0; k < 3; k++) r[n][k] = ra[k] + t * (rb[k] - ra[k]);
+            n++;
+        }
+    }
+    if (n < 3 || !above) return 0.0f;
+
+    // Lambert: F = 1/(2 pi) * sum over the edges of the angle subtended by the edge times the
+    // cosine between normal and the normal of the plane through the point and the edge.
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        const double *a = r[i], *b = r[(i + 1) % n];
+        double c[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+        double cLen = sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+        double aLen = sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+        double bLen = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+        if (cLen <= 0.0 || aLen <= 0.0 || bLen <= 0.0) continue;
+
+        double angle = atan2(cLen, a[0] * b[0] + a[1] * b[1] + a[2] * b[2]);
+        sum += angle * (c[0] * normal[0] + c[1] * normal[1] + c[2] * normal[2]) / cLen;
+    }
+    return (float)(fabs(sum) / (2.0 * M_PI));
+}
@@ -0,0 +1,69 @@
+#ifndef _FORMFACTOR_H_
+#define _FORMFACTOR_H_
+
+// Reduction of hemicube item buffers to per-gatherer form factors.
+// Instead of updating the gatherer quads pixel by pixel, the delta form factors of all
+// the pixels that see the same gatherer are first summed up into a sparse row of
+// (gatherer ID, form factor) pairs. The radiosity updates are then applied once per
+// gatherer that appears in the row.
+// Item buffers mostly consist of long horizontal runs of the same item, so each pixel row
+// is decoded into runs, and the delta form factor of a whole run is obtained with a single
+// subtraction from a table of per-row prefix sums.
+
+
+typedef struct FF_Row {
+    int numEntries;         // Number of gatherers in the row.
+    int capacity;           // Allocated length of the arrays.
+    int *gatherers;         // Gatherer IDs, in the order they are first seen.
+    float *formFactors;     // Sum of the delta form factors of the pixels that see each gatherer.
+}
+FF_Row;
+
+
+typedef struct FF_Reducer {
+    int numItems;           // Item IDs from 0 to (numItems - 1) are valid; all others are ignored.
+    int numWorkers;         // Number of thread pool workers, each with its own accumulator.
+    float **sums;           // Dense per-worker accumulators of numItems elements, kept zeroed.
+}
+FF_Reducer;
+
+
+
+extern FF_Row FF_RowInit(void);
+extern void FF_RowCleanUp(FF_Row *row);
+
+extern void FF_RowClear(FF_Row *row);
+// Make the row empty, keeping its memory.
+
+extern void FF_RowAppend(FF_Row *row, int gatherer, float formFactor);
+
+
+extern FF_Reducer FF_ReducerInit(int numItems);
+// Allocate an accumulator for every worker of the thread pool.
+// Must be called after TP_Init().
+
+extern void FF_ReducerCleanUp(FF_Reducer *r);
+
+extern void FF_ComputeRowPrefixSums(double prefixSums[], const float deltaFormFactors[], int width, int height);
+// Compute the prefix sums of each row of a (width x height) table of delta form factors.
+// prefixSums[] must have (width + 1) x height elements. Element y * (width + 1) + x is
+// the sum of the delta form factors of the first x pixels of row y.
+
+extern void FF_ReduceItemBuffers(const FF_Reducer *r, FF_Row *row, int numBuffers,
+                                 const unsigned int *const itemBufs[], const double *const rowPrefixSums[],
+                                 const int widths[], const int heights[]);
+// Sum the delta form factors of each item seen in the item buffers into row.
+// Item buffer b is widths[b] x heights[b] pixels, and rowPrefixSums[b] are the row prefix
+// sums of its delta form factors, as computed by FF_ComputeRowPrefixSums().
+// The buffers are cut into bands of rows that are reduced in parallel and then merged
+// in a fixed order, so the result does not depend on the thread scheduling.
+// Can be called concurrently from different tasks of the same TP_ParallelFor().
+
+extern float FF_PolygonToPointFormFactor(const float point[3], const float normal[3], int numVerts, const float verts[][3]);
+// The exact unoccluded form factor from a differential area at point, facing normal, to a
+// planar convex polygon of up to 4 vertices, using Lambert's contour integral formula.
+// The part of the polygon below the plane of the differential area is clipped away.
+// Returns 0 if the point is behind the polygon, as seen from the side its normal points to
+// by the vertex order (counter-clockwise from the front).
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "common.h"
+#include "glcontext.h"
+
+#ifdef GLC_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifdef __APPLE__
+#include <dlfcn.h>
+#endif
+
+
+// OpenGL 3.0 / ARB_framebuffer_object definitions, which the OpenGL 1.1
+// headers on some platforms do not have.
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#ifndef GL_FRAMEBUFFER
+#define GL_FRAMEBUFFER                  0x8D40
+#define GL_RENDERBUFFER                 0x8D41
+#define GL_COLOR_ATTACHMENT0            0x8CE0
+#define GL_DEPTH_ATTACHMENT             0x8D00
+#define GL_FRAMEBUFFER_COMPLETE         0x8CD5
+#define GL_MAX_RENDERBUFFER_SIZE        0x84E8
+#endif
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER            0x88EB
+#define GL_STREAM_READ                  0x88E1
+#define GL_READ_ONLY                    0x88B8
+#endif
+
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24            0x81A6
+#endif
+
+typedef void (APIENTRY *GenFramebuffersFunc)(GLsizei n, GLuint *ids);
+typedef void (APIENTRY *DeleteFramebuffersFunc)(GLsizei n, const GLuint *ids);
+typedef void (APIENTRY *BindFramebufferFunc)(GLenum target, GLuint id);
+typedef GLenum (APIENTRY *CheckFramebufferStatusFunc)(GLenum target);
+typedef void (APIENTRY *FramebufferRenderbufferFunc)(GLenum target, GLenum attachment, GLenum rbTarget, GLuint rb);
+typedef void (APIENTRY *GenRenderbuffersFunc)(GLsizei n, GLuint *ids);
+typedef void (APIENTRY *DeleteRenderbuffersFunc)(GLsizei n, const GLuint *ids);
+typedef void (APIENTRY *BindRenderbufferFunc)(GLenum target, GLuint id);
+typedef void (APIENTRY *RenderbufferStorageFunc)(GLenum target, GLenum format, GLsizei width, GLsizei height);
+typedef void (APIENTRY *GenBuffersFunc)(GLsizei n, GLuint *ids);
+typedef void (APIENTRY *DeleteBuffersFunc)(GLsizei n, const GLuint *ids);
+typedef void (APIENTRY *BindBufferFunc)(GLenum target, GLuint id);
+typedef void (APIENTRY *BufferDataFunc)(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void *(APIENTRY *MapBufferFunc)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY *UnmapBufferFunc)(GLenum target);
+
+static GenFramebuffersFunc glcGenFramebuffers = NULL;
+static DeleteFramebuffersFunc glcDeleteFramebuffers = NULL;
+static BindFramebufferFunc glcBindFramebuffer = NULL;
+static CheckFramebufferStatusFunc glcCheckFramebufferStatus = NULL;
+static FramebufferRenderbufferFunc glcFramebufferRenderbuffer = NULL;
+static GenRenderbuffersFunc glcGenRenderbuffers = NULL;
+static DeleteRenderbuffersFunc glcDeleteRenderbuffers = NULL;
+static BindRenderbufferFunc glcBindRenderbuffer = NULL;
+static RenderbufferStorageFunc glcRenderbufferStorage = NULL;
+static GenBuffersFunc glcGenBuffers = NULL;
+static DeleteBuffersFunc glcDeleteBuffers = NULL;
+static BindBufferFunc glcBindBuffer = NULL;
+static BufferDataFunc glcBufferData = NULL;
+static MapBufferFunc glcMapBuffer = NULL;
+static UnmapBufferFunc glcUnmapBuffer = NULL;
+
+
+#ifdef GLC_HAVE_EGL
+static EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+static EGLContext eglContext = EGL_NO_CONTEXT;
+#endif
+
+static bool headless = false;   // Is the current context a headless one?
+
+
+
+void GLC_CreateHeadlessContext(void)
+// Create a headless OpenGL context and make it current.
+{
+#ifdef GLC_HAVE_EGL
+    // Prefer the surfaceless platform, which does not try to connect to any display.
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL)
+        eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (eglDisplay == EGL_NO_DISPLAY)
+        eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor))
+        ShowFatalError(__FILE__, __LINE__, "Cannot initialize EGL (error 0x%x)", eglGetError());
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+        ShowFatalError(__FILE__, __LINE__, "EGL does not support desktop OpenGL");
+
+    // Any config will do, as all rendering goes to framebuffer objects.
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint numConfigs = 0;
+    eglChooseConfig(eglDisplay, configAttribs, &config, 1, &numConfigs);
+
+    // A context without config needs EGL_KHR_no_config_context.
+    eglContext = eglCreateContext(eglDisplay, (numConfigs > 0) ? config : (EGLConfig)0, EGL_NO_CONTEXT, NULL);
+    if (eglContext == EGL_NO_CONTEXT)
+        ShowFatalError(__FILE__, __LINE__, "Cannot create EGL context (error 0x%x)", eglGetError());
+
+    // Needs EGL_KHR_surfaceless_context.
+    if (!eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+        ShowFatalError(__FILE__, __LINE__, "Cannot make surfaceless EGL context current (error 0x%x)", eglGetError());
+
+    headless = true;
+    printf("EGL %d.%d, OpenGL %s (%s)\n", major, minor, (const char *)glGetString(GL_VERSION),
+           (const char *)glGetString(GL_RENDERER));
+#else
+    ShowFatalError(__FILE__, __LINE__, "Headless OpenGL contexts are not supported on this platform");
+#endif
+}
+
+
+void GLC_DestroyHeadlessContext(void)
+{
+#ifdef GLC_HAVE_EGL
+    if (eglDisplay == EGL_NO_DISPLAY) return;
+    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (eglContext != EGL_NO_CONTEXT) eglDestroyContext(eglDisplay, eglContext);
+    eglTerminate(eglDisplay);
+    eglDisplay = EGL_NO_DISPLAY;
+    eglContext = EGL_NO_CONTEXT;
+    headless = false;
+#endif
+}
+
+
+
+static void *LoadGLFunction(const char *name)
+// Look up an OpenGL entry point of the current context.
+{
+    void *proc = NULL;
+#ifdef GLC_HAVE_EGL
+    if (headless) proc = (void *)eglGetProcAddress(name);
+#endif
+#ifdef __APPLE__
+    if (proc == NULL) proc = dlsym(RTLD_DEFAULT, name);
+#else
+    if (proc == NULL) proc = (void *)glutGetProcAddress(name);
+#endif
+    if (proc == NULL) ShowFatalError(__FILE__, __LINE__, "Cannot load OpenGL function %s", name);
+    return proc;
+}
+
+
+void GLC_LoadFunctions(void)
+// Load the OpenGL entry points beyond OpenGL 1.1 that are used here.
+{
+    glcGenFramebuffers = (GenFramebuffersFunc)LoadGLFunction("glGenFramebuffers");
+    glcDeleteFramebuffers = (DeleteFramebuffersFunc)LoadGLFunction("glDeleteFramebuffers");
+    glcBindFramebuffer = (BindFramebufferFunc)LoadGLFunction("glBindFramebuffer");
+    glcCheckFramebufferStatus = (CheckFramebufferStatusFunc)LoadGLFunction("glCheckFramebufferStatus");
+    glcFramebufferRenderbuffer = (FramebufferRenderbufferFunc)LoadGLFunction("glFramebufferRenderbuffer");
+    glcGenRenderbuffers = (GenRenderbuffersFunc)LoadGLFunction("glGenRenderbuffers");
+    glcDeleteRenderbuffers = (DeleteRenderbuffersFunc)LoadGLFunction("glDeleteRenderbuffers");
+    glcBindRenderbuffer = (BindRenderbufferFunc)LoadGLFunction("glBindRenderbuffer");
+    glcRenderbufferStorage = (RenderbufferStorageFunc)LoadGLFunction("glRenderbufferStorage");
+    glcGenBuffers = (GenBuffersFunc)LoadGLFunction("glGenBuffers");
+    glcDeleteBuffers = (DeleteBuffersFunc)LoadGLFunction("glDeleteBuffers");
+    glcBindBuffer = (BindBufferFunc)LoadGLFunction("glBindBuffer");
+    glcBufferData = (BufferDataFunc)LoadGLFunction("glBufferData");
+    glcMapBuffer = (MapBufferFunc)LoadGLFunction("glMapBuffer");
+    glcUnmapBuffer = (UnmapBufferFunc)LoadGLFunction("glUnmapBuffer");
+}
+
+
+
+GLC_Framebuffer GLC_CreateFramebuffer(int width, int height)
+// Create a framebuffer object with a color and a depth buffer, and bind it
+// for both drawing and reading.
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+    if (width > maxSize || height > maxSize)
+        ShowFatalError(__FILE__, __LINE__, "Framebuffer size %d x %d exceeds the maximum of %d", width, height, maxSize);
+
+    GLC_Framebuffer fb;
+    fb.width = width;
+    fb.height = height;
+
+    glcGenRenderbuffers(1, &fb.colorBuffer);
+    glcBindRenderbuffer(GL_RENDERBUFFER, fb.colorBuffer);
+    glcRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glcGenRenderbuffers(1, &fb.depthBuffer);
+    glcBindRenderbuffer(GL_RENDERBUFFER, fb.depthBuffer);
+    glcRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glcGenFramebuffers(1, &fb.fbo);
+    glcBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glcFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, fb.colorBuffer);
+    glcFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, fb.depthBuffer);
+
+    if (glcCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        ShowFatalError(__FILE__, __LINE__, "Framebuffer object is incomplete");
+
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    return fb;
+}
+
+
+void GLC_DestroyFramebuffer(GLC_Framebuffer *fb)
+{
+    if (fb == NULL || fb->fbo == 0) return;
+    glcBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glcDeleteFramebuffers(1, &fb->fbo);
+    glcDeleteRenderbuffers(1, &fb->colorBuffer);
+    glcDeleteRenderbuffers(1, &fb->depthBuffer);
+    fb->fbo = fb->colorBuffer = fb->depthBuffer = 0;
+}
+
+
+
+GLuint GLC_CreatePixelPackBuffer(int numBytes)
+// Create a pixel pack buffer object (PBO) of numBytes bytes for asynchronous readback.
+{
+    GLuint pbo = 0;
+    glcGenBuffers(1, &pbo);
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glcBufferData(GL_PIXEL_PACK_BUFFER, numBytes, NULL, GL_STREAM_READ);
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (pbo == 0) ShowFatalError(__FILE__, __LINE__, "Cannot create pixel pack buffer");
+    return pbo;
+}
+
+
+void GLC_DestroyPixelPackBuffer(GLuint *pbo)
+{
+    if (pbo == NULL || *pbo == 0) return;
+    glcDeleteBuffers(1, pbo);
+    *pbo = 0;
+}
+
+
+void GLC_ReadPixelsToBuffer(GLuint pbo, int x, int y, int width, int height, GLenum format, GLenum type)
+// Start reading a region of the current read buffer into a pixel pack buffer.
+{
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glReadPixels(x, y, width, height, format, type, (void *)0);
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+
+const void *GLC_MapPixelPackBuffer(GLuint pbo)
+// Map the pixel pack buffer for reading by the CPU, waiting for any pending readback into it.
+{
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    const void *data = glcMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (data == NULL) ShowFatalError(__FILE__, __LINE__, "Cannot map pixel pack buffer");
+    return data;
+}
+
+
+void GLC_UnmapPixelPackBuffer(GLuint pbo)
+{
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glcUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glcBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
@@ -0,0 +1,63 @@
+#ifndef _GLCONTEXT_H_
+#define _GLCONTEXT_H_
+
+#ifdef __APPLE__
+#define GL_SILENCE_DEPRECATION
+#include <GLUT/glut.h>
+#else
+#include <GL/freeglut.h>
+#endif
+
+// OpenGL context and offscreen framebuffer support.
+// The hemicube faces are rendered into an offscreen framebuffer object (FBO) whose size
+// does not depend on any window. The OpenGL context is either the one of a GLUT window,
+// or a headless context made with EGL without any surface, which needs no X server
+// (e.g. Mesa's llvmpipe software renderer on a machine without display or GPU).
+
+#if defined(__linux__) && !defined(GLC_NO_EGL)
+#define GLC_HAVE_EGL    // Headless contexts are available.
+#endif
+
+
+typedef struct GLC_Framebuffer {
+    GLuint fbo;             // Framebuffer object.
+    GLuint colorBuffer;     // RGBA8 color renderbuffer.
+    GLuint depthBuffer;     // Depth renderbuffer.
+    int width, height;      // Size in pixels.
+}
+GLC_Framebuffer;
+
+
+
+extern void GLC_CreateHeadlessContext(void);
+// Create a headless OpenGL context and make it current.
+// Shows a fatal error if this is not possible.
+
+extern void GLC_DestroyHeadlessContext(void);
+
+extern void GLC_LoadFunctions(void);
+// Load the OpenGL entry points beyond OpenGL 1.1 that are used here.
+// Must be called after a context has been made current.
+
+extern GLC_Framebuffer GLC_CreateFramebuffer(int width, int height);
+// Create a framebuffer object with a color and a depth buffer, and bind it
+// for both drawing and reading.
+
+extern void GLC_DestroyFramebuffer(GLC_Framebuffer *fb);
+
+extern GLuint GLC_CreatePixelPackBuffer(int numBytes);
+// Create a pixel pack buffer object (PBO) of numBytes bytes for asynchronous readback.
+
+extern void GLC_DestroyPixelPackBuffer(GLuint *pbo);
+
+extern void GLC_ReadPixelsToBuffer(GLuint pbo, int x, int y, int width, int height, GLenum format, GLenum type);
+// Start reading a region of the current read buffer into a pixel pack buffer.
+// Returns without waiting for the rendering or the transfer to finish.
+
+extern const void *GLC_MapPixelPackBuffer(GLuint pbo);
+// Map the pixel pack buffer for reading by the CPU, waiting for any pending readback into it.
+// The pointer is valid until GLC_UnmapPixelPackBuffer() is called.
+
+extern void GLC_UnmapPixelPackBuffer(GLuint pbo);
+
+#endif
@@ -0,0 +1,485 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "common.h"
+#include "vector3.h"
+#include "quadmodel.h"
+#include "threadpool.h"
+#include "hemicube.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HC_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+#define TILE_SIZE       64      // Width and height of a tile in pixels. Must be a multiple of 4.
+#define MAX_CLIP_VERTS  12      // A quad clipped by 6 planes has at most 4 + 6 vertices.
+
+
+// A triangle that is ready for rasterization on a face.
+// The vertices are in pixel coordinates and are counter-clockwise.
+typedef struct HC_Triangle {
+    float x[3], y[3];       // Pixel coordinates of the vertices.
+    float z0, dzdx, dzdy;   // Plane equation of 1/w, relative to vertex 0.
+    int minX, minY, maxX, maxY;     // Bounding box in pixels, inclusive.
+    unsigned int item;
+}
+HC_Triangle;
+
+
+// Triangles and tile bins of a face.
+typedef struct HC_FaceWork {
+    std::vector<HC_Triangle> tris;
+    std::vector< std::vector<int> > bins;   // Indices of triangles overlapping each tile.
+    int width, height;                      // Face size in pixels.
+    int tilesX, tilesY;                     // Number of tiles across and down the face.
+}
+HC_FaceWork;
+
+
+struct HC_Workspace {
+    HC_FaceWork face[HC_NUM_FACES];
+};
+
+
+
+HC_Scene HC_SceneInit(const QM_Model *m)
+// Make a scene of all the gatherer quads of the model.
+// The item ID of each gatherer quad is its index in m->gatherers[].
+{
+    HC_Scene sc;
+    sc.numQuads = m->totalGatherers;
+    sc.quads = (float (*)[4][3])CheckedMalloc(sizeof(float) * 12 * (sc.numQuads > 0 ? sc.numQuads : 1));
+
+    for (int q = 0; q < m->totalGatherers; q++)
+        QM_GathererVertices(m->gatherers[q], sc.quads[q]);
+
+    return sc;
+}
+
+
+void HC_SceneCleanUp(HC_Scene *sc)
+{
+    if (sc == NULL) return;
+    free(sc->quads);
+    sc->quads = NULL;
+    sc->numQuads = 0;
+}
+
+
+
+HC_Hemicube HC_HemicubeInit(int res)
+// Allocate the buffers of a hemicube of the given resolution.
+{
+    if (res <= 0 || res % 2 != 0)
+        ShowFatalError(__FILE__, __LINE__, "Hemicube resolution must be a positive even number");
+
+    HC_Hemicube hc;
+    hc.res = res;
+    hc.work = new HC_Workspace;
+
+    for (int f = 0; f < HC_NUM_FACES; f++)
+    {
+        HC_FaceWork *fw = &(hc.work->face[f]);
+        fw->width = res;
+        fw->height = (f == 0) ? res : res / 2;
+        fw->tilesX = (fw->width + TILE_SIZE - 1) / TILE_SIZE;
+        fw->tilesY = (fw->height + TILE_SIZE - 1) / TILE_SIZE;
+        fw->bins.resize(fw->tilesX * fw->tilesY);
+
+        hc.items[f] = (unsigned int *)CheckedMalloc(sizeof(unsigned int) * fw->width * fw->height);
+        hc.depth[f] = (float *)CheckedMalloc(sizeof(float) * fw->width * fw->height);
+    }
+    return hc;
+}
+
+
+void HC_HemicubeCleanUp(HC_Hemicube *hc)
+{
+    if (hc == NULL) return;
+    for (int f = 0; f < HC_NUM_FACES; f++)
+    {
+        free(hc->items[f]);
+        free(hc->depth[f]);
+        hc->items[f] = NULL;
+        hc->depth[f] = NULL;
+    }
+    delete hc->work;
+    hc->work = NULL;
+    hc->res = 0;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// TRIANGLE SETUP
+/////////////////////////////////////////////////////////////////////////////
+
+// A vertex in the camera space of a face: x is to the right, y is up,
+// and w is the distance along the view direction.
+typedef struct ClipVert {
+    float x, y, w;
+}
+ClipVert;
+
+
+static inline float ClipPlaneDist(const ClipVert *v, int plane, float nearPlane, float farPlane, float bottom)
+// Signed distance of v to one of the 6 frustum planes. Inside if >= 0.
+// bottom is -1 for the top face, and 0 for a side face, which only covers the upper half.
+{
+    switch (plane)
+    {
+    case 0: return v->w - nearPlane;
+    case 1: return farPlane - v->w;
+    case 2: return v->x + v->w;
+    case 3: return v->w - v->x;
+    case 4: return v->y - bottom * v->w;
+    default: return v->w - v->y;
+    }
+}
+
+
+static int ClipPolygon(ClipVert poly[MAX_CLIP_VERTS], int n, float nearPlane, float farPlane, float bottom)
+// Clip the convex polygon against the face's view frustum (Sutherland-Hodgman).
+// Returns the number of vertices left.
+{
+    ClipVert tmp[MAX_CLIP_VERTS];
+
+    for (int plane = 0; plane < 6 && n >= 3; plane++)
+    {
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const ClipVert *a = &poly[i];
+            const ClipVert *b = &poly[(i + 1) % n];
+            float da = ClipPlaneDist(a, plane, nearPlane, farPlane, bottom);
+            float db = ClipPlaneDist(b, plane, nearPlane, farPlane, bottom);
+
+            if (da >= 0.0f) tmp[m++] = *a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+            {
+                float t = da / (da - db);
+                tmp[m].x = a->x + t * (b->x - a->x);
+                tmp[m].y = a->y + t * (b->y - a->y);
+                tmp[m].w = a->w + t * (b->w - a->w);
+                m++;
+            }
+        }
+        n = m;
+        for (int i = 0; i < n; i++) poly[i] = tmp[i];
+    }
+    return n;
+}
+
+
+static void AddTriangle(HC_FaceWork *fw, const float sx[3], const float sy[3], const float sz[3], unsigned int item)
+// Set up a screen-space triangle for rasterization, and add it to the face.
+{
+    HC_Triangle tri;
+    tri.item = item;
+
+    // Make the triangle counter-clockwise; drop it if it is degenerate.
+    float area2 = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+    if (area2 == 0.0f) return;
+    int i1 = (area2 > 0.0f) ? 1 : 2;
+    int i2 = (area2 > 0.0f) ? 2 : 1;
+    if (area2 < 0.0f) area2 = -area2;
+
+    float z[3];
+    tri.x[0] = sx[0];  tri.y[0] = sy[0];  z[0] = sz[0];
+    tri.x[1] = sx[i1]; tri.y[1] = sy[i1]; z[1] = sz[i1];
+    tri.x[2] = sx[i2]; tri.y[2] = sy[i2]; z[2] = sz[i2];
+
+    tri.z0 = z[0];
+    tri.dzdx = ((z[1] - z[0]) * (tri.y[2] - tri.y[0]) - (z[2] - z[0]) * (tri.y[1] - tri.y[0])) / area2;
+    tri.dzdy = ((z[2] - z[0]) * (tri.x[1] - tri.x[0]) - (z[1] - z[0]) * (tri.x[2] - tri.x[0])) / area2;
+
+    // Bounding box of the pixel centers that may be covered.
+    float minX = Min3(tri.x[0], tri.x[1], tri.x[2]);
+    float maxX = Max3(tri.x[0], tri.x[1], tri.x[2]);
+    float minY = Min3(tri.y[0], tri.y[1], tri.y[2]);
+    float maxY = Max3(tri.y[0], tri.y[1], tri.y[2]);
+    tri.minX = Max2((int)floorf(minX - 0.5f), 0);
+    tri.minY = Max2((int)floorf(minY - 0.5f), 0);
+    tri.maxX = Min2((int)ceilf(maxX - 0.5f), fw->width - 1);
+    tri.maxY = Min2((int)ceilf(maxY - 0.5f), fw->height - 1);
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) return;
+
+    fw->tris.push_back(tri);
+}
+
+
+static void SetupFace(HC_FaceWork *fw, const HC_Scene *sc, const float eye[3], const float right[3],
+                      const float up[3], const float forward[3], float nearPlane, float farPlane, bool isTopFace)
+// Transform, clip and project all the quads of the scene for one face, and bin the
+// resulting triangles into the tiles of the face.
+{
+    const float bottom = isTopFace ? -1.0f : 0.0f;
+    const float halfWidth = 0.5f * fw->width;
+    const float yOffset = isTopFace ? 1.0f : 0.0f;
+
+    fw->tris.clear();
+
+    for (int q = 0; q < sc->numQuads; q++)
+    {
+        ClipVert poly[MAX_CLIP_VERTS];
+        unsigned int outsideAll = 0x3F, outsideAny = 0;
+
+        for (int i = 0; i < 4; i++)
+        {
+            float d[3];
+            VecDiff(d, sc->quads[q][i], eye);
+            poly[i].x = VecDotProd(d, right);
+            poly[i].y = VecDotProd(d, up);
+            poly[i].w = VecDotProd(d, forward);
+
+            unsigned int outside = 0;
+            for (int plane = 0; plane < 6; plane++)
+                if (ClipPlaneDist(&poly[i], plane, nearPlane, farPlane, bottom) < 0.0f) outside |= (1u << plane);
+            outsideAll &= outside;
+            outsideAny |= outside;
+        }
+
+        if (outsideAll != 0) continue;  // All vertices are outside the same plane.
+
+        int n = 4;
+        if (outsideAny != 0) n = ClipPolygon(poly, n, nearPlane, farPlane, bottom);
+        if (n < 3) continue;
+
+        // Project to pixel coordinates. 1/w is linear in screen space.
+        float sx[MAX_CLIP_VERTS], sy[MAX_CLIP_VERTS], sz[MAX_CLIP_VERTS];
+        for (int i = 0; i < n; i++)
+        {
+            float invW = 1.0f / poly[i].w;
+            sx[i] = (poly[i].x * invW + 1.0f) * halfWidth;
+            sy[i] = (poly[i].y * invW + yOffset) * halfWidth;
+            sz[i] = invW;
+        }
+
+        // Triangulate as a fan.
+        for (int i = 1; i + 1 < n; i++)
+        {
+            float tx[3] = { sx[0], sx[i], sx[i + 1] };
+            float ty[3] = { sy[0], sy[i], sy[i + 1] };
+            float tz[3] = { sz[0], sz[i], sz[i + 1] };
+            AddTriangle(fw, tx, ty, tz, (unsigned int)q);
+        }
+    }
+
+    // Bin the triangles, keeping them in drawing order within each bin.
+    for (size_t b = 0; b < fw->bins.size(); b++) fw->bins[b].clear();
+
+    for (int t = 0; t < (int)fw->tris.size(); t++)
+    {
+        const HC_Triangle *tri = &(fw->tris[t]);
+        for (int ty = tri->minY / TILE_SIZE; ty <= tri->maxY / TILE_SIZE; ty++)
+            for (int tx = tri->minX / TILE_SIZE; tx <= tri->maxX / TILE_SIZE; tx++)
+                fw->bins[ty * fw->tilesX + tx].push_back(t);
+    }
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// RASTERIZATION
+/////////////////////////////////////////////////////////////////////////////
+
+// Edge function of a triangle edge.
+// To make adjacent triangles meet without cracks or overlaps, the edge function of a shared
+// edge is always evaluated from the same canonical endpoint, and the result is then multiplied
+// by sign. Both triangles thus compute exactly opposite values for any pixel.
+// A pixel exactly on an edge belongs to the triangle for which the edge is an "owner" edge.
+typedef struct EdgeFunc {
+    float a, b;         // E(px, py) = sign * (a * (px - x0) + b * (py - y0)).
+    float x0, y0;
+    float sign;
+    bool owner;
+}
+EdgeFunc;
+
+
+static void SetupEdge(EdgeFunc *e, float ax, float ay, float bx, float by)
+// Edge from (ax, ay) to (bx, by) of a counter-clockwise triangle. Inside is E > 0.
+{
+    bool swap = (bx < ax) || (bx == ax && by < ay);
+    float cx0 = swap ? bx : ax, cy0 = swap ? by : ay;
+    float cx1 = swap ? ax : bx, cy1 = swap ? ay : by;
+
+    e->a = -(cy1 - cy0);
+    e->b = cx1 - cx0;
+    e->x0 = cx0;
+    e->y0 = cy0;
+    e->sign = swap ? -1.0f : 1.0f;
+
+    float dx = bx - ax, dy = by - ay;
+    e->owner = (dy < 0.0f) || (dy == 0.0f && dx > 0.0f);
+}
+
+
+static inline bool EdgeInside(const EdgeFunc *e, float px, float py)
+{
+    float v = e->sign * (e->a * (px - e->x0) + e->b * (py - e->y0));
+    return v > 0.0f || (v == 0.0f && e->owner);
+}
+
+
+static inline void ShadePixel(const HC_Triangle *tri, const EdgeFunc edge[3], int px, int py,
+                              unsigned int *items, float *depth, int width)
+// Scalar path for a single pixel.
+{
+    float cx = px + 0.5f, cy = py + 0.5f;
+    if (!EdgeInside(&edge[0], cx, cy) || !EdgeInside(&edge[1], cx, cy) || !EdgeInside(&edge[2], cx, cy)) return;
+
+    float z = tri->z0 + tri->dzdx * (cx - tri->x[0]) + tri->dzdy * (cy - tri->y[0]);
+    int p = py * width + px;
+    if (z > depth[p])
+    {
+        depth[p] = z;
+        items[p] = tri->item;
+    }
+}
+
+
+static void RasterizeTile(HC_FaceWork *fw, unsigned int *items, float *depth, int tile)
+// Clear a tile and rasterize all the triangles in its bin.
+{
+    int tx0 = (tile % fw->tilesX) * TILE_SIZE;
+    int ty0 = (tile / fw->tilesX) * TILE_SIZE;
+    int tx1 = Min2(tx0 + TILE_SIZE, fw->width);     // Exclusive.
+    int ty1 = Min2(ty0 + TILE_SIZE, fw->height);
+    int width = fw->width;
+
+    for (int py = ty0; py < ty1; py++)
+        for (int px = tx0; px < tx1; px++)
+        {
+            items[py * width + px] = HC_BACKGROUND_ITEM;
+            depth[py * width + px] = 0.0f;
+        }
+
+    const std::vector<int> &bin = fw->bins[tile];
+
+    for (size_t b = 0; b < bin.size(); b++)
+    {
+        const HC_Triangle *tri = &(fw->tris[bin[b]]);
+
+        int x0 = Max2(tri->minX, tx0), x1 = Min2(tri->maxX, tx1 - 1);
+        int y0 = Max2(tri->minY, ty0), y1 = Min2(tri->maxY, ty1 - 1);
+        if (x0 > x1 || y0 > y1) continue;
+
+        EdgeFunc edge[3];
+        SetupEdge(&edge[0], tri->x[0], tri->y[0], tri->x[1], tri->y[1]);
+        SetupEdge(&edge[1], tri->x[1], tri->y[1], tri->x[2], tri->y[2]);
+        SetupEdge(&edge[2], tri->x[2], tri->y[2], tri->x[0], tri->y[0]);
+
+#ifdef HC_USE_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 laneOffset = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        const __m128 laneIndex = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        __m128 ea[3], ex0[3], esign[3], eowner[3];
+        for (int i = 0; i < 3; i++)
+        {
+            ea[i] = _mm_set1_ps(edge[i].a);
+            ex0[i] = _mm_set1_ps(edge[i].x0);
+            esign[i] = _mm_set1_ps(edge[i].sign);
+            eowner[i] = _mm_castsi128_ps(_mm_set1_epi32(edge[i].owner ? -1 : 0));
+        }
+        const __m128 dzdx = _mm_set1_ps(tri->dzdx);
+        const __m128 vx0 = _mm_set1_ps(tri->x[0]);
+        const __m128 itemVec = _mm_castsi128_ps(_mm_set1_epi32((int)tri->item));
+        const int xStart = x0 & ~3;     // Tile edges are multiples of 4, so this stays in the tile.
+
+        for (int py = y0; py <= y1; py++)
+        {
+            float cy = py + 0.5f;
+            __m128 eb[3];
+            for (int i = 0; i < 3; i++) eb[i] = _mm_set1_ps(edge[i].b * (cy - edge[i].y0));
+            __m128 zRow = _mm_set1_ps(tri->z0 + tri->dzdy * (cy - tri->y[0]));
+            unsigned int *itemRow = items + py * width;
+            float *depthRow = depth + py * width;
+
+            for (int px = xStart; px <= x1; px += 4)
+            {
+                if (px + 4 > tx1)
+                {
+                    // Partial group at the right border of the face.
+                    for (int k = Max2(px, x0); k <= x1; k++) ShadePixel(tri, edge, k, py, items, depth, width);
+                    continue;
+                }
+
+                __m128 cx = _mm_add_ps(_mm_set1_ps((float)px), laneOffset);
+
+                // Only the lanes in [x0, x1] may be written.
+                __m128 lane = _mm_add_ps(_mm_set1_ps((float)px), laneIndex);
+                __m128 mask = _mm_and_ps(_mm_cmpge_ps(lane, _mm_set1_ps((float)x0)),
+                                         _mm_cmple_ps(lane, _mm_set1_ps((float)x1)));
+                for (int i = 0; i < 3; i++)
+                {
+                    __m128 e = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ea[i], _mm_sub_ps(cx, ex0[i])), eb[i]), esign[i]);
+                    __m128 in = _mm_or_ps(_mm_cmpgt_ps(e, zero), _mm_and_ps(_mm_cmpeq_ps(e, zero), eowner[i]));
+                    mask = _mm_and_ps(mask, in);
+                }
+                if (_mm_movemask_ps(mask) == 0) continue;
+
+                __m128 z = _mm_add_ps(zRow, _mm_mul_ps(dzdx, _mm_sub_ps(cx, vx0)));
+                __m128 oldZ = _mm_loadu_ps(depthRow + px);
+                mask = _mm_and_ps(mask, _mm_cmpgt_ps(z, oldZ));
+                if (_mm_movemask_ps(mask) == 0) continue;
+
+                __m128 oldItems = _mm_loadu_ps((const float *)(itemRow + px));
+                _mm_storeu_ps(depthRow + px, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, oldZ)));
+                _mm_storeu_ps((float *)(itemRow + px), _mm_or_ps(_mm_and_ps(mask, itemVec), _mm_andnot_ps(mask, oldItems)));
+            }
+        }
+#else
+        for (int py = y0; py <= y1; py++)
+            for (int px = x0; px <= x1; px++)
+                ShadePixel(tri, edge, px, py, items, depth, width);
+#endif
+    }
+}
+
+
+
+void HC_RenderHemicube(HC_Hemicube *hc, const HC_Scene *sc, const float eye[3], const float normal[3],
+                       const float up[3], float nearPlane, float farPlane)
+// Render the scene into the 5 faces of a hemicube placed at eye and facing normal.
+{
+    // Orthonormal frame of the hemicube, as gluLookAt() would construct it for the top face.
+    float n[3], u[3], r[3];
+    VecNormalize(n, normal);
+    VecCrossProd(r, n, up);
+    VecNormalize(r, r);
+    VecCrossProd(u, r, n);
+
+    float negU[3], negR[3];
+    VecNeg(negU, u);
+    VecNeg(negR, r);
+
+    // Forward direction of each face. The side faces use the normal as their "up" direction.
+    const float *forward[HC_NUM_FACES] = { n, negU, negR, u, r };
+
+    TP_ParallelFor(HC_NUM_FACES, [&](int f, int) {
+        if (f == 0)
+            SetupFace(&(hc->work->face[f]), sc, eye, r, u, n, nearPlane, farPlane, true);
+        else
+        {
+            float faceRight[3];
+            VecCrossProd(faceRight, forward[f], n);
+            SetupFace(&(hc->work->face[f]), sc, eye, faceRight, n, forward[f], nearPlane, farPlane, false);
+        }
+    });
+
+    // Rasterize all the tiles of all the faces.
+    int faceFirstTile[HC_NUM_FACES + 1];
+    faceFirstTile[0] = 0;
+    for (int f = 0; f < HC_NUM_FACES; f++)
+        faceFirstTile[f + 1] = faceFirstTile[f] + (int)hc->work->face[f].bins.size();
+
+    TP_ParallelFor(faceFirstTile[HC_NUM_FACES], [&](int task, int) {
+        int f = 0;
+        while (task >= faceFirstTile[f + 1]) f++;
+        RasterizeTile(&(hc->work->face[f]), hc->items[f], hc->depth[f], task - faceFirstTile[f]);
+    });
+}
@@ -0,0 +1,61 @@
+#ifndef _HEMICUBE_H_
+#define _HEMICUBE_H_
+
+#include "quadmodel.h"
+
+// Software hemicube renderer.
+// Renders the item buffers of the 5 faces of a hemicube on the CPU, without OpenGL.
+// Each face is cut into tiles, and the faces and tiles are rasterized in parallel
+// on the thread pool using an edge-function rasterizer with a 1/w depth buffer.
+// The item buffers hold the 32-bit IDs of the visible gatherer quads, in the same
+// layout that glReadPixels() returns for the corresponding OpenGL viewports.
+
+
+#define HC_BACKGROUND_ITEM  0xFFFFFFFFu // Item ID of pixels not covered by any quad.
+
+#define HC_NUM_FACES    5   // Face 0 is the top face, faces 1 to 4 are the side faces.
+
+struct HC_Workspace;    // Forward declaration. Internal per-hemicube rasterization storage.
+
+
+typedef struct HC_Scene {
+    int numQuads;           // Number of quads.
+    float (*quads)[4][3];   // Array of the 4 vertices of each quad. The array index is the item ID.
+}
+HC_Scene;
+
+
+typedef struct HC_Hemicube {
+    int res;                    // Resolution. The top face is (res x res) pixels, and each side
+                                // face is (res x res/2) pixels. Must be an even number.
+    unsigned int *items[HC_NUM_FACES];  // Item buffer of each face. Row 0 is the bottom row, which
+                                        // on a side face is the row at the base of the hemicube.
+    float *depth[HC_NUM_FACES];         // Depth buffer of each face, storing 1/depth (0 = background).
+    HC_Workspace *work;
+}
+HC_Hemicube;
+
+
+
+extern HC_Scene HC_SceneInit(const QM_Model *m);
+// Make a scene of all the gatherer quads of the model.
+// The item ID of each gatherer quad is its index in m->gatherers[].
+
+extern void HC_SceneCleanUp(HC_Scene *sc);
+
+extern HC_Hemicube HC_HemicubeInit(int res);
+// Allocate the buffers of a hemicube of the given resolution.
+// Each hemicube can only be rendered into by one thread at a time, so a separate
+// hemicube is needed for each shooter that is processed concurrently.
+
+extern void HC_HemicubeCleanUp(HC_Hemicube *hc);
+
+extern void HC_RenderHemicube(HC_Hemicube *hc, const HC_Scene *sc, const float eye[3], const float normal[3],
+                              const float up[3], float nearPlane, float farPlane);
+// Render the scene into the 5 faces of a hemicube placed at eye and facing normal.
+// up gives the "up" direction of the top face; it does not need to be perpendicular to normal.
+// The side faces 1, 2, 3 and 4 look in the directions -up, -right, +up and +right respectively,
+// where right = normal x up, and have normal as their "up" direction.
+// nearPlane is the distance of the faces from eye, and nothing beyond farPlane is rendered.
+
+#endif
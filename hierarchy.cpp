@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "common.h"
+#include "vector3.h"
+#include "threadpool.h"
+#include "formfactor.h"
+#include "hierarchy.h"
+
+
+#define CHUNK_ELEMENTS  256     // Number of elements processed by each task.
+
+
+// A link while the links are being built, before they are grouped by receiver.
+typedef struct HR_BuildLink {
+    int receiver, source;
+    float formFactor;
+}
+HR_BuildLink;
+
+
+
+static void InitElement(HR_Element *el, const float v[4][3], const float normal[3], const QM_Surface *surface,
+                        int parent, int firstChild, int numChildren, int gatherer)
+{
+    for (int i = 0; i < 4; i++) CopyArray3(el->v[i], v[i]);
+    for (int a = 0; a < 3; a++) el->centroid[a] = 0.25f * (v[0][a] + v[1][a] + v[2][a] + v[3][a]);
+    CopyArray3(el->normal, normal);
+
+    float n1[3], n2[3];
+    VecTriNormal(n1, v[0], v[1], v[2]);
+    VecTriNormal(n2, v[0], v[2], v[3]);
+    el->area = 0.5f * (VecLen(n1) + VecLen(n2));
+
+    el->surface = surface;
+    el->parent = parent;
+    el->firstChild = firstChild;
+    el->numChildren = numChildren;
+    el->gatherer = gatherer;
+    el->firstLink = 0;
+    el->numLinks = 0;
+    el->radiosity[0] = el->radiosity[1] = el->radiosity[2] = 0.0f;
+    el->gathered[0] = el->gathered[1] = el->gathered[2] = 0.0f;
+}
+
+
+
+static double PushPull(HR_Hierarchy *h, int e, const float down[3])
+// Push the radiosity gathered by the ancestors of element e (down) and by e itself to the
+// gatherer quads below e, and pull their area-weighted averages back up to e.
+// Returns the total RGB power change of the gatherer quads.
+{
+    HR_Element *el = &h->elements[e];
+    float total[3] = { down[0] + el->gathered[0], down[1] + el->gathered[1], down[2] + el->gathered[2] };
+    float newRadiosity[3];
+    double change = 0.0;
+
+    if (el->numChildren == 0)
+    {
+        for (int c = 0; c < 3; c++) newRadiosity[c] = el->surface->emission[c] + total[c];
+        change = el->area * (fabs(newRadiosity[0] - el->radiosity[0]) + fabs(newRadiosity[1] - el->radiosity[1]) +
+                             fabs(newRadiosity[2] - el->radiosity[2]));
+    }
+    else
+    {
+        double sum[3] = { 0.0, 0.0, 0.0 };
+        double areaSum = 0.0;
+        for (int i = el->firstChild; i < el->firstChild + el->numChildren; i++)
+        {
+            change += PushPull(h, i, total);
+            const HR_Element *child = &h->elements[i];
+            for (int c = 0; c < 3; c++) sum[c] += child->area * child->radiosity[c];
+            areaSum += child->area;
+        }
+        for (int c = 0; c < 3; c++) newRadiosity[c] = (areaSum > 0.0) ? (float)(sum[c] / areaSum) : total[c];
+    }
+
+    CopyArray3(el->radiosity, newRadiosity);
+    return change;
+}
+
+
+
+HR_Hierarchy HR_HierarchyInit(const QM_Model *m, const RC_Bvh *bvh, float formFactorEpsilon,
+                              int shadowSamplesPerSide, float minDist)
+// Make the element hierarchy of a subdivided model, whose radiosities are the emissions.
+{
+    HR_Hierarchy h;
+    h.numRoots = 0;
+    for (int s = 0; s < m->numSurfaces; s++) h.numRoots += m->surfaces[s].numOrigQuads;
+    h.numElements = h.numRoots + m->totalShooters + m->totalGatherers;
+    h.elements = (HR_Element *)CheckedMalloc(sizeof(HR_Element) * (h.numElements > 0 ? h.numElements : 1));
+    h.numLinks = 0;
+    h.links = NULL;
+    h.bvh = bvh;
+    h.formFactorEpsilon = formFactorEpsilon;
+    h.shadowSamplesPerSide = shadowSamplesPerSide;
+    h.minDist = minDist;
+
+    // The quads of each level are in the order of the surfaces, and the children of each quad are consecutive.
+    int shooterBase = h.numRoots;
+    int gathererBase = h.numRoots + m->totalShooters;
+    int numOrig = 0, numShooters = 0, numGatherers = 0;    // Quads of the previous surfaces.
+
+    for (int s = 0; s < m->numSurfaces; s++)
+    {
+        const QM_Surface *surface = &m->surfaces[s];
+
+        for (int q = 0; q < surface->numOrigQuads; q++)
+        {
+            const QM_OrigQuad *origQuad = &surface->origQuads[q];
+            InitElement(&h.elements[numOrig + q], origQuad->v, origQuad->normal, surface, -1,
+                        shooterBase + numShooters + origQuad->firstShooter, origQuad->numShooters[0] * origQuad->numShooters[1], -1);
+        }
+
+        for (int q = 0; q < surface->numShooterQuads; q++)
+        {
+            const QM_ShooterQuad *shooterQuad = &surface->shooters[q];
+            InitElement(&h.elements[shooterBase + numShooters + q], shooterQuad->v, shooterQuad->normal, surface,
+                        numOrig + (int)(shooterQuad->origQuad - surface->origQuads),
+                        gathererBase + numGatherers + shooterQuad->firstGatherer,
+                        shooterQuad->numGatherers[0] * shooterQuad->numGatherers[1], -1);
+        }
+
+        for (int q = 0; q < surface->numGathererQuads; q++)
+        {
+            const QM_GathererQuad *gathererQuad = &surface->gatherers[q];
+            float v[4][3];
+            QM_GathererVertices(gathererQuad, v);
+            InitElement(&h.elements[gathererBase + numGatherers + q], v, gathererQuad->shooter->normal,
+                        surface, shooterBase + numShooters + (int)(gathererQuad->shooter - surface->shooters),
+                        0, 0, numGatherers + q);
+        }
+
+        numOrig += surface->numOrigQuads;
+        numShooters += surface->numShooterQuads;
+        numGatherers += surface->numGathererQuads;
+    }
+
+    // Set the radiosities to the emissions.
+    const float zero[3] = { 0.0f, 0.0f, 0.0f };
+    for (int r = 0; r < h.numRoots; r++) PushPull(&h, r, zero);
+    return h;
+}
+
+
+void HR_HierarchyCleanUp(HR_Hierarchy *h)
+{
+    if (h == NULL) return;
+    free(h->elements);
+    free(h->links);
+    h->elements = NULL;
+    h->links = NULL;
+    h->numElements = h->numRoots = h->numLinks = 0;
+}
+
+
+
+static void Refine(const HR_Hierarchy *h, int r, int s, bool forceSplit, std::vector<HR_BuildLink> &out)
+// Link receiver element r to source element s, or if the form factor between them is too large,
+// link the children of the one that subtends the larger form factor from the other instead.
+// If forceSplit is true, the children are linked whatever the form factor.
+{
+    const HR_Element *er = &h->elements[r], *es = &h->elements[s];
+    float Frs = FF_PolygonToPointFormFactor(er->centroid, er->normal, 4, es->v);
+    float Fsr = FF_PolygonToPointFormFactor(es->centroid, es->normal, 4, er->v);
+    if (Frs <= 0.0f && Fsr <= 0.0f) return;    // They do not face each other.
+
+    bool split = forceSplit || Max2(Frs, Fsr) > h->formFactorEpsilon;
+    if (split && (er->numChildren > 0 || es->numChildren > 0))
+    {
+        if (es->numChildren > 0 && (Frs >= Fsr || er->numChildren == 0))
+            for (int c = es->firstChild; c < es->firstChild + es->numChildren; c++) Refine(h, r, c, false, out);
+        else
+            for (int c = er->firstChild; c < er->firstChild + er->numChildren; c++) Refine(h, c, s, false, out);
+        return;
+    }
+    if (Frs <= 0.0f) return;
+
+    unsigned int seed = (unsigned int)r * 73856093u ^ (unsigned int)s * 19349663u;
+    float visibility = RC_QuadVisibility(h->bvh, er->centroid, es->v, RC_MISS_ITEM, h->shadowSamplesPerSide,
+                                         h->minDist, seed);
+    if (visibility > 0.0f)
+    {
+        HR_BuildLink link = { r, s, Frs * visibility };
+        out.push_back(link);
+    }
+}
+
+
+
+static void SetLinks(HR_Hierarchy *h, const std::vector< std::vector<HR_BuildLink> > &taskLinks)
+// Replace the links by the links made by a sequence of tasks, grouping them by receiver.
+{
+    for (int e = 0; e < h->numElements; e++) h->elements[e].numLinks = 0;
+    h->numLinks = 0;
+    for (size_t t = 0; t < taskLinks.size(); t++)
+        for (size_t i = 0; i < taskLinks[t].size(); i++)
+        {
+            h->elements[taskLinks[t][i].receiver].numLinks++;
+            h->numLinks++;
+        }
+
+    int first = 0;
+    for (int e = 0; e < h->numElements; e++)
+    {
+        h->elements[e].firstLink = first;
+        first += h->elements[e].numLinks;
+        h->elements[e].numLinks = 0;
+    }
+
+    free(h->links);
+    h->links = (HR_Link *)CheckedMalloc(sizeof(HR_Link) * (h->numLinks > 0 ? h->numLinks : 1));
+    for (size_t t = 0; t < taskLinks.size(); t++)
+        for (size_t i = 0; i < taskLinks[t].size(); i++)
+        {
+            HR_Element *el = &h->elements[taskLinks[t][i].receiver];
+            HR_Link *link = &h->links[el->firstLink + el->numLinks++];
+            link->source = taskLinks[t][i].source;
+            link->formFactor = taskLinks[t][i].formFactor;
+        }
+}
+
+
+
+void HR_BuildLinks(HR_Hierarchy *h)
+// Link all the pairs of original quads, refining each link as needed.
+{
+    std::vector< std::vector<HR_BuildLink> > taskLinks(h->numRoots);
+    TP_ParallelFor(h->numRoots, [&](int r, int) {
+        for (int s = 0; s < h->numRoots; s++)
+            if (s != r) Refine(h, r, s, false, taskLinks[r]);
+    });
+    SetLinks(h, taskLinks);
+}
+
+
+
+double HR_Iterate(HR_Hierarchy *h)
+// Gather over all the links and push-pull the radiosities through the hierarchy.
+{
+    int numChunks = (h->numElements + CHUNK_ELEMENTS - 1) / CHUNK_ELEMENTS;
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_ELEMENTS, h->numElements);
+        for (int e = chunk * CHUNK_ELEMENTS; e < end; e++)
+        {
+            HR_Element *el = &h->elements[e];
+            double sum[3] = { 0.0, 0.0, 0.0 };
+            for (int i = el->firstLink; i < el->firstLink + el->numLinks; i++)
+            {
+                const HR_Link *link = &h->links[i];
+                const float *B = h->elements[link->source].radiosity;
+                for (int c = 0; c < 3; c++) sum[c] += link->formFactor * B[c];
+            }
+            for (int c = 0; c < 3; c++) el->gathered[c] = (float)(el->surface->reflectivity[c] * sum[c]);
+        }
+    });
+
+    std::vector<double> change(h->numRoots);
+    TP_ParallelFor(h->numRoots, [&](int r, int) {
+        const float zero[3] = { 0.0f, 0.0f, 0.0f };
+        change[r] = PushPull(h, r, zero);
+    });
+
+    double totalChange = 0.0;
+    for (int r = 0; r < h->numRoots; r++) totalChange += change[r];
+    return totalChange;
+}
+
+
+
+int HR_RefineLinks(HR_Hierarchy *h, float bfEpsilon)
+// Refine each link whose form factor times the source's mean RGB radiosity exceeds bfEpsilon.
+{
+    int numChunks = (h->numElements + CHUNK_ELEMENTS - 1) / CHUNK_ELEMENTS;
+    std::vector< std::vector<HR_BuildLink> > taskLinks(numChunks);
+    std::vector<int> numRefined(numChunks, 0);
+
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_ELEMENTS, h->numElements);
+        for (int e = chunk * CHUNK_ELEMENTS; e < end; e++)
+        {
+            const HR_Element *el = &h->elements[e];
+            for (int i = el->firstLink; i < el->firstLink + el->numLinks; i++)
+            {
+                const HR_Link *link = &h->links[i];
+                const HR_Element *src = &h->elements[link->source];
+                float B = (src->radiosity[0] + src->radiosity[1] + src->radiosity[2]) / 3.0f;
+
+                if (link->formFactor * B > bfEpsilon && (el->numChildren > 0 || src->numChildren > 0))
+                {
+                    Refine(h, e, link->source, true, taskLinks[chunk]);
+                    numRefined[chunk]++;
+                }
+                else
+                {
+                    HR_BuildLink kept = { e, link->source, link->formFactor };
+                    taskLinks[chunk].push_back(kept);
+                }
+            }
+        }
+    });
+
+    int totalRefined = 0;
+    for (int t = 0; t < numChunks; t++) totalRefined += numRefined[t];
+    if (totalRefined > 0) SetLinks(h, taskLinks);
+    return totalRefined;
+}
+
+
+
+void HR_StoreGathererRadiosities(const HR_Hierarchy *h, QM_Model *m)
+// Copy the radiosities of the gatherer elements to the gatherer quads of the model.
+{
+    for (int e = 0; e < h->numElements; e++)
+        if (h->elements[e].gatherer >= 0)
+            CopyArray3(m->radiosities[h->elements[e].gatherer], h->elements[e].radiosity);
+}
@@ -0,0 +1,83 @@
+#ifndef _HIERARCHY_H_
+#define _HIERARCHY_H_
+
+#include "quadmodel.h"
+#include "raycast.h"
+
+// Hierarchical radiosity.
+// The original quads, shooter quads and gatherer quads of a subdivided model form a 3-level
+// hierarchy of elements. Light is transferred along links between pairs of elements, each made
+// at the coarsest levels at which the form factor between them is small enough, so that the number
+// of links grows about linearly with the number of elements instead of quadratically.
+// Each iteration gathers the radiosity of the sources of all the links (a Jacobi step), then pushes
+// the gathered radiosity down to the gatherer quads and pulls the area-weighted averages back up.
+// Links that carry too much radiosity are refined on demand between iterations (BF refinement).
+// Form factors are point-to-polygon estimates from the receiver's centroid, scaled by the
+// visibility estimated with shadow rays.
+
+
+typedef struct HR_Element {
+    float v[4][3];          // Vertices of the quad.
+    float centroid[3];
+    float normal[3];
+    float area;
+    const QM_Surface *surface;  // Surface with the reflectivity and emission of the quad.
+    int parent;             // Index of the parent element, or -1 for an original quad.
+    int firstChild;         // Index of the first child element. The children are consecutive.
+    int numChildren;        // 0 for a gatherer quad.
+    int gatherer;           // Index in QM_Model::gatherers[] of a gatherer quad, or -1.
+    int firstLink;          // Index of the first link that the element gathers from.
+    int numLinks;
+    float radiosity[3];     // Radiosity of the element, the area-weighted average of its children.
+    float gathered[3];      // Radiosity gathered over the element's own links in the last iteration.
+}
+HR_Element;
+
+
+typedef struct HR_Link {
+    int source;             // Element whose radiosity is gathered.
+    float formFactor;       // Form factor from the receiver to the source, including visibility.
+}
+HR_Link;
+
+
+typedef struct HR_Hierarchy {
+    int numElements;        // Elements are the original quads, then the shooter quads and
+    HR_Element *elements;   // then the gatherer quads, in the order of the model.
+    int numRoots;           // Number of original quads, which are elements 0 to (numRoots - 1).
+    int numLinks;
+    HR_Link *links;         // Links, grouped by receiver element.
+
+    const RC_Bvh *bvh;      // BVH of the gatherer quads, for the visibility of the links.
+    float formFactorEpsilon;    // Links with a larger form factor in either direction are refined.
+    int shadowSamplesPerSide;   // Shadow rays per link = shadowSamplesPerSide^2.
+    float minDist;              // Occluders nearer than this to the receiver are ignored.
+}
+HR_Hierarchy;
+
+
+
+extern HR_Hierarchy HR_HierarchyInit(const QM_Model *m, const RC_Bvh *bvh, float formFactorEpsilon,
+                                     int shadowSamplesPerSide, float minDist);
+// Make the element hierarchy of a subdivided model, whose radiosities are the emissions.
+// bvh must be a BVH of the model's gatherer quads, and must stay valid while the hierarchy is used.
+
+extern void HR_HierarchyCleanUp(HR_Hierarchy *h);
+
+extern void HR_BuildLinks(HR_Hierarchy *h);
+// Link all the pairs of original quads, refining each link until its form factor in both
+// directions is at most formFactorEpsilon or it joins two gatherer quads.
+
+extern double HR_Iterate(HR_Hierarchy *h);
+// Gather over all the links and push-pull the radiosities through the hierarchy.
+// Returns the total RGB power change of the gatherer quads.
+
+extern int HR_RefineLinks(HR_Hierarchy *h, float bfEpsilon);
+// Refine each link whose form factor times the source's mean RGB radiosity exceeds bfEpsilon,
+// by linking the children of the receiver or of the source instead. Returns the number of
+// links refined.
+
+extern void HR_StoreGathererRadiosities(const HR_Hierarchy *h, QM_Model *m);
+// Copy the radiosities of the gatherer elements to the gatherer quads of the model.
+
+#endif
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "common.h"
+#include "vector3.h"
+#include "threadpool.h"
+#include "formfactor.h"
+#include "lowrank.h"
+
+
+#define LEAF_SHOOTERS   4       // Clusters of more shooter quads are split in 2.
+#define MAX_RANK        32      // Highest rank of a compressed block.
+#define ADMISSIBILITY   4.0f    // Blocks are compressed if the larger cluster diameter is at
+                                // most this times the gap between the clusters.
+
+
+
+static float FormFactor(const LR_Operator *op, int g, int s)
+// The form factor from the centroid of shooter quad s to gatherer quad g, including visibility.
+// The shadow rays are seeded by the pair, so evaluating it again gives the same value.
+{
+    const QM_ShooterQuad *shooterQuad = op->model->shooters[s];
+    float v[4][3];
+    QM_GathererVertices(op->model->gatherers[g], v);
+    float F = FF_PolygonToPointFormFactor(shooterQuad->centroid, shooterQuad->normal, 4, v);
+    if (F <= 0.0f) return 0.0f;
+    unsigned int seed = (unsigned int)s * 0x9E3779B9u ^ (unsigned int)g * 0x85EBCA6Bu;
+    return F * RC_QuadVisibility(op->bvh, shooterQuad->centroid, v, (unsigned int)g,
+                                 op->shadowSamplesPerSide, op->minDist, seed);
+}
+
+
+static bool InFront(const QM_Model *m, const LR_Cluster *a, const LR_Cluster *b, float tolerance)
+// Returns whether any vertex of the shooter quads of cluster a is in front of the plane of cluster b.
+{
+    const float *n = m->shooters[b->firstShooter]->normal;
+    const float *p = m->shooters[b->firstShooter]->v[0];
+    for (int s = a->firstShooter; s < a->firstShooter + a->numShooters; s++)
+        for (int i = 0; i < 4; i++)
+        {
+            const float *v = m->shooters[s]->v[i];
+            if ((v[0] - p[0]) * n[0] + (v[1] - p[1]) * n[1] + (v[2] - p[2]) * n[2] > tolerance) return true;
+        }
+    return false;
+}
+
+
+
+static void InitCluster(LR_Operator *op, LR_Cluster *c, const int firstGatherer[], int firstShooter, int numShooters)
+{
+    c->firstShooter = firstShooter;
+    c->numShooters = numShooters;
+    c->firstGatherer = firstGatherer[firstShooter];
+    c->numGatherers = firstGatherer[firstShooter + numShooters] - c->firstGatherer;
+    c->children[0] = c->children[1] = -1;
+    c->firstBlock = c->numBlocks = 0;
+
+    float lo[3], hi[3];
+    CopyArray3(lo, op->model->shooters[firstShooter]->v[0]);
+    CopyArray3(hi, lo);
+    for (int s = firstShooter; s < firstShooter + numShooters; s++)
+        for (int i = 0; i < 4; i++)
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = Min2(lo[a], op->model->shooters[s]->v[i][a]);
+                hi[a] = Max2(hi[a], op->model->shooters[s]->v[i][a]);
+            }
+    for (int a = 0; a < 3; a++) c->center[a] = 0.5f * (lo[a] + hi[a]);
+    c->radius = 0.5f * VecDist(lo, hi);
+}
+
+
+static void SplitCluster(LR_Operator *op, std::vector<LR_Cluster> &clusters, const int firstGatherer[], int c)
+// Split a cluster into 2 halves of its shooter quads, recursively. The shooter quads of an original
+// quad are in rows, so the halves are the top and bottom rows, and then parts of a row.
+{
+    if (clusters[c].numShooters <= LEAF_SHOOTERS) return;
+    int first = clusters[c].firstShooter, half = clusters[c].numShooters / 2;
+    int sizes[2] = { half, clusters[c].numShooters - half };
+    for (int k = 0; k < 2; k++)
+    {
+        LR_Cluster child;
+        InitCluster(op, &child, firstGatherer, first + k * half, sizes[k]);
+        clusters[c].children[k] = (int)clusters.size();
+        clusters.push_back(child);
+        SplitCluster(op, clusters, firstGatherer, clusters[c].children[k]);
+    }
+}
+
+
+static bool CompressBlock(const LR_Operator *op, const LR_Cluster *r, const LR_Cluster *c,
+                          std::vector<float> &values, int *rank, long long *numEvaluated)
+// Approximate the block by ACA with partial pivoting, and append U and V to values.
+// Returns false, leaving values unchanged, if the rank would not make it smaller than dense.
+{
+    int m = r->numGatherers, n = c->numShooters;
+    int maxRank = Min2((int)((long long)m * n / (m + n)), MAX_RANK);
+    std::vector<float> U, V;            // Column l of U is U[l * m], row l of V is V[l * n].
+    std::vector<float> row(n);
+    std::vector<bool> usedRow(m, false);
+    double normSquared = 0.0;           // Squared Frobenius norm of the approximation.
+    int k = 0, i = 0, numUsed = 0;
+    bool converged = false;
+
+    while (k < maxRank && numUsed < m)
+    {
+        // Residual of row i, and its largest element.
+        usedRow[i] = true;
+        numUsed++;
+        int pivot = 0;
+        for (int j = 0; j < n; j++)
+        {
+            double sum = FormFactor(op, r->firstGatherer + i, c->firstShooter + j);
+            for (int l = 0; l < k; l++) sum -= U[l * m + i] * V[l * n + j];
+            row[j] = (float)sum;
+            if (fabsf(row[j]) > fabsf(row[pivot])) pivot = j;
+        }
+        *numEvaluated += n;
+
+        if (row[pivot] == 0.0f)
+        {
+            // The row is already approximated exactly. Try the next one that has not been used.
+            converged = (numUsed == m);
+            for (i = 0; i < m && usedRow[i]; i++) {}
+            continue;
+        }
+
+        // The new rank-1 term is the residual column of the pivot times the scaled residual row.
+        float invPivot = 1.0f / row[pivot];
+        V.resize((k + 1) * n);
+        U.resize((k + 1) * m);
+        for (int j = 0; j < n; j++) V[k * n + j] = row[j] * invPivot;
+        for (int g = 0; g < m; g++)
+        {
+            double sum = FormFactor(op, r->firstGatherer + g, c->firstShooter + pivot);
+            for (int l = 0; l < k; l++) sum -= V[l * n + pivot] * U[l * m + g];
+            U[k * m + g] = (float)sum;
+        }
+        *numEvaluated += m;
+
+        double uu = 0.0, vv = 0.0;
+        for (int g = 0; g < m; g++) uu += (double)U[k * m + g] * U[k * m + g];
+        for (int j = 0; j < n; j++) vv += (double)V[k * n + j] * V[k * n + j];
+        for (int l = 0; l < k; l++)
+        {
+            double ul = 0.0, vl = 0.0;
+            for (int g = 0; g < m; g++) ul += (double)U[k * m + g] * U[l * m + g];
+            for (int j = 0; j < n; j++) vl += (double)V[k * n + j] * V[l * n + j];
+            normSquared += 2.0 * ul * vl;
+        }
+        normSquared += uu * vv;
+        k++;
+
+        if (uu * vv <= (double)op->acaEpsilon * op->acaEpsilon * normSquared)
+        {
+            converged = true;
+            break;
+        }
+
+        // The next row is the one of the largest element of the new column.
+        int next = -1;
+        for (int g = 0; g < m; g++)
+            if (!usedRow[g] && (next < 0 || fabsf(U[k * m - m + g]) > fabsf(U[k * m - m + next]))) next = g;
+        if (next < 0) break;
+        i = next;
+    }
+    if (!converged) return false;
+
+    *rank = k;
+    for (int g = 0; g < m; g++)
+        for (int l = 0; l < k; l++) values.push_back(U[l * m + g]);
+    values.insert(values.end(), V.begin(), V.end());
+    return true;
+}
+
+
+static bool DenseBlock(const LR_Operator *op, const LR_Cluster *r, const LR_Cluster *c,
+                       std::vector<float> &values, long long *numEvaluated)
+// Append the form factors of the block to values. Returns false, leaving values unchanged, if they are all 0.
+{
+    size_t start = values.size();
+    bool any = false;
+    for (int g = r->firstGatherer; g < r->firstGatherer + r->numGatherers; g++)
+        for (int s = c->firstShooter; s < c->firstShooter + c->numShooters; s++)
+        {
+            float F = FormFactor(op, g, s);
+            values.push_back(F);
+            any = any || F > 0.0f;
+        }
+    *numEvaluated += (long long)r->numGatherers * c->numShooters;
+    if (!any) values.resize(start);
+    return any;
+}
+
+
+
+static bool IsLeaf(const LR_Cluster *c)
+{
+    return c->children[0] < 0;
+}
+
+
+static void RefineBlock(const LR_Operator *op, int r, int c, std::vector<LR_Block> &blocks,
+                        std::vector<float> &values, long long *numEvaluated)
+// Make the blocks of the form factors from the shooters of cluster c to the gatherers of cluster r.
+// A pair of distant clusters gets a compressed block. Otherwise, the larger cluster is split,
+// down to the leaves, which get a dense block.
+{
+    const LR_Cluster *rc = &op->clusters[r], *cc = &op->clusters[c];
+    LR_Block block;
+    block.row = r;
+    block.col = c;
+    block.offset = values.size();
+
+    float gap = VecDist(rc->center, cc->center) - rc->radius - cc->radius;
+    if (gap > 0.0f && 2.0f * Max2(rc->radius, cc->radius) <= ADMISSIBILITY * gap &&
+        CompressBlock(op, rc, cc, values, &block.rank, numEvaluated))
+    {
+        if (block.rank > 0) blocks.push_back(block);
+        return;
+    }
+
+    if (!IsLeaf(rc) && (IsLeaf(cc) || rc->radius >= cc->radius))
+    {
+        RefineBlock(op, rc->children[0], c, blocks, values, numEvaluated);
+        RefineBlock(op, rc->children[1], c, blocks, values, numEvaluated);
+    }
+    else if (!IsLeaf(cc))
+    {
+        RefineBlock(op, r, cc->children[0], blocks, values, numEvaluated);
+        RefineBlock(op, r, cc->children[1], blocks, values, numEvaluated);
+    }
+    else
+    {
+        block.rank = -1;
+        if (DenseBlock(op, rc, cc, values, numEvaluated)) blocks.push_back(block);
+    }
+}
+
+
+
+LR_Operator LR_OperatorInit(const QM_Model *m, const RC_Bvh *bvh, float acaEpsilon,
+                            int shadowSamplesPerSide, float minDist)
+{
+    LR_Operator op;
+    op.model = m;
+    op.bvh = bvh;
+    op.shadowSamplesPerSide = shadowSamplesPerSide;
+    op.minDist = minDist;
+    op.acaEpsilon = acaEpsilon;
+    op.numDenseBlocks = op.numLowRankBlocks = 0;
+    op.sumRanks = op.numEvaluated = 0;
+
+    // The gatherers of each shooter are consecutive, as QM_Subdivide() makes them shooter by shooter.
+    int *firstGatherer = (int *)CheckedMalloc(sizeof(int) * (m->totalShooters + 1));
+    int g = 0;
+    for (int q = 0; q < m->totalShooters; q++)
+    {
+        firstGatherer[q] = g;
+        while (g < m->totalGatherers && m->gatherers[g]->shooter->index == q) g++;
+    }
+    firstGatherer[m->totalShooters] = g;
+    if (g != m->totalGatherers)
+        ShowFatalError(__FILE__, __LINE__, "Gatherer quads are not grouped by shooter quad");
+
+    // The roots are the original quads, whose shooters are consecutive.
+    std::vector<LR_Cluster> clusters;
+    int numShooters = 0;    // Shooters of the previous surfaces.
+    for (int s = 0; s < m->numSurfaces; s++)
+    {
+        const QM_Surface *surface = &m->surfaces[s];
+        for (int q = 0; q < surface->numOrigQuads; q++)
+        {
+            const QM_OrigQuad *origQuad = &surface->origQuads[q];
+            LR_Cluster root;
+            InitCluster(&op, &root, firstGatherer, numShooters + origQuad->firstShooter,
+                        origQuad->numShooters[0] * origQuad->numShooters[1]);
+            clusters.push_back(root);
+        }
+        numShooters += surface->numShooterQuads;
+    }
+    op.numRoots = (int)clusters.size();
+    for (int r = 0; r < op.numRoots; r++) SplitCluster(&op, clusters, firstGatherer, r);
+    free(firstGatherer);
+
+    op.numClusters = (int)clusters.size();
+    op.clusters = (LR_Cluster *)CheckedMalloc(sizeof(LR_Cluster) * (op.numClusters > 0 ? op.numClusters : 1));
+    for (int c = 0; c < op.numClusters; c++) op.clusters[c] = clusters[c];
+
+    // Compute the blocks of the receivers of each root in its own task, so that each task of
+    // LR_Multiply() writes to its own gatherers. Roots that do not face each other exchange no light.
+    std::vector< std::vector<LR_Block> > taskBlocks(op.numRoots);
+    std::vector< std::vector<float> > taskValues(op.numRoots);
+    std::vector<long long> taskEvaluated(op.numRoots, 0);
+    float tolerance = 1e-5f * m->radius;
+
+    TP_ParallelFor(op.numRoots, [&](int r, int) {
+        for (int c = 0; c < op.numRoots; c++)
+            if (InFront(m, &op.clusters[r], &op.clusters[c], tolerance) && InFront(m, &op.clusters[c], &op.clusters[r], tolerance))
+                RefineBlock(&op, r, c, taskBlocks[r], taskValues[r], &taskEvaluated[r]);
+    });
+
+    // Concatenate the blocks of the roots.
+    op.numBlocks = 0;
+    op.numValues = 0;
+    for (int r = 0; r < op.numRoots; r++)
+    {
+        op.clusters[r].firstBlock = op.numBlocks;
+        op.clusters[r].numBlocks = (int)taskBlocks[r].size();
+        op.numBlocks += (int)taskBlocks[r].size();
+        op.numValues += taskValues[r].size();
+    }
+    op.blocks = (LR_Block *)CheckedMalloc(sizeof(LR_Block) * (op.numBlocks > 0 ? op.numBlocks : 1));
+    op.values = (float *)CheckedMalloc(sizeof(float) * (op.numValues > 0 ? op.numValues : 1));
+
+    size_t offset = 0;
+    for (int r = 0; r < op.numRoots; r++)
+    {
+        for (size_t b = 0; b < taskBlocks[r].size(); b++)
+        {
+            LR_Block block = taskBlocks[r][b];
+            block.offset += offset;
+            op.blocks[op.clusters[r].firstBlock + b] = block;
+            if (block.rank < 0) op.numDenseBlocks++;
+            else
+            {
+                op.numLowRankBlocks++;
+                op.sumRanks += block.rank;
+            }
+        }
+        for (size_t i = 0; i < taskValues[r].size(); i++) op.values[offset + i] = taskValues[r][i];
+        offset += taskValues[r].size();
+        op.numEvaluated += taskEvaluated[r];
+    }
+    return op;
+}
+
+
+void LR_OperatorCleanUp(LR_Operator *op)
+{
+    if (op == NULL) return;
+    free(op->clusters);
+    free(op->blocks);
+    free(op->values);
+    op->clusters = NULL;
+    op->blocks = NULL;
+    op->values = NULL;
+    op->numClusters = op->numRoots = op->numBlocks = 0;
+    op->numValues = 0;
+}
+
+
+size_t LR_OperatorBytes(const LR_Operator *op)
+{
+    return op->numValues * sizeof(float) + op->numBlocks * sizeof(LR_Block) + op->numClusters * sizeof(LR_Cluster);
+}
+
+
+
+void LR_Multiply(const LR_Operator *op, const float (*shooterPowers)[4], float (*received)[4])
+// Each task sums the blocks of the receivers of one root cluster.
+{
+    TP_ParallelFor(op->numRoots, [&](int r, int) {
+        const LR_Cluster *root = &op->clusters[r];
+        for (int i = root->firstGatherer; i < root->firstGatherer + root->numGatherers; i++)
+            received[i][0] = received[i][1] = received[i][2] = received[i][3] = 0.0f;
+
+        for (int b = root->firstBlock; b < root->firstBlock + root->numBlocks; b++)
+        {
+            const LR_Block *block = &op->blocks[b];
+            const LR_Cluster *rc = &op->clusters[block->row], *cc = &op->clusters[block->col];
+            float (*y)[4] = &received[rc->firstGatherer];
+            const float (*x)[4] = &shooterPowers[cc->firstShooter];
+            const float *A = &op->values[block->offset];
+            int m = rc->numGatherers, n = cc->numShooters, k = block->rank;
+
+            if (k < 0)
+            {
+                for (int i = 0; i < m; i++, A += n)
+                    for (int j = 0; j < n; j++)
+                        for (int c = 0; c < 3; c++) y[i][c] += A[j] * x[j][c];
+                continue;
+            }
+
+            // Multiply by V, then by U.
+            float t[MAX_RANK][3];
+            const float *V = A + m * k;
+            for (int l = 0; l < k; l++)
+            {
+                t[l][0] = t[l][1] = t[l][2] = 0.0f;
+                for (int j = 0; j < n; j++)
+                    for (int c = 0; c < 3; c++) t[l][c] += V[l * n + j] * x[j][c];
+            }
+            for (int i = 0; i < m; i++)
+                for (int l = 0; l < k; l++)
+                    for (int c = 0; c < 3; c++) y[i][c] += A[i * k + l] * t[l][c];
+        }
+    });
+}
@@ -0,0 +1,85 @@
+#ifndef _LOWRANK_H_
+#define _LOWRANK_H_
+
+#include <stddef.h>
+#include "quadmodel.h"
+#include "raycast.h"
+
+// Transport operator of form factors from the shooter quads to the gatherer quads, stored in blocks.
+// The shooter quads of each original quad form a cluster, which is split in halves recursively
+// into a binary tree of clusters, and the gatherer quads go with their shooter quads. The form
+// factors between two original quads that face each other are covered by blocks between pairs of
+// their clusters: pairs that are far apart compared to their sizes vary smoothly, so their blocks
+// are compressed to low rank by adaptive cross approximation (ACA) with partial pivoting, which only
+// evaluates the few rows and columns it picks. Closer pairs are split further, down to dense blocks
+// between leaf clusters. Memory then grows about linearly with the number of gatherer quads
+// instead of with the number of pairs.
+// Each form factor is the exact unoccluded form factor from the centroid of the shooter quad to the
+// gatherer quad, scaled by the visibility estimated with shadow rays, as the analytic backend does.
+
+
+typedef struct LR_Cluster {
+    int firstShooter;       // Shooter quads firstShooter to (firstShooter + numShooters - 1).
+    int numShooters;
+    int firstGatherer;      // Gatherer quads of those shooter quads.
+    int numGatherers;
+    float center[3];        // Bounding sphere of the quads.
+    float radius;
+    int children[2];        // The 2 halves of the cluster, or -1 for a leaf.
+    int firstBlock;         // Blocks of the form factors to the gatherers of a root cluster.
+    int numBlocks;
+}
+LR_Cluster;
+
+
+typedef struct LR_Block {
+    int row;                // Cluster whose gatherer quads receive the light.
+    int col;                // Cluster whose shooter quads send the light.
+    int rank;               // Rank of a compressed block, or -1 for a dense block.
+    size_t offset;          // Index of the first value of the block.
+}
+LR_Block;
+// A dense block stores the form factor from each shooter to each gatherer, gatherer by gatherer.
+// A block of rank k stores U, (numGatherers x k) values gatherer by gatherer, and then V,
+// (k x numShooters) values, so that the form factor from shooter j to gatherer i is sum(U[i][l] V[l][j]).
+
+
+typedef struct LR_Operator {
+    const QM_Model *model;
+    const RC_Bvh *bvh;
+    int shadowSamplesPerSide;
+    float minDist;
+    float acaEpsilon;       // Relative accuracy of the compressed blocks.
+
+    int numClusters;
+    int numRoots;           // Clusters 0 to (numRoots - 1) are the original quads.
+    LR_Cluster *clusters;
+    int numBlocks;
+    LR_Block *blocks;
+    size_t numValues;
+    float *values;
+
+    int numDenseBlocks;     // Statistics.
+    int numLowRankBlocks;
+    long long sumRanks;
+    long long numEvaluated; // Number of form factors evaluated.
+}
+LR_Operator;
+
+
+
+extern LR_Operator LR_OperatorInit(const QM_Model *m, const RC_Bvh *bvh, float acaEpsilon,
+                                   int shadowSamplesPerSide, float minDist);
+// Cluster the quads of a subdivided model, and compute the blocks in parallel on the thread pool.
+// The gatherer quads of each shooter quad must be consecutive, in the order of the shooter quads.
+
+extern void LR_OperatorCleanUp(LR_Operator *op);
+
+extern size_t LR_OperatorBytes(const LR_Operator *op);
+// Returns the memory used by the blocks.
+
+extern void LR_Multiply(const LR_Operator *op, const float (*shooterPowers)[4], float (*received)[4]);
+// Compute the RGB power received by every gatherer quad from the RGB powers of the shooter quads,
+// all stored as (r, g, b, unused), in parallel on the thread pool.
+
+#endif
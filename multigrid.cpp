@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "common.h"
+#include "threadpool.h"
+#include "multigrid.h"
+
+
+#define CHUNK_SHOOTERS  16      // Number of coarse rows summed by each task.
+
+
+
+static int CompareInts(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+MG_CoarseMatrix MG_CoarseMatrixInit(const FM_Matrix *mat, const int firstGatherer[], int numShooters)
+{
+    MG_CoarseMatrix c;
+    c.numShooters = numShooters;
+    int n = (numShooters > 0) ? numShooters : 1;
+
+    // Each worker sums rows into a dense array, remembering the columns it has touched.
+    int numWorkers = TP_NumWorkers();
+    float *sums = (float *)CheckedMalloc(sizeof(float) * numWorkers * n);
+    int *touched = (int *)CheckedMalloc(sizeof(int) * numWorkers * n);
+    for (int i = 0; i < numWorkers * n; i++) sums[i] = 0.0f;
+
+    int **rowCols = (int **)CheckedMalloc(sizeof(int *) * n);
+    float **rowValues = (float **)CheckedMalloc(sizeof(float *) * n);
+    int *rowCounts = (int *)CheckedMalloc(sizeof(int) * n);
+
+    int numChunks = (numShooters + CHUNK_SHOOTERS - 1) / CHUNK_SHOOTERS;
+    TP_ParallelFor(numChunks, [&](int chunk, int worker) {
+        float *sum = &sums[worker * n];
+        int *cols = &touched[worker * n];
+        int end = Min2((chunk + 1) * CHUNK_SHOOTERS, numShooters);
+
+        for (int s = chunk * CHUNK_SHOOTERS; s < end; s++)
+        {
+            for (int g = firstGatherer[s]; g < firstGatherer[s + 1]; g++)
+                FM_AccumulateRow(mat, g, sum);
+
+            // The gatherers of a shooter see few of the shooters, so scan only the columns of their rows.
+            int count = 0;
+            for (int g = firstGatherer[s]; g < firstGatherer[s + 1]; g++)
+            {
+                int col = 0;
+                for (size_t i = mat->rowStart[g]; i < mat->rowStart[g + 1]; i++)
+                {
+                    col += mat->deltas[i];
+                    if (sum[col] > 0.0f)
+                    {
+                        cols[count++] = col;
+                        sum[col] = -sum[col];   // Marks the column as taken.
+                    }
+                }
+            }
+            qsort(cols, count, sizeof(int), CompareInts);
+
+            rowCounts[s] = count;
+            rowCols[s] = (int *)CheckedMalloc(sizeof(int) * (count > 0 ? count : 1));
+            rowValues[s] = (float *)CheckedMalloc(sizeof(float) * (count > 0 ? count : 1));
+            for (int k = 0; k < count; k++)
+            {
+                rowCols[s][k] = cols[k];
+                rowValues[s][k] = -sum[cols[k]];
+                sum[cols[k]] = 0.0f;
+            }
+        }
+    });
+
+    c.rowStart = (int *)CheckedMalloc(sizeof(int) * (numShooters + 1));
+    c.rowStart[0] = 0;
+    for (int s = 0; s < numShooters; s++) c.rowStart[s + 1] = c.rowStart[s] + rowCounts[s];
+    int numEntries = c.rowStart[numShooters];
+    c.cols = (int *)CheckedMalloc(sizeof(int) * (numEntries > 0 ? numEntries : 1));
+    c.formFactors = (float *)CheckedMalloc(sizeof(float) * (numEntries > 0 ? numEntries : 1));
+    for (int s = 0; s < numShooters; s++)
+    {
+        for (int k = 0; k < rowCounts[s]; k++)
+        {
+            c.cols[c.rowStart[s] + k] = rowCols[s][k];
+            c.formFactors[c.rowStart[s] + k] = rowValues[s][k];
+        }
+        free(rowCols[s]);
+        free(rowValues[s]);
+    }
+
+    free(rowCols);
+    free(rowValues);
+    free(rowCounts);
+    free(sums);
+    free(touched);
+    return c;
+}
+
+
+void MG_CoarseMatrixCleanUp(MG_CoarseMatrix *c)
+{
+    if (c == NULL) return;
+    free(c->rowStart);
+    free(c->cols);
+    free(c->formFactors);
+    c->rowStart = NULL;
+    c->cols = NULL;
+    c->formFactors = NULL;
+}
+
+
+
+int MG_Solve(const MG_CoarseMatrix *c, const float (*emittedPowers)[4], const float (*reflectivities)[4],
+             float (*shooterPowers)[4], double tolerance, int maxSweeps)
+// Gauss-Seidel sweeps over the coarse system of the shooter powers.
+{
+    int sweep = 0;
+    while (sweep < maxSweeps)
+    {
+        double change = 0.0;
+        for (int s = 0; s < c->numShooters; s++)
+        {
+            double received[3] = { 0.0, 0.0, 0.0 };
+            for (int i = c->rowStart[s]; i < c->rowStart[s + 1]; i++)
+            {
+                const float *P = shooterPowers[c->cols[i]];
+                for (int ch = 0; ch < 3; ch++) received[ch] += c->formFactors[i] * P[ch];
+            }
+            for (int ch = 0; ch < 3; ch++)
+            {
+                float power = (float)(emittedPowers[s][ch] + reflectivities[s][ch] * received[ch]);
+                change += fabs(power - shooterPowers[s][ch]);
+                shooterPowers[s][ch] = power;
+            }
+        }
+        sweep++;
+        if (change <= tolerance) break;
+    }
+    return sweep;
+}
@@ -0,0 +1,38 @@
+#ifndef _MULTIGRID_H_
+#define _MULTIGRID_H_
+
+#include "ffmatrix.h"
+
+// Two-level solve of the form factor matrix.
+// Gatherer quads only receive light, and a shooter quad sends out the total power of its
+// gatherer quads. Summing the rows of the gatherers of each shooter therefore gives a coarse
+// matrix of the form factors between shooter quads, which act as both senders and receivers,
+// and the coarse system of the shooter powers has the same solution as the gatherer-level one.
+// It has fewer rows and entries, so it is solved first with Gauss-Seidel sweeps, and the gatherer
+// quads then gather their radiosity from the coarse shooter powers, which adds back the detail
+// within each shooter. Sweeps at the gatherer level only correct what remains.
+
+
+typedef struct MG_CoarseMatrix {
+    int numShooters;
+    int *rowStart;          // Entries of row s are rowStart[s] to (rowStart[s + 1] - 1).
+    int *cols;              // Sending shooter quad of each entry, increasing along a row.
+    float *formFactors;     // Fraction of the power of the sender received by the gatherers of the row's shooter.
+}
+MG_CoarseMatrix;
+
+
+
+extern MG_CoarseMatrix MG_CoarseMatrixInit(const FM_Matrix *mat, const int firstGatherer[], int numShooters);
+// Sum the rows of the gatherers of each shooter, in parallel on the thread pool. The gatherers
+// of shooter s are the rows firstGatherer[s] to (firstGatherer[s + 1] - 1) of mat.
+
+extern void MG_CoarseMatrixCleanUp(MG_CoarseMatrix *c);
+
+extern int MG_Solve(const MG_CoarseMatrix *c, const float (*emittedPowers)[4], const float (*reflectivities)[4],
+                    float (*shooterPowers)[4], double tolerance, int maxSweeps);
+// Solve P = E + R * (C P) for the RGB powers P of the shooters, stored as (r, g, b, unused), with
+// Gauss-Seidel sweeps starting from shooterPowers, until the total change of a sweep is at most
+// tolerance or maxSweeps have been made. Returns the number of sweeps.
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "common.h"
+#include "pqueue.h"
+
+
+#define HEAP_ARITY  4   // Number of children of each heap node.
+
+
+
+static inline void PlaceItem(PQ_MaxHeap *h, int slot, int item, float key)
+{
+    h->keys[slot] = key;
+    h->items[slot] = item;
+    h->slots[item] = slot;
+}
+
+
+static void SiftUp(PQ_MaxHeap *h, int slot)
+{
+    int item = h->items[slot];
+    float key = h->keys[slot];
+
+    while (slot > 0)
+    {
+        int parent = (slot - 1) / HEAP_ARITY;
+        if (h->keys[parent] >= key) break;
+        PlaceItem(h, slot, h->items[parent], h->keys[parent]);
+        slot = parent;
+    }
+    PlaceItem(h, slot, item, key);
+}
+
+
+static void SiftDown(PQ_MaxHeap *h, int slot)
+{
+    int item = h->items[slot];
+    float key = h->keys[slot];
+
+    for (;;)
+    {
+        int first = HEAP_ARITY * slot + 1;
+        if (first >= h->numItems) break;
+        int last = Min2(first + HEAP_ARITY, h->numItems);
+
+        // Find the child with the largest key.
+        int best = first;
+        for (int c = first + 1; c < last; c++)
+            if (h->keys[c] > h->keys[best]) best = c;
+
+        if (h->keys[best] <= key) break;
+        PlaceItem(h, slot, h->items[best], h->keys[best]);
+        slot = best;
+    }
+    PlaceItem(h, slot, item, key);
+}
+
+
+
+PQ_MaxHeap PQ_Init(int numItems, const float keys[])
+// Build a heap of the items 0 to (numItems - 1) with the given keys in O(n) time.
+{
+    PQ_MaxHeap h;
+    int n = (numItems > 0) ? numItems : 1;
+    h.numItems = numItems;
+    h.keys = (float *)CheckedMalloc(sizeof(float) * n);
+    h.items = (int *)CheckedMalloc(sizeof(int) * n);
+    h.slots = (int *)CheckedMalloc(sizeof(int) * n);
+
+    for (int i = 0; i < numItems; i++) PlaceItem(&h, i, i, keys[i]);
+    if (numItems > 1)
+        for (int slot = (numItems - 2) / HEAP_ARITY; slot >= 0; slot--) SiftDown(&h, slot);
+    return h;
+}
+
+
+void PQ_CleanUp(PQ_MaxHeap *h)
+{
+    if (h == NULL) return;
+    free(h->keys);
+    free(h->items);
+    free(h->slots);
+    h->keys = NULL;
+    h->items = NULL;
+    h->slots = NULL;
+    h->numItems = 0;
+}
+
+
+
+void PQ_Update(PQ_MaxHeap *h, int item, float key)
+// Change the key of an item and restore the heap order.
+{
+    int slot = h->slots[item];
+    float oldKey = h->keys[slot];
+    h->keys[slot] = key;
+
+    if (key > oldKey)
+        SiftUp(h, slot);
+    else if (key < oldKey)
+        SiftDown(h, slot);
+}
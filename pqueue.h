@@ -0,0 +1,42 @@
+#ifndef _PQUEUE_H_
+#define _PQUEUE_H_
+
+// Indexed 4-ary max-heap (priority queue).
+// Items are integers from 0 to (numItems - 1), and the key of any item can be changed
+// in O(log n) time. The keys are kept in a compact array in heap order, so that the
+// sift operations only touch a small amount of memory.
+
+
+typedef struct PQ_MaxHeap {
+    int numItems;       // Number of items in the heap.
+    float *keys;        // keys[slot] -- key of the item at each heap slot.
+    int *items;         // items[slot] -- item at each heap slot.
+    int *slots;         // slots[item] -- heap slot of each item.
+}
+PQ_MaxHeap;
+
+
+
+extern PQ_MaxHeap PQ_Init(int numItems, const float keys[]);
+// Build a heap of the items 0 to (numItems - 1) with the given keys in O(n) time.
+
+extern void PQ_CleanUp(PQ_MaxHeap *h);
+
+extern void PQ_Update(PQ_MaxHeap *h, int item, float key);
+// Change the key of an item and restore the heap order.
+
+
+inline int PQ_Top(const PQ_MaxHeap *h)
+// Returns the item with the largest key.
+{
+    return h->items[0];
+}
+
+
+inline float PQ_Key(const PQ_MaxHeap *h, int item)
+// Returns the key of an item.
+{
+    return h->keys[h->slots[item]];
+}
+
+#endif
@@ -2,19 +2,31 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
 #include "common.h"
 #include "vector3.h"
 #include "quadmodel.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 
 #define EQUAL_VERTEX_THRESHOLD  (1e-6f)     // If the distance between two vertices are less than this threshold,
                                             // they are assumed to be the same vertex.
 
+#define ARENA_ALIGNMENT     64      // Alignment of the arrays in the arena of a model, a cache line.
+
 
 static const float ZERO_VEC_3F[3] = { 0.0f, 0.0f, 0.0f };
 
+static void ArenaFree(void *arena, size_t numBytes);
+
 
 
 void QM_SurfaceInit(QM_Surface *s)
@@ -41,11 +53,10 @@ QM_Surface QM_SurfaceInit(void)
 
 
 void QM_SurfaceCleanUp(QM_Surface *s)
+// The shooter and gatherer quads of a subdivided surface belong to the arena of its model.
 {
     if (s == NULL) return;
     free(s->origQuads);
-    free(s->shooters);
-    free(s->gatherers);
     QM_SurfaceInit(s);
 }
 
@@ -59,6 +70,20 @@ void QM_ModelInit(QM_Model *m)
     m->shooters = NULL;
     m->totalGatherers = 0;
     m->gatherers = NULL;
+    m->arena = NULL;
+    m->arenaBytes = 0;
+    m->useHugePages = false;
+    m->unshotPowers = NULL;
+    m->gathererAreas = NULL;
+    m->gathererInvAreas = NULL;
+    m->radiosities = NULL;
+    m->gathererReflectivities = NULL;
+    m->gathererEmissions = NULL;
+    m->gathererShooters = NULL;
+    m->vertexRadiosities = NULL;
+    m->vertexQuadStart = NULL;
+    m->vertexQuads = NULL;
+    m->numTJunctions = 0;
     m->maxShooterQuadEdgeLength = FLT_MAX;
     m->maxGathererQuadEdgeLength = FLT_MAX;
 
@@ -81,9 +106,11 @@ QM_Model QM_ModelInit(void)
 void QM_ModelCleanUp(QM_Model *m)
 {
     if (m == NULL) return;
+    for (int s = 0; s < m->numSurfaces; s++) QM_SurfaceCleanUp(&m->surfaces[s]);
     free(m->surfaces);
-    free(m->shooters);
-    free(m->gatherers);
+    if (m->arena != NULL) ArenaFree(m->arena, m->arenaBytes);
+    free(m->vertexQuads);
+    free(m->vertexRadiosities);
     QM_ModelInit(m);
 }
 
@@ -378,7 +405,7 @@ static inline void LineInterpolate(float vo[3], float k, const float v1[3], cons
 }
 
 
-static inline void QuadBilinearInterpolate(float vo[3], float x, float y, float v[4][3])
+static inline void QuadBilinearInterpolate(float vo[3], float x, float y, const float v[4][3])
 // Bilinearly interpolate the vertices of the input quad to get a point.
 // The edge v[0]v[1] is considered the x axis, and the edge v[0]v[3] is the y axis.
 // 0 <= x, y <= 1.
@@ -391,181 +418,526 @@ static inline void QuadBilinearInterpolate(float vo[3], float x, float y, float
 
 
 
+static inline void CountSegments(int numSegments[2], const float v[4][3], float maxEdgeLen)
+// Compute how many regular segments to divide a quad into along its x axis (edges v[0]v[1] and
+// v[3]v[2]) and its y axis (edges v[0]v[3] and v[1]v[2]), so that no resulting edge is longer
+// than maxEdgeLen.
+{
+    float xLen = Max2(VecDist(v[0], v[1]), VecDist(v[3], v[2]));
+    float yLen = Max2(VecDist(v[0], v[3]), VecDist(v[1], v[2]));
+    numSegments[0] = Max2(1, (int)ceil(xLen / maxEdgeLen));
+    numSegments[1] = Max2(1, (int)ceil(yLen / maxEdgeLen));
+}
+
+
+
+static inline float PointSegmentSqrDist(const float p[3], const float a[3], const float b[3], float *t)
+// Returns the squared distance from point p to segment ab, and in t the parameter of the nearest point.
+{
+    float ab[3], ap[3];
+    VecDiff(ab, b, a);
+    VecDiff(ap, p, a);
+    float len2 = VecDotProd(ab, ab);
+    *t = (len2 > 0.0f) ? Min2(Max2(VecDotProd(ap, ab) / len2, 0.0f), 1.0f) : 0.0f;
+    float d[3] = { ap[0] - *t * ab[0], ap[1] - *t * ab[1], ap[2] - *t * ab[2] };
+    return VecDotProd(d, d);
+}
+
+
+static bool IsTJunction(const float p[3], const float v[4][3])
+// Returns whether point p lies inside an edge of the quad, away from its vertices.
+{
+    for (int i = 0; i < 4; i++)
+    {
+        const float *a = v[i], *b = v[(i + 1) % 4];
+        float t;
+        if (PointSegmentSqrDist(p, a, b, &t) <= EQUAL_VERTEX_THRESHOLD &&
+            VecSqrDist(p, a) > EQUAL_VERTEX_THRESHOLD && VecSqrDist(p, b) > EQUAL_VERTEX_THRESHOLD)
+            return true;
+    }
+    return false;
+}
+
+
+typedef struct CellEntry {
+    unsigned long long cell;    // Packed coordinates of a cell of the spatial hash.
+    int gatherer;               // Index in QM_Surface::gatherers[] of a gatherer quad that overlaps it.
+}
+CellEntry;
+
+
+static inline unsigned long long CellKey(const float p[3], const float origin[3], float cellSize)
+// Returns the packed integer coordinates of the cell of the spatial hash that contains point p.
+{
+    unsigned long long key = 0;
+    for (int a = 0; a < 3; a++)
+        key = (key << 21) | (unsigned long long)(int)floorf((p[a] - origin[a]) / cellSize);
+    return key;
+}
+
+
+static inline unsigned int HashCellKey(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDull;
+    key ^= key >> 33;
+    return (unsigned int)key;
+}
+
+
+static void BuildVertexAdjacency(QM_Model *m)
+// Find the gatherer quads around each vertex of each gatherer quad on the same surface: those
+// with a vertex at the same place, once for each such vertex, and those with the vertex inside
+// one of their edges, where neighbouring quads are subdivided differently (T-junctions).
+// Each gatherer quad is entered into the cells of a quantised spatial hash that its bounding box,
+// grown by the vertex distance threshold, overlaps, so the candidates for a vertex are the quads
+// entered into its cell, in the order of the quads. This finds the same quads, in the same
+// order, as comparing the vertex with every quad on the surface.
+{
+    int numVertices = 4 * m->totalGatherers;
+    int capacity = (numVertices > 0) ? 4 * numVertices : 1;
+    m->vertexQuads = (int *)CheckedMalloc(sizeof(int) * capacity);
+    m->numTJunctions = 0;
+
+    const float reach = 2.0f * sqrtf(EQUAL_VERTEX_THRESHOLD);   // With a margin for rounding.
+    int numEntries = 0;
+    int first = 0;      // Index in m->gatherers[] of the first gatherer quad of the surface.
+
+    for (int s = 0; s < m->numSurfaces; s++)
+    {
+        QM_Surface *surface = &(m->surfaces[s]);
+        int n = surface->numGathererQuads;
+        if (n <= 0) continue;
+
+        float (*v)[4][3] = (float (*)[4][3])CheckedMalloc(sizeof(float) * 12 * n);
+        for (int g = 0; g < n; g++) QM_GathererVertices(&surface->gatherers[g], v[g]);
+
+        // The cells are about as large as the quads, but no more than 2^20 along an axis of the surface.
+        float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        double sumExtent = 0.0;
+        for (int g = 0; g < n; g++)
+        {
+            float glo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, ghi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+            for (int i = 0; i < 4; i++)
+                for (int a = 0; a < 3; a++)
+                {
+                    glo[a] = Min2(glo[a], v[g][i][a]);
+                    ghi[a] = Max2(ghi[a], v[g][i][a]);
+                }
+            sumExtent += Max2(ghi[0] - glo[0], Max2(ghi[1] - glo[1], ghi[2] - glo[2]));
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = Min2(lo[a], glo[a]);
+                hi[a] = Max2(hi[a], ghi[a]);
+            }
+        }
+        float origin[3] = { lo[0] - 2.0f * reach, lo[1] - 2.0f * reach, lo[2] - 2.0f * reach };
+        float cellSize = Max2((float)(sumExtent / n), 4.0f * reach);
+        for (int a = 0; a < 3; a++) cellSize = Max2(cellSize, (hi[a] - origin[a] + 2.0f * reach) / (1 << 20));
+
+        // Count the cells of each quad, then enter the quads into the buckets of their cells.
+        int *cellRanges = (int *)CheckedMalloc(sizeof(int) * 6 * n);
+        int numCellEntries = 0;
+        for (int g = 0; g < n; g++)
+        {
+            int *range = &cellRanges[6 * g];
+            for (int a = 0; a < 3; a++)
+            {
+                float vmin = v[g][0][a], vmax = vmin;
+                for (int i = 1; i < 4; i++)
+                {
+                    vmin = Min2(vmin, v[g][i][a]);
+                    vmax = Max2(vmax, v[g][i][a]);
+                }
+                range[a] = (int)floorf((vmin - reach - origin[a]) / cellSize);
+                range[3 + a] = (int)floorf((vmax + reach - origin[a]) / cellSize);
+            }
+            numCellEntries += (range[3] - range[0] + 1) * (range[4] - range[1] + 1) * (range[5] - range[2] + 1);
+        }
+
+        unsigned int numBuckets = 1;
+        while (numBuckets < 2u * (unsigned int)numCellEntries) numBuckets *= 2;
+        int *bucketStart = (int *)CheckedMalloc(sizeof(int) * (numBuckets + 1));
+        CellEntry *cellEntries = (CellEntry *)CheckedMalloc(sizeof(CellEntry) * numCellEntries);
+        for (unsigned int b = 0; b <= numBuckets; b++) bucketStart[b] = 0;
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int g = 0; g < n; g++)
+            {
+                const int *range = &cellRanges[6 * g];
+                for (int x = range[0]; x <= range[3]; x++)
+                    for (int y = range[1]; y <= range[4]; y++)
+                        for (int z = range[2]; z <= range[5]; z++)
+                        {
+                            unsigned long long key = ((unsigned long long)x << 42) | ((unsigned long long)y << 21) | (unsigned long long)z;
+                            unsigned int b = HashCellKey(key) & (numBuckets - 1);
+                            if (pass == 0) bucketStart[b + 1]++;
+                            else
+                            {
+                                CellEntry entry = { key, g };
+                                cellEntries[bucketStart[b]++] = entry;
+                            }
+                        }
+            }
+            // After counting, make bucketStart[b] the start of bucket b. After filling, it is the
+            // end of bucket b, which is the start of bucket b + 1.
+            if (pass == 0)
+                for (unsigned int b = 0; b < numBuckets; b++) bucketStart[b + 1] += bucketStart[b];
+            else
+                for (unsigned int b = numBuckets; b > 0; b--) bucketStart[b] = bucketStart[b - 1];
+            bucketStart[0] = 0;
+        }
+
+        for (int g = 0; g < n; g++)
+            for (int i = 0; i < 4; i++)
+            {
+                const float *p = v[g][i];
+                m->vertexQuadStart[4 * (first + g) + i] = numEntries;
+                bool tJunction = false;
+
+                unsigned long long key = CellKey(p, origin, cellSize);
+                unsigned int b = HashCellKey(key) & (numBuckets - 1);
+                for (int e = bucketStart[b]; e < bucketStart[b + 1]; e++)
+                {
+                    if (cellEntries[e].cell != key) continue;
+                    int g2 = cellEntries[e].gatherer;
+                    int numUses = 0;
+                    for (int i2 = 0; i2 < 4; i2++)
+                        if (VecSqrDist(p, v[g2][i2]) <= EQUAL_VERTEX_THRESHOLD) numUses++;
+                    if (numUses == 0 && IsTJunction(p, v[g2]))
+                    {
+                        numUses = 1;
+                        tJunction = true;
+                    }
+
+                    for (int k = 0; k < numUses; k++)
+                    {
+                        if (numEntries == capacity)
+                        {
+                            int *newVertexQuads = (int *)CheckedMalloc(sizeof(int) * 2 * capacity);
+                            CopyArrayN(newVertexQuads, m->vertexQuads, numEntries);
+                            free(m->vertexQuads);
+                            m->vertexQuads = newVertexQuads;
+                            capacity *= 2;
+                        }
+                        m->vertexQuads[numEntries++] = first + g2;
+                    }
+                }
+                if (tJunction) m->numTJunctions++;
+            }
+
+        free(v);
+        free(cellRanges);
+        free(bucketStart);
+        free(cellEntries);
+        first += n;
+    }
+    m->vertexQuadStart[numVertices] = numEntries;
+}
+
+
+
+static void ShooterVertices(const QM_OrigQuad *origQuad, int x, int y, float v[4][3])
+// Compute the 4 vertices of the shooter quad in column x and row y of the grid of an original quad.
+{
+    int nx = origQuad->numShooters[0], ny = origQuad->numShooters[1];
+    QuadBilinearInterpolate(v[0], (float)x / nx, (float)y / ny, origQuad->v);
+    QuadBilinearInterpolate(v[1], (float)(x + 1) / nx, (float)y / ny, origQuad->v);
+    QuadBilinearInterpolate(v[2], (float)(x + 1) / nx, (float)(y + 1) / ny, origQuad->v);
+    QuadBilinearInterpolate(v[3], (float)x / nx, (float)(y + 1) / ny, origQuad->v);
+}
+
+
+static inline size_t ArenaSlice(size_t *arenaBytes, size_t numBytes)
+// Reserve numBytes at the end of the arena, aligned to a cache line. Returns their offset.
+{
+    size_t offset = (*arenaBytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    *arenaBytes = offset + numBytes;
+    return offset;
+}
+
+
+static void *ArenaAlloc(size_t numBytes, bool hugePages)
+// Allocate zeroed, page-aligned memory for the arena of a model straight from the operating system.
+// With hugePages, ask for large pages, which cut the TLB misses of the loops over a large model.
+// Without the privilege to lock large pages (Windows) or transparent huge pages (Linux), the
+// arena gets normal pages.
+{
+    void *arena = NULL;
+#ifdef _WIN32
+    SIZE_T largePageBytes = hugePages ? GetLargePageMinimum() : 0;
+    if (largePageBytes > 0)
+        arena = VirtualAlloc(NULL, (numBytes + largePageBytes - 1) / largePageBytes * largePageBytes,
+                             MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (arena == NULL)
+        arena = VirtualAlloc(NULL, numBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    arena = mmap(NULL, numBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) arena = NULL;
+#ifdef MADV_HUGEPAGE
+    if (arena != NULL && hugePages) madvise(arena, numBytes, MADV_HUGEPAGE);
+#endif
+#endif
+    if (arena == NULL)
+        ShowFatalError(__FILE__, __LINE__, "Cannot allocate %.1f MB for the subdivided model", numBytes / (1024.0 * 1024.0));
+    return arena;
+}
+
+
+static void ArenaFree(void *arena, size_t numBytes)
+{
+#ifdef _WIN32
+    (void)numBytes;
+    VirtualFree(arena, 0, MEM_RELEASE);
+#else
+    munmap(arena, numBytes);
+#endif
+}
+
+
+
 void QM_Subdivide(QM_Model *m)
 // Subdivide the original quads in the model to smaller
 // shooter quads and even-smaller gatherer quads.
 // Each shooter quad cannot have edge longer than maxShooterQuadEdgeLength, and
 // each gatherer quad cannot have edge longer than maxGathererQuadEdgeLength.
+// Each quad is subdivided into its own grid, with as many segments along each of
+// its axes as the longer of its 2 edges along that axis needs.
+// The quads are counted first, so that they and the solver state take a single allocation.
 {
     if (m == NULL || m->numSurfaces <= 0) return;
 
-    // Subdivide original quads to get shooter quads.
+    // Count the shooter quads of each original quad, and the gatherer quads of each shooter quad.
 
     int modelTotalShooters = 0;     // This will contain the total number of shooter quads in model.
+    int modelTotalGatherers = 0;    // This will contain the total number of gatherers quads in model.
 
     for (int s = 0; s < m->numSurfaces; s++)
     {
         QM_Surface *surface = &(m->surfaces[s]);
+        surface->numShooterQuads = 0;
+        surface->numGathererQuads = 0;
 
-        // Find longest edge length of all original quads in the current surface.
-        float maxEdgeLen = 0.0f;
         for (int q = 0; q < surface->numOrigQuads; q++)
         {
             QM_OrigQuad *origQuad = &(surface->origQuads[q]);
-            float edgeLen;
-            edgeLen = VecDist(origQuad->v[0], origQuad->v[1]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(origQuad->v[1], origQuad->v[2]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(origQuad->v[2], origQuad->v[3]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(origQuad->v[3], origQuad->v[0]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
+            CountSegments(origQuad->numShooters, origQuad->v, m->maxShooterQuadEdgeLength);
+            origQuad->firstShooter = surface->numShooterQuads;
+            surface->numShooterQuads += origQuad->numShooters[0] * origQuad->numShooters[1];
+
+            for (int y = 0; y < origQuad->numShooters[1]; y++)
+                for (int x = 0; x < origQuad->numShooters[0]; x++)
+                {
+                    float v[4][3];
+                    int numGatherers[2];
+                    ShooterVertices(origQuad, x, y, v);
+                    CountSegments(numGatherers, v, m->maxGathererQuadEdgeLength);
+                    if (numGatherers[0] > USHRT_MAX || numGatherers[1] > USHRT_MAX)
+                        ShowFatalError(__FILE__, __LINE__, "Too many gatherer quads along an edge of a shooter quad");
+                    surface->numGathererQuads += numGatherers[0] * numGatherers[1];
+                }
         }
+        modelTotalShooters += surface->numShooterQuads;
+        modelTotalGatherers += surface->numGathererQuads;
+    }
+
+
+    // Lay out the quads, the arrays of pointers to them, and the solver state in one arena.
+    size_t arenaBytes = 0;
+    size_t shooterQuadsAt = ArenaSlice(&arenaBytes, sizeof(QM_ShooterQuad) * modelTotalShooters);
+    size_t gathererQuadsAt = ArenaSlice(&arenaBytes, sizeof(QM_GathererQuad) * modelTotalGatherers);
+    size_t shootersAt = ArenaSlice(&arenaBytes, sizeof(QM_ShooterQuad *) * modelTotalShooters);
+    size_t gatherersAt = ArenaSlice(&arenaBytes, sizeof(QM_GathererQuad *) * modelTotalGatherers);
+    size_t unshotPowersAt = ArenaSlice(&arenaBytes, sizeof(float) * 3 * modelTotalShooters);
+    size_t gathererAreasAt = ArenaSlice(&arenaBytes, sizeof(float) * modelTotalGatherers);
+    size_t gathererInvAreasAt = ArenaSlice(&arenaBytes, sizeof(float) * modelTotalGatherers);
+    size_t radiositiesAt = ArenaSlice(&arenaBytes, sizeof(float) * 3 * modelTotalGatherers);
+    size_t gathererReflectivitiesAt = ArenaSlice(&arenaBytes, sizeof(float) * 3 * modelTotalGatherers);
+    size_t gathererEmissionsAt = ArenaSlice(&arenaBytes, sizeof(float) * 3 * modelTotalGatherers);
+    size_t gathererShootersAt = ArenaSlice(&arenaBytes, sizeof(int) * modelTotalGatherers);
+    size_t vertexQuadStartAt = ArenaSlice(&arenaBytes, sizeof(int) * (4 * modelTotalGatherers + 1));
+
+    char *arena = (char *)ArenaAlloc(arenaBytes, m->useHugePages);
+    m->arena = arena;
+    m->arenaBytes = arenaBytes;
+    m->totalShooters = modelTotalShooters;
+    m->totalGatherers = modelTotalGatherers;
+    m->shooters = (QM_ShooterQuad **)(arena + shootersAt);
+    m->gatherers = (QM_GathererQuad **)(arena + gatherersAt);
+    m->unshotPowers = (float (*)[3])(arena + unshotPowersAt);
+    m->gathererAreas = (float *)(arena + gathererAreasAt);
+    m->gathererInvAreas = (float *)(arena + gathererInvAreasAt);
+    m->radiosities = (float (*)[3])(arena + radiositiesAt);
+    m->gathererReflectivities = (float (*)[3])(arena + gathererReflectivitiesAt);
+    m->gathererEmissions = (float (*)[3])(arena + gathererEmissionsAt);
+    m->gathererShooters = (int *)(arena + gathererShootersAt);
+    m->vertexQuadStart = (int *)(arena + vertexQuadStartAt);
+
+    QM_ShooterQuad *shooterQuads = (QM_ShooterQuad *)(arena + shooterQuadsAt);
+    QM_GathererQuad *gathererQuads = (QM_GathererQuad *)(arena + gathererQuadsAt);
+    for (int s = 0; s < m->numSurfaces; s++)
+    {
+        m->surfaces[s].shooters = shooterQuads;
+        m->surfaces[s].gatherers = gathererQuads;
+        shooterQuads += m->surfaces[s].numShooterQuads;
+        gathererQuads += m->surfaces[s].numGathererQuads;
+    }
+
 
-        // Compute how many regular segments to divide the longest edge into so that 
-        // every resulting segment is not longer than maxShooterQuadEdgeLength.
-        int numSegments = (int)ceil(maxEdgeLen / m->maxShooterQuadEdgeLength);
+    // Subdivide original quads to get shooter quads.
 
-        // Each original quad on the current surface is going to be subdivided into
-        // (numSegments*numSegments) shooter quads.
-        // Therefore, the total number of shooter quads for this surface is...
-        surface->numShooterQuads = surface->numOrigQuads * numSegments * numSegments;
+    int modelTotalShootersCount = 0;
 
-        surface->shooters = (QM_ShooterQuad *)CheckedMalloc(sizeof(QM_ShooterQuad) * surface->numShooterQuads);
-        int surfShootersCount = 0;  // This will contain the number of shooters in this surface.
+    for (int s = 0; s < m->numSurfaces; s++)
+    {
+        QM_Surface *surface = &(m->surfaces[s]);
 
         for (int q = 0; q < surface->numOrigQuads; q++)
         {
             QM_OrigQuad *origQuad = &(surface->origQuads[q]);
 
-            for (int y = 0; y < numSegments; y++)
-                for (int x = 0; x < numSegments; x++)
+            for (int y = 0; y < origQuad->numShooters[1]; y++)
+                for (int x = 0; x < origQuad->numShooters[0]; x++)
                 {
-                    float newv[4][3];
-                    QuadBilinearInterpolate(newv[0], (float)x / numSegments, (float)y / numSegments, origQuad->v);
-                    QuadBilinearInterpolate(newv[1], (float)(x + 1) / numSegments, (float)y / numSegments, origQuad->v);
-                    QuadBilinearInterpolate(newv[2], (float)(x + 1) / numSegments, (float)(y + 1) / numSegments, origQuad->v);
-                    QuadBilinearInterpolate(newv[3], (float)x / numSegments, (float)(y + 1) / numSegments, origQuad->v);
-
-                    QM_ShooterQuad *shooterQuad = &(surface->shooters[surfShootersCount]);
-                    for (int i = 0; i < 4; i++) CopyArray3(shooterQuad->v[i], newv[i]);
+                    QM_ShooterQuad *shooterQuad = &(surface->shooters[origQuad->firstShooter + y * origQuad->numShooters[0] + x]);
+                    ShooterVertices(origQuad, x, y, shooterQuad->v);
                     QuadCentroid(shooterQuad->centroid, shooterQuad->v);
                     CopyArray3(shooterQuad->normal, origQuad->normal);
                     shooterQuad->area = QuadArea(shooterQuad->v);
-
-                    // Initialize the unshot power of the shooter quad.
-                    shooterQuad->unshotPower[0] = surface->emission[0] * shooterQuad->area;
-                    shooterQuad->unshotPower[1] = surface->emission[1] * shooterQuad->area;
-                    shooterQuad->unshotPower[2] = surface->emission[2] * shooterQuad->area;
-
                     shooterQuad->surface = surface;
-                    surfShootersCount++;
-                    modelTotalShooters++;
+                    shooterQuad->origQuad = origQuad;
+
+                    m->shooters[modelTotalShootersCount] = shooterQuad;
+                    shooterQuad->index = modelTotalShootersCount;
+                    modelTotalShootersCount++;
                 }
         }
     }
 
 
-    // Build an array of pointers to all the shooters in the model.
-    m->totalShooters = modelTotalShooters;
-    m->shooters = (QM_ShooterQuad **)CheckedMalloc(sizeof(QM_ShooterQuad *) * modelTotalShooters);
-    int modelTotalShootersCount = 0;
-
-    for (int s = 0; s < m->numSurfaces; s++)
-        for (int q = 0; q < m->surfaces[s].numShooterQuads; q++)
-        {
-            m->shooters[modelTotalShootersCount] = &(m->surfaces[s].shooters[q]);
-            modelTotalShootersCount++;
-        }
-
-
     // Subdivide shooter quads to get gatherer quads.
 
-    int modelTotalGatherers = 0;        // This will contain the total number of gatherers quads in model.
+    int modelTotalGatherersCount = 0;
 
     for (int s = 0; s < m->numSurfaces; s++)
     {
         QM_Surface *surface = &(m->surfaces[s]);
-
-        // Find longest edge length of all shooter quads in the current surface.
-        float maxEdgeLen = 0.0f;
-        for (int q = 0; q < surface->numShooterQuads; q++)
-        {
-            QM_ShooterQuad *shooterQuad = &(surface->shooters[q]);
-            float edgeLen;
-            edgeLen = VecDist(shooterQuad->v[0], shooterQuad->v[1]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(shooterQuad->v[1], shooterQuad->v[2]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(shooterQuad->v[2], shooterQuad->v[3]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-            edgeLen = VecDist(shooterQuad->v[3], shooterQuad->v[0]);
-            if (edgeLen > maxEdgeLen) maxEdgeLen = edgeLen;
-        }
-
-        // Compute how many regular segments to divide the longest edge into so that 
-        // every resulting segment is not longer than maxGathererQuadEdgeLength.
-        int numSegments = (int)ceil(maxEdgeLen / m->maxGathererQuadEdgeLength);
-
-        // Each shooter quad on the current surface is going to be subdivided into
-        // (numSegments*numSegments) gatherer quads.
-        // Therefore, the total number of gatherer quads for this surface is...
-        surface->numGathererQuads = surface->numShooterQuads * numSegments * numSegments;
-
-        surface->gatherers = (QM_GathererQuad *)CheckedMalloc(sizeof(QM_GathererQuad) * surface->numGathererQuads);
         int surfGatherersCount = 0;  // This will contain the number of gatherers in this surface.
 
         for (int q = 0; q < surface->numShooterQuads; q++)
         {
             QM_ShooterQuad *shooterQuad = &(surface->shooters[q]);
+            CountSegments(shooterQuad->numGatherers, shooterQuad->v, m->maxGathererQuadEdgeLength);
+            shooterQuad->firstGatherer = surfGatherersCount;
+            int nx = shooterQuad->numGatherers[0], ny = shooterQuad->numGatherers[1];
 
-            for (int y = 0; y < numSegments; y++)
-                for (int x = 0; x < numSegments; x++)
+            for (int y = 0; y < ny; y++)
+                for (int x = 0; x < nx; x++)
                 {
-                    float newv[4][3];
-                    QuadBilinearInterpolate(newv[0], (float)x / numSegments, (float)y / numSegments, shooterQuad->v);
-                    QuadBilinearInterpolate(newv[1], (float)(x + 1) / numSegments, (float)y / numSegments, shooterQuad->v);
-                    QuadBilinearInterpolate(newv[2], (float)(x + 1) / numSegments, (float)(y + 1) / numSegments, shooterQuad->v);
-                    QuadBilinearInterpolate(newv[3], (float)x / numSegments, (float)(y + 1) / numSegments, shooterQuad->v);
-
                     QM_GathererQuad *gathererQuad = &(surface->gatherers[surfGatherersCount]);
-                    for (int i = 0; i < 4; i++) CopyArray3(gathererQuad->v[i], newv[i]);
-                    CopyArray3(gathererQuad->normal, shooterQuad->normal);
-                    gathererQuad->area = QuadArea(gathererQuad->v);
-
-                    // Initialize the radiosity of the gatherer quad.
-                    gathererQuad->radiosity[0] = surface->emission[0];
-                    gathererQuad->radiosity[1] = surface->emission[1];
-                    gathererQuad->radiosity[2] = surface->emission[2];
-
-                    CopyArray3(gathererQuad->vRadiosity[0], ZERO_VEC_3F);
-                    CopyArray3(gathererQuad->vRadiosity[1], ZERO_VEC_3F);
-                    CopyArray3(gathererQuad->vRadiosity[2], ZERO_VEC_3F);
-                    CopyArray3(gathererQuad->vRadiosity[3], ZERO_VEC_3F);
-
                     gathererQuad->shooter = shooterQuad;
-                    gathererQuad->surface = surface;
+                    gathererQuad->x = (unsigned short)x;
+                    gathererQuad->y = (unsigned short)y;
                     surfGatherersCount++;
-                    modelTotalGatherers++;
+
+                    // Set up its solver state, apart from the radiosity.
+                    int g = modelTotalGatherersCount;
+                    m->gatherers[g] = gathererQuad;
+                    gathererQuad->index = g;
+                    float v[4][3];
+                    QM_GathererVertices(gathererQuad, v);
+                    m->gathererAreas[g] = QuadArea(v);
+                    m->gathererInvAreas[g] = 1.0f / m->gathererAreas[g];
+                    CopyArray3(m->gathererReflectivities[g], surface->reflectivity);
+                    CopyArray3(m->gathererEmissions[g], surface->emission);
+                    m->gathererShooters[g] = shooterQuad->index;
+                    modelTotalGatherersCount++;
                 }
         }
     }
 
+    QM_ResetSolverState(m);
+    BuildVertexAdjacency(m);
+    return;
+}
+
+
+
+static inline void HashBytes(unsigned long long *hash, const void *data, size_t numBytes)
+// Add bytes to a 64-bit FNV-1a hash.
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < numBytes; i++)
+    {
+        *hash ^= bytes[i];
+        *hash *= 0x100000001B3ull;
+    }
+}
+
+
+void QM_ResetSolverState(QM_Model *m)
+// Set the radiosity of each gatherer quad to the emission of its surface, and the unshot power of
+// each shooter quad to the power it emits.
+{
+    for (int q = 0; q < m->totalShooters; q++)
+    {
+        const QM_ShooterQuad *shooterQuad = m->shooters[q];
+        m->unshotPowers[q][0] = shooterQuad->surface->emission[0] * shooterQuad->area;
+        m->unshotPowers[q][1] = shooterQuad->surface->emission[1] * shooterQuad->area;
+        m->unshotPowers[q][2] = shooterQuad->surface->emission[2] * shooterQuad->area;
+    }
+
+    for (int g = 0; g < m->totalGatherers; g++)
+        CopyArray3(m->radiosities[g], m->gathererEmissions[g]);
+}
 
-    // Build an array of pointers to all the gatherers in the model.
-    m->totalGatherers = modelTotalGatherers;
-    m->gatherers = (QM_GathererQuad **)CheckedMalloc(sizeof(QM_GathererQuad *) * modelTotalGatherers);
-    int modelTotalGatherersCount = 0;
+
+
+unsigned long long QM_GeometryHash(const QM_Model *m)
+// Returns a 64-bit hash of the subdivided geometry.
+{
+    unsigned long long hash = 0xCBF29CE484222325ull;
+    HashBytes(&hash, &m->maxShooterQuadEdgeLength, sizeof(float));
+    HashBytes(&hash, &m->maxGathererQuadEdgeLength, sizeof(float));
+    HashBytes(&hash, &m->numSurfaces, sizeof(int));
 
     for (int s = 0; s < m->numSurfaces; s++)
-        for (int q = 0; q < m->surfaces[s].numGathererQuads; q++)
+    {
+        const QM_Surface *surface = &(m->surfaces[s]);
+        HashBytes(&hash, &surface->numOrigQuads, sizeof(int));
+        HashBytes(&hash, &surface->numShooterQuads, sizeof(int));
+        HashBytes(&hash, &surface->numGathererQuads, sizeof(int));
+
+        for (int q = 0; q < surface->numShooterQuads; q++)
         {
-            m->gatherers[modelTotalGatherersCount] = &(m->surfaces[s].gatherers[q]);
-            modelTotalGatherersCount++;
+            HashBytes(&hash, surface->shooters[q].v, sizeof(float) * 4 * 3);
+            HashBytes(&hash, surface->shooters[q].normal, sizeof(float) * 3);
         }
+        for (int q = 0; q < surface->numGathererQuads; q++)
+        {
+            float v[4][3];
+            QM_GathererVertices(&surface->gatherers[q], v);
+            HashBytes(&hash, v, sizeof(float) * 4 * 3);
+            HashBytes(&hash, surface->gatherers[q].shooter->normal, sizeof(float) * 3);
+        }
+    }
+    return hash;
+}
 
-    return;
+
+
+void QM_GathererVertices(const QM_GathererQuad *g, float v[4][3])
+// Compute the 4 vertices of a gatherer quad by bilinear interpolation of its shooter quad,
+// as the quad was subdivided.
+{
+    const QM_ShooterQuad *shooterQuad = g->shooter;
+    int nx = shooterQuad->numGatherers[0], ny = shooterQuad->numGatherers[1];
+    int x = g->x, y = g->y;
+    QuadBilinearInterpolate(v[0], (float)x / nx, (float)y / ny, shooterQuad->v);
+    QuadBilinearInterpolate(v[1], (float)(x + 1) / nx, (float)y / ny, shooterQuad->v);
+    QuadBilinearInterpolate(v[2], (float)(x + 1) / nx, (float)(y + 1) / ny, shooterQuad->v);
+    QuadBilinearInterpolate(v[3], (float)x / nx, (float)(y + 1) / ny, shooterQuad->v);
 }
 
 
@@ -575,41 +947,43 @@ void QM_ComputeVertexRadiosities(QM_Model *m)
 // the radiosities of the quads that use the vertex.
 {
     if (m == NULL || m->numSurfaces <= 0) return;
+    QM_AllocVertexRadiosities(m);
+    QM_ComputeVertexRadiosities(m, 0, m->totalGatherers);
+}
 
-    for (int s = 0; s < m->numSurfaces; s++)
-    {
-        QM_Surface *surface = &(m->surfaces[s]);
 
-        for (int g = 0; g < surface->numGathererQuads; g++)
-        {
-            QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+void QM_AllocVertexRadiosities(QM_Model *m)
+// Allocate m->vertexRadiosities if it is not allocated yet.
+{
+    if (m->vertexRadiosities == NULL)
+        m->vertexRadiosities = (float (*)[4][3])CheckedMalloc(sizeof(float) * 12 * (m->totalGatherers > 0 ? m->totalGatherers : 1));
+}
 
-            for (int i = 0; i < 4; i++)
-            {
-                int numQuadsUsingVertex = 0;
-                CopyArray3(gatherer->vRadiosity[i], ZERO_VEC_3F);
 
-                for (int g2 = 0; g2 < surface->numGathererQuads; g2++)
-                {
-                    QM_GathererQuad *gatherer2 = &(surface->gatherers[g2]);
+void QM_ComputeVertexRadiosities(QM_Model *m, int begin, int end)
+// Compute the vertex radiosities of gatherers[begin] to gatherers[end - 1] only.
+{
+    for (int g = begin; g < end; g++)
+    {
+        float (*vRadiosity)[3] = m->vertexRadiosities[g];
 
-                    for (int i2 = 0; i2 < 4; i2++)
-                    {
-                        float sqrDist = VecSqrDist(gatherer->v[i], gatherer2->v[i2]);
-                        if (sqrDist <= EQUAL_VERTEX_THRESHOLD)
-                        {
-                            gatherer->vRadiosity[i][0] += gatherer2->radiosity[0];
-                            gatherer->vRadiosity[i][1] += gatherer2->radiosity[1];
-                            gatherer->vRadiosity[i][2] += gatherer2->radiosity[2];
-                            numQuadsUsingVertex++;
-                        }
-                    }
-                }
+        for (int i = 0; i < 4; i++)
+        {
+            int first = m->vertexQuadStart[4 * g + i], last = m->vertexQuadStart[4 * g + i + 1];
+            CopyArray3(vRadiosity[i], ZERO_VEC_3F);
 
-                gatherer->vRadiosity[i][0] /= numQuadsUsingVertex;
-                gatherer->vRadiosity[i][1] /= numQuadsUsingVertex;
-                gatherer->vRadiosity[i][2] /= numQuadsUsingVertex;
+            for (int k = first; k < last; k++)
+            {
+                const float *radiosity2 = m->radiosities[m->vertexQuads[k]];
+                vRadiosity[i][0] += radiosity2[0];
+                vRadiosity[i][1] += radiosity2[1];
+                vRadiosity[i][2] += radiosity2[2];
             }
+
+            int numQuadsUsingVertex = last - first;
+            vRadiosity[i][0] /= numQuadsUsingVertex;
+            vRadiosity[i][1] /= numQuadsUsingVertex;
+            vRadiosity[i][2] /= numQuadsUsingVertex;
         }
     }
 }
@@ -622,6 +996,8 @@ void QM_WriteGatherersToFile(const char *filename, const QM_Model *m)
     char badWrite[] = "Error writing to file";
 
     if (m == NULL || m->totalGatherers <= 0) return;
+    if (m->vertexRadiosities == NULL)
+        ShowFatalError(__FILE__, __LINE__, "Vertex radiosities must be computed before writing \"%s\"", filename);
 
     // Open output file.
     FILE *fp = fopen(filename, "w");
@@ -634,16 +1010,18 @@ void QM_WriteGatherersToFile(const char *filename, const QM_Model *m)
 
     for (int q = 0; q < m->totalGatherers; q++)
     {
-        QM_GathererQuad *gatherer = m->gatherers[q];
+        float v[4][3];
+        QM_GathererVertices(m->gatherers[q], v);
+        const float (*vRadiosity)[3] = m->vertexRadiosities[q];
 
         // For each quad, write each 3D vertex and its vertex radiosity.
         for (int i = 0; i < 4; i++)
         {
-            if (fprintf(fp, "%.6g %.6g %.6g\n", gatherer->v[i][0], gatherer->v[i][1], gatherer->v[i][2]) < 0)
+            if (fprintf(fp, "%.6g %.6g %.6g\n", v[i][0], v[i][1], v[i][2]) < 0)
                 ShowFatalError(__FILE__, __LINE__, "%s \"%s\"", badWrite, filename);
 
             // Write its RGB radiosity values.
-            if (fprintf(fp, "%.3f %.3f %.3f\n", gatherer->vRadiosity[i][0], gatherer->vRadiosity[i][1], gatherer->vRadiosity[i][2]) < 0)
+            if (fprintf(fp, "%.3f %.3f %.3f\n", vRadiosity[i][0], vRadiosity[i][1], vRadiosity[i][2]) < 0)
                 ShowFatalError(__FILE__, __LINE__, "%s \"%s\"", badWrite, filename);
         }
     }
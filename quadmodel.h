@@ -1,6 +1,8 @@
 #ifndef _QUADMODEL_H_
 #define _QUADMODEL_H_
 
+#include <stddef.h>
+
 // The followings define the three quadrilateral types. 
 // A quadrilateral may be the original input quadrilateral,
 // a subdivided shooter quadrilateral, or a subdivided gatherer quadrilateral.
@@ -12,6 +14,8 @@ struct QM_Surface;  // Forward declaration.
 typedef struct QM_OrigQuad {
     float v[4][3];          // 3D coordinates of the 4 vertices of the quadrilateral.
     float normal[3];        // Unit normal vector.
+    int numShooters[2];     // Number of shooter quads along the v[0]v[1] and v[0]v[3] edges.
+    int firstShooter;       // Index of its first shooter quad in QM_Surface::shooters[]. They are row by row.
 }
 QM_OrigQuad;
 
@@ -21,22 +25,23 @@ typedef struct QM_ShooterQuad {
     float centroid[3];      // Centroid of the 4 vertices. A hemicube is placed at here.
     float normal[3];        // Unit normal vector.
     float area;             // Surface area of quadrilateral.
-    float unshotPower[3];   // Unshot RGB light power = unshot radiosity * quad area.
     QM_Surface *surface;    // Pointer to the surface which the quadrilateral belongs to.
+    QM_OrigQuad *origQuad;  // Pointer to the original quadrilateral it is subdivided from.
+    int index;              // Index of the quadrilateral in QM_Model::shooters[].
+    int numGatherers[2];    // Number of gatherer quads along the v[0]v[1] and v[0]v[3] edges.
+    int firstGatherer;      // Index of its first gatherer quad in QM_Surface::gatherers[]. They are row by row.
 }
 QM_ShooterQuad;
 
 
 typedef struct QM_GathererQuad {
-    float v[4][3];          // 3D coordinates of the 4 vertices of the quadrilateral.
-    float normal[3];        // Unit normal vector.
-    float area;             // Surface area of quadrilateral.
-    float radiosity[3];     // The patch radiosity.
-    float vRadiosity[4][3]; // The radiosities at the vertices.
-    QM_ShooterQuad *shooter;    // Pointer to its parent shooter quadrilateral.
-    QM_Surface *surface;        // Pointer to the surface which the quadrilateral belongs to.
+    QM_ShooterQuad *shooter;    // Pointer to its parent shooter quadrilateral, which has its normal and surface.
+    unsigned short x, y;        // Column and row of the quadrilateral in the grid of gatherer quads of its shooter.
+    int index;                  // Index of the quadrilateral in QM_Model::gatherers[].
 }
 QM_GathererQuad;
+// The vertices of a gatherer quad are not stored, but computed from its shooter quad when needed
+// by QM_GathererVertices, and its area is in QM_Model::gathererAreas[].
 
 
 
@@ -48,10 +53,10 @@ typedef struct QM_Surface {
     QM_OrigQuad *origQuads;     // Array of QM_OrigQuad.
 
     int numShooterQuads;        // Number of shooter quadrilaterals on the surface.
-    QM_ShooterQuad *shooters;   // Array of QM_ShooterQuad.
+    QM_ShooterQuad *shooters;   // Array of QM_ShooterQuad, in the arena of the model.
 
     int numGathererQuads;       // Number of shooter quadrilaterals on the surface.
-    QM_GathererQuad *gatherers; // Array of QM_GathererQuad.
+    QM_GathererQuad *gatherers; // Array of QM_GathererQuad, in the arena of the model.
 }
 QM_Surface;
 
@@ -68,6 +73,11 @@ typedef struct QM_Model {
                                       // maxShooterQuadEdgeLength, and each gatherer quad cannot 
                                       // have edge longer than maxGathererQuadEdgeLength.
 
+    bool useHugePages;              // Whether QM_Subdivide asks for huge pages for the arena.
+    void *arena;                    // A single allocation made by QM_Subdivide, which holds the shooter and
+    size_t arenaBytes;              // gatherer quads of all the surfaces, the arrays of pointers to them,
+                                    // the solver state and vertexQuadStart[].
+
     int totalShooters;              // Total number of shooter quadrilaterals on all surfaces.
     QM_ShooterQuad **shooters;      // Array of pointers to all QM_ShooterQuad.
                                     // NOTE: Use this array to search the shooters for the
@@ -81,6 +91,25 @@ typedef struct QM_Model {
                                     // unique ID, and use it to index this array to access the 
                                     // corresponding gatherer quad.
 
+    // The state of the solvers, in arrays indexed like shooters[] and gatherers[], so that the loops
+    // over the form factors only bring the values they use into the cache. The quads above keep
+    // the geometry and the vertex radiosities.
+    float (*unshotPowers)[3];           // Unshot RGB light power of each shooter quad = unshot radiosity * quad area.
+    float *gathererAreas;               // Surface area of each gatherer quad.
+    float *gathererInvAreas;            // 1 / surface area of each gatherer quad.
+    float (*radiosities)[3];            // The patch radiosity of each gatherer quad.
+    float (*gathererReflectivities)[3]; // The reflectivity of the surface of each gatherer quad.
+    float (*gathererEmissions)[3];      // The emission of the surface of each gatherer quad.
+    int *gathererShooters;              // Index in shooters[] of the parent shooter quad of each gatherer quad.
+    float (*vertexRadiosities)[4][3];   // The radiosities at the vertices of each gatherer quad. Only allocated
+                                        // when they are computed for output.
+
+    int *vertexQuadStart;           // The gatherer quads around vertex i of gatherers[g] are
+    int *vertexQuads;               // gatherers[vertexQuads[k]] for k from vertexQuadStart[4 * g + i]
+                                    // to (vertexQuadStart[4 * g + i + 1] - 1): those on the same surface
+                                    // with a vertex there, and those with it inside an edge (T-junction).
+    int numTJunctions;              // Number of gatherer vertices that are T-junctions.
+
     // Axis-aligned bounding box (AABB).
     float min_xyz[3];       // Corner of bounding box with minimum x, y, z.
     float max_xyz[3];       // Corner of bounding box with maximum x, y, z.
@@ -110,12 +139,35 @@ extern void QM_Subdivide(QM_Model *m);
 // shooter quads and even-smaller gatherer quads.
 // Each shooter quad cannot have edge longer than maxShooterQuadEdgeLength, and
 // each gatherer quad cannot have edge longer than maxGathererQuadEdgeLength.
+// The quads and the solver state are allocated in the arena of the model.
+// Each quad gets its own number of segments along each of its 2 axes. The gatherer quads
+// around each gatherer vertex are recorded for the vertex radiosities.
+
+extern void QM_ResetSolverState(QM_Model *m);
+// Set the radiosity of each gatherer quad to the emission of its surface, and the unshot power of
+// each shooter quad to the power it emits. QM_Subdivide starts from this state.
+
+extern unsigned long long QM_GeometryHash(const QM_Model *m);
+// Returns a 64-bit hash of the subdivided geometry: the maximum edge lengths, the number of
+// quads of each level on each surface, and the vertices and normals of the shooter and gatherer
+// quads. The reflectivities and emissions of the surfaces do not change it.
+
+extern void QM_GathererVertices(const QM_GathererQuad *g, float v[4][3]);
+// Compute the 4 vertices of a gatherer quad by bilinear interpolation of its shooter quad.
 
 extern void QM_ComputeVertexRadiosities(QM_Model *m);
 // Compute the radiosities at the vertices by averaging 
 // the radiosities of the quads that use the vertex.
 
+extern void QM_AllocVertexRadiosities(QM_Model *m);
+// Allocate m->vertexRadiosities if it is not allocated yet.
+
+extern void QM_ComputeVertexRadiosities(QM_Model *m, int begin, int end);
+// Compute the vertex radiosities of gatherers[begin] to gatherers[end - 1] only, so that
+// different ranges can be computed concurrently. QM_AllocVertexRadiosities must be called first.
+
 extern void QM_WriteGatherersToFile(const char *filename, const QM_Model *m);
 // Write the gatherer quads and their vertex radiosity values to a file.
+// The vertex radiosities must have been computed.
 
 #endif
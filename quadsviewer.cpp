@@ -411,13 +411,15 @@ static GLuint MakeGathererQuadsDisplayList(const QM_Model *m)
         glBegin(GL_QUADS);
         for (int q = 0; q < m->surfaces[s].numGathererQuads; q++)
         {
-            QM_GathererQuad *quad = &(m->surfaces[s].gatherers[q]);
-
-            glNormal3fv(quad->normal);
-            glVertex3fv(quad->v[0]);
-            glVertex3fv(quad->v[1]);
-            glVertex3fv(quad->v[2]);
-            glVertex3fv(quad->v[3]);
+            const QM_GathererQuad *quad = &(m->surfaces[s].gatherers[q]);
+            float v[4][3];
+            QM_GathererVertices(quad, v);
+
+            glNormal3fv(quad->shooter->normal);
+            glVertex3fv(v[0]);
+            glVertex3fv(v[1]);
+            glVertex3fv(v[2]);
+            glVertex3fv(v[3]);
         }
         glEnd();
     }
@@ -12,6 +12,18 @@
 #include "common.h"
 #include "vector3.h"
 #include "quadmodel.h"
+#include "threadpool.h"
+#include "hemicube.h"
+#include "pqueue.h"
+#include "formfactor.h"
+#include "glcontext.h"
+#include "raycast.h"
+#include "hierarchy.h"
+#include "stochastic.h"
+#include "ffmatrix.h"
+#include "rowcache.h"
+#include "multigrid.h"
+#include "lowrank.h"
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -25,21 +37,142 @@ static const char inputModelFilename[] = "model.in";
 // Output model filename. This model contains the radiosity solution.
 static const char outputModelFilename[] = "model.out";
 
-// This value tells when to terminate the progressive refinement radiosity computation.
-// It sets the maximum number of iterations.
-static const int maxIterations = 250;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// RUNTIME OPTIONS, SET FROM THE COMMAND LINE
+/////////////////////////////////////////////////////////////////////////////
+
+// These values tell when to terminate the progressive refinement radiosity computation.
+// The computation stops as soon as any of the enabled conditions is met.
+static int maxIterations = 250;     // Maximum number of iterations. 0 means no limit.
+static double maxSeconds = 0.0;     // Maximum wall-clock time in seconds. 0 means no limit.
+static double residualEpsilon = -1.0;   // Stop when the total unshot power falls below this
+                                        // fraction of the total emitted power. 0 means never.
+                                        // The sweeps of the matrix and low-rank methods stop when the
+                                        // change of the power in a sweep does. Negative until set, and
+                                        // then the default of the method.
+
+// Default residualEpsilon of the matrix and low-rank methods. Their change of the power in a sweep
+// decreases geometrically but never reaches exactly 0, so they need a tolerance to stop early.
+#define DEFAULT_SWEEP_EPSILON   1e-4
+
+// Which renderer produces the hemicube item buffers.
+// The CPU renderer needs no display or GPU, and runs on all the worker threads.
+// The OpenGL renderers draw into an offscreen framebuffer, with the OpenGL context
+// of either a GLUT window (BACKEND_GL) or a headless EGL context (BACKEND_EGL).
+// BACKEND_RAY replaces the hemicube by cosine-weighted rays cast through a BVH on the CPU.
+// BACKEND_ANALYTIC computes the exact unoccluded form factor of every gatherer, scaled by
+// its visibility estimated with shadow rays through the BVH.
+enum HemicubeBackend { BACKEND_CPU, BACKEND_GL, BACKEND_EGL, BACKEND_RAY, BACKEND_ANALYTIC };
+static HemicubeBackend hemicubeBackend = BACKEND_CPU;
+
+// Which radiosity method is used.
+// METHOD_PROGRESSIVE shoots the power of one batch of shooters per iteration, with the
+// form factors of the chosen backend.
+// METHOD_HIERARCHICAL links elements of the original/shooter/gatherer quad hierarchy and
+// gathers over all the links in each iteration, with form factors scaled by shadow-ray
+// visibility. It needs no hemicube, so it does not use the backend.
+// METHOD_STOCHASTIC shoots the unshot power of all the shooters in each iteration with
+// random rays (stochastic Jacobi), and does not use the backend either.
+// METHOD_MATRIX computes the form factors of every shooter once with the backend, stores them
+// in a compressed sparse matrix, and solves the whole system with sweeps over the matrix.
+// METHOD_LOWRANK stores the form factors in blocks between clusters of quads, compressing the
+// blocks between distant clusters to low rank, and solves with Jacobi sweeps. Its form factors
+// are computed as the analytic backend does, so it does not use the backend either.
+enum SolverMethod { METHOD_PROGRESSIVE, METHOD_HIERARCHICAL, METHOD_STOCHASTIC, METHOD_MATRIX, METHOD_LOWRANK };
+static SolverMethod solverMethod = METHOD_PROGRESSIVE;
+
+// Form factor above which the hierarchical method links the children of two elements
+// instead of the elements themselves.
+static float linkFormFactorEpsilon = 0.05f;
+
+// The hierarchical method refines a link between iterations when its form factor times the
+// radiosity of its source is above this fraction of the highest emission of a surface.
+static float linkBFEpsilon = 0.005f;
+
+// Total number of rays of the stochastic method. Each iteration gets a share of them in
+// proportion to its unshot power. The noise decreases with the square root of the ray count.
+static int stochasticRays = 1 << 22;
+
+// Whether the matrix method solves with Jacobi sweeps, which gather all the gatherers in parallel
+// from the previous sweep, or with Gauss-Seidel sweeps, which run shooter by shooter on one thread
+// and use the newest radiosities, so they need fewer sweeps.
+static bool gaussSeidelSweeps = false;
+
+// Whether the matrix method first solves the coarse system of the shooter quads, made by summing
+// the rows of their gatherer quads, so that the gatherer-level sweeps only correct what remains.
+static bool multigridSolve = false;
+
+// Relative accuracy to which the low-rank method compresses the blocks between distant clusters.
+static float acaEpsilon = 0.05f;
+
+// Cache file of the form factor matrix of the matrix method, or NULL for none. The matrix is
+// reused by later runs with the same subdivided geometry and form factor settings, such as runs
+// that only change the reflectivities and emissions of the surfaces.
+static const char *formFactorCacheFilename = NULL;
+
+// Memory budget in megabytes of the cache of the form factor rows of progressive refinement.
+// A shooter that is shot again reuses its cached row instead of rendering its hemicube.
+// 0 disables the cache.
+static double rowCacheMegabytes = 256.0;
+
+// Overshooting (over-relaxation) factor of progressive refinement. A shooter also shoots
+// this times the power it is estimated to receive back from the rest of the scene, which is
+// its reflectivity times the ambient unshot radiosity. 0 shoots exactly the unshot power.
+static double overshootFactor = 0.0;
+
+// Whether the progressive and stochastic methods add an ambient term to the radiosities they
+// write out, to stand in for the light that has not been shot yet when they stop.
+static bool addAmbientTerm = false;
+
+// Whether the subdivided model asks for huge pages, which cut the TLB misses of the solver loops
+// over large models.
+static bool useHugePages = false;
+
+// Hemicube resolution. The top face is hemicubeRes x hemicubeRes pixels,
+// and each side face is hemicubeRes x (hemicubeRes / 2) pixels. Must be even number.
+static int hemicubeRes = 600;
+
+// Whether the OpenGL backends render the 5 faces of a hemicube into one atlas and read it
+// back at once, instead of rendering and reading back the faces one at a time.
+// The atlas is hemicubeRes pixels wide and stacks the top face and the 4 side faces.
+static bool hemicubeAtlas = true;
+
+// Number of pixel pack buffers of the OpenGL backends. The item buffers of up to
+// (readbackBuffers - 1) hemicube faces or atlases are transferred asynchronously while
+// the CPU works on an earlier one. 0 means read back synchronously.
+static int readbackBuffers = 3;
+
+// Number of rays cast from each shooter by the ray-casting backend, rounded up to a square
+// number. The error of the form factors decreases with the square root of the ray count.
+static int raysPerShooter = 65536;
+
+// Number of shadow rays per gatherer of the analytic backend, rounded up to a square number.
+static int shadowRaysPerGatherer = 4;
+
+// Number of worker threads. 0 means use all the hardware threads.
+static int numThreads = 0;
+
+// Number of shooters shot together in each iteration.
+// The batchSize shooters with the highest unshot power have their hemicubes rendered
+// concurrently, and their contributions are then merged in one pass (a Jacobi-style step).
+// Each shooter in the batch needs its own hemicube buffers.
+static int batchSize = 1;
 
 
 /////////////////////////////////////////////////////////////////////////////
 // CONSTANTS
 /////////////////////////////////////////////////////////////////////////////
 
-// Window size.
-static int winWidthHeight = 600;     // Window width & height in pixels. Must be even number.
+// Window size. The hemicube is rendered into an offscreen framebuffer, so the window
+// of the GLUT backend only provides the OpenGL context, and its size does not matter.
+static const int winWidthHeight = 256;
 
 // Use white background, so that it will not conflict
 // with the colors of the the gatherer quads.
-static const float backgroundColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+// Alpha is 0 everywhere, so that an RGBA pixel read as a 32-bit integer is the item ID.
+static const float backgroundColor[4] = { 1.0f, 1.0f, 1.0f, 0.0f };
 
 // An integer corresponding to the RGB color [255, 255, 255].
 static const int backgroundColorInt = (255 * 256 + 255) * 256 + 255;
@@ -55,16 +188,89 @@ static QM_Model model;
 // OpenGL display list.
 static GLuint gathererQuadsDList = 0;
 
+// Offscreen framebuffer for rendering the hemicube faces, of size hemicubeRes x hemicubeRes,
+// or hemicubeRes x (3 * hemicubeRes) for the hemicube atlas.
+static GLC_Framebuffer hemicubeFramebuffer;
+
+// Buffers for reading back the OpenGL item buffers of the 5 hemicube faces.
+static GLubyte *colorBuf = NULL;
+static GLuint *itemBufs[HC_NUM_FACES] = { NULL };
+
+// Item buffer of the hemicube atlas, for synchronous readback.
+static GLuint *atlasItemBuf = NULL;
+
+// Pixel pack buffers for the asynchronous readback of the hemicube faces, used in turn.
+static GLuint *readbackPBOs = NULL;
+
+// Scene of the CPU renderer, and a hemicube for each shooter in a batch.
+static HC_Scene hcScene;
+static HC_Hemicube *hemicubes = NULL;
+
+// Priority queue of the shooter quads, keyed on their total RGB unshot power.
+// Its items are the indices into model.shooters[].
+static PQ_MaxHeap shooterQueue;
+
+// Reduction of item buffers to per-gatherer form factors, and the
+// form factor row of each shooter in a batch.
+static FF_Reducer ffReducer;
+static FF_Row *shooterRows = NULL;
+
+// Cache of the form factor rows of the shooters that have been shot.
+static LC_Cache rowCache;
+
 // Pre-computed delta form factors lookup tables.
 static float *topDeltaFormFactors = NULL;
 static float *sideDeltaFormFactors = NULL;
 
+// Prefix sums of each row of the delta form factors lookup tables.
+static double *topRowPrefixSums = NULL;
+static double *sideRowPrefixSums = NULL;
+
+// Row prefix sums of the delta form factors in the layout of the hemicube atlas.
+static double *atlasRowPrefixSums = NULL;
+
+// BVH of the gatherer quads for the ray-casting backend, and the hit buffer of each
+// shooter in a batch, holding rayGridRes x rayGridRes hit gatherer IDs. Every ray
+// carries the same fraction of the form factor, which the row prefix sums are made of.
+static RC_Bvh rayBvh;
+static int rayGridRes = 0;
+static unsigned int **rayHitBufs = NULL;
+static double *rayRowPrefixSums = NULL;
+static unsigned int rayShotCount = 0;     // Number of shots so far, which seeds the rays of each shot.
+
+// Dense form factors from the shooter to every gatherer for each shooter in a batch,
+// and the shadow ray grid size of the analytic backend.
+static float **analyticFormFactors = NULL;
+static int shadowGridRes = 0;
+
+// Element hierarchy and links of the hierarchical method.
+static HR_Hierarchy hierarchy;
+
+// Accumulators of the stochastic method.
+static SJ_Solver sjSolver;
+
+// Form factors of the matrix method.
+static FM_Matrix ffMatrix;
+
+// Whether ffMatrix was mapped from the cache file, in which case no form factor backend is set up.
+static bool formFactorsCached = false;
+
+// Blocks of form factors of the low-rank method.
+static LR_Operator lrOperator;
+
 
 
 /////////////////////////////////////////////////////////////////////////////
 // HELPER FUNCTIONS.
 /////////////////////////////////////////////////////////////////////////////
 
+static inline bool UsesOpenGL(void)
+{
+    return hemicubeBackend == BACKEND_GL || hemicubeBackend == BACKEND_EGL;
+}
+
+
+
 static GLuint RGBToUnsignedInt(const GLubyte rgb[3])
 // Convert RGB 8-bit triplets to an integer.
 // Note that R is the lowest byte of rgb[3].
@@ -86,25 +292,39 @@ static void UnsignedIntToRGB(GLubyte rgb[3], unsigned int i)
 
 
 
-static void ReadColorBuffer(GLubyte *buf, bool frontBuffer, int x, int y, int width, int height)
-// Read the RGB color buffer in the window region of size width x height.
-// The bottom-left corner of this window region is at (x, y).
-// If frontBuffer == true, it reads the front buffer, otherwise, the back buffer.
+static void ReadColorBuffer(GLubyte *buf, int x, int y, int width, int height)
+// Read the RGB color buffer of the hemicube framebuffer in the region of size width x height.
+// The bottom-left corner of this region is at (x, y).
 // The read color buffer region is stored in the 1-D array buf[], which must be
 // pre-allocated enough memory space.
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    if (frontBuffer)
-        glReadBuffer(GL_FRONT);
-    else
-        glReadBuffer(GL_BACK);
     glReadPixels(x, y, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void *)buf);
     glPopAttrib();
 }
 
 
 
+static void ColorBufferToItemBuffer(GLuint itemBuf[], const GLubyte colorBuf[], int numPixels)
+// Convert the RGB colors read from the color buffer to gatherer quad IDs.
+// The pixels are converted in chunks on the thread pool.
+{
+    const int CHUNK_PIXELS = 1 << 15;
+    int numChunks = (numPixels + CHUNK_PIXELS - 1) / CHUNK_PIXELS;
+
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_PIXELS, numPixels);
+        for (int i = chunk * CHUNK_PIXELS; i < end; i++)
+        {
+            itemBuf[i] = RGBToUnsignedInt(&colorBuf[3 * i]);
+            if (itemBuf[i] == (GLuint)backgroundColorInt) itemBuf[i] = HC_BACKGROUND_ITEM;
+        }
+    });
+}
+
+
+
 static GLuint MakeGathererQuadsDisplayList(const QM_Model *m)
 // Build a OpenGL display list for all the gatherer quads.
 // Each gatherer quad is rendered in a unique color.
@@ -117,13 +337,14 @@ static GLuint MakeGathererQuadsDisplayList(const QM_Model *m)
     glBegin(GL_QUADS);
     for (int q = 0; q < m->totalGatherers; q++)
     {
-        QM_GathererQuad *quad = m->gatherers[q];
+        float v[4][3];
+        QM_GathererVertices(m->gatherers[q], v);
         UnsignedIntToRGB(rgb, (unsigned int)q);
-        glColor3ubv(rgb);
-        glVertex3fv(quad->v[0]);
-        glVertex3fv(quad->v[1]);
-        glVertex3fv(quad->v[2]);
-        glVertex3fv(quad->v[3]);
+        glColor4ub(rgb[0], rgb[1], rgb[2], 0);
+        glVertex3fv(v[0]);
+        glVertex3fv(v[1]);
+        glVertex3fv(v[2]);
+        glVertex3fv(v[3]);
     }
     glEnd();
     glEndList();
@@ -132,18 +353,31 @@ static GLuint MakeGathererQuadsDisplayList(const QM_Model *m)
 
 
 
-static int FindShooterQuadWithHighestUnshotPower(const QM_Model *m)
+static inline float RGBUnshotPower(const float unshotPower[3])
+// The key of a shooter quad in the shooter priority queue. With overshooting, the unshot
+// power can be negative, and a shooter with a large negative unshot power is as urgent to
+// shoot as one with a large positive unshot power.
 {
-    int s = 0;
-    float maxUnshotPower = 0.0f;
+    return fabsf(unshotPower[0] + unshotPower[1] + unshotPower[2]);
+}
 
-    for (int q = 0; q < m->totalShooters; q++)
-    {
-        float *unshotPower = m->shooters[q]->unshotPower;
-        float RGBunshotPower = unshotPower[0] + unshotPower[1] + unshotPower[2];
-        if (RGBunshotPower > maxUnshotPower) { maxUnshotPower = RGBunshotPower;  s = q; }
-    }
-    return s;
+
+
+static PQ_MaxHeap MakeShooterQueue(const QM_Model *m)
+// Build the priority queue of all the shooter quads, keyed on their current unshot power.
+{
+    float *keys = (float *)CheckedMalloc(sizeof(float) * (m->totalShooters > 0 ? m->totalShooters : 1));
+    for (int q = 0; q < m->totalShooters; q++) keys[q] = RGBUnshotPower(m->unshotPowers[q]);
+    PQ_MaxHeap queue = PQ_Init(m->totalShooters, keys);
+    free(keys);
+    return queue;
+}
+
+
+
+static int FindShooterQuadWithHighestUnshotPower(const PQ_MaxHeap *queue)
+{
+    return PQ_Top(queue);
 }
 
 
@@ -229,12 +463,12 @@ static void PreComputeSideFaceDeltaFormFactors(float deltaFormFactors[], int num
 
 
 
-static void SetupHemicubeTopView(const QM_ShooterQuad *shooterQuad, float nearPlane, float farPlane)
+static void SetupHemicubeTopView(const QM_ShooterQuad *shooterQuad, int viewportY, float nearPlane, float farPlane)
 // Set up a view for the top face of a hemicube.
 // Need to set up the viewport, projection and view transfromation.
+// The bottom of the viewport is at row viewportY of the framebuffer.
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glViewport(0, 0, winWidthHeight, winWidthHeight);
+    glViewport(0, viewportY, hemicubeRes, hemicubeRes);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -252,13 +486,13 @@ static void SetupHemicubeTopView(const QM_ShooterQuad *shooterQuad, float nearPl
 
 
 
-static void SetupHemicubeSideView(int face, const QM_ShooterQuad *shooterQuad, float nearPlane, float farPlane)
+static void SetupHemicubeSideView(int face, const QM_ShooterQuad *shooterQuad, int viewportY, float nearPlane, float farPlane)
 // Set up a view for one of the four side faces of a hemicube.
 // The input parameter face is a number from 1 to 4, that indicates which face to set up for.
 // Need to set up the viewport, projection and view transfromation.
+// The bottom of the viewport is at row viewportY of the framebuffer.
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glViewport(0, 0, winWidthHeight, winWidthHeight / 2);
+    glViewport(0, viewportY, hemicubeRes, hemicubeRes / 2);
 
     /**********************************************************
     ****************** WRITE YOUR CODE HERE ******************
@@ -280,106 +514,962 @@ static void SetupHemicubeSideView(int face, const QM_ShooterQuad *shooterQuad, f
 
 
 
-static void UpdateRadiosities(const QM_Model *m, const float shotPower[3], const GLubyte colorBuf[],
-                              const float deltaFormFactors[], int width, int height)
-    // Use the color buffer (item buffer) to update the radiosities of the gatherer quads,
-    // and update the unshot power of their parent shooter quads.
+static void ReduceHemicube(FF_Row *row, const GLuint *const itemBufs[HC_NUM_FACES])
+// Sum up the delta form factors of the pixels of the 5 hemicube item buffers for each gatherer quad.
 {
-    for (int i = 0; i < width * height; i++)
+    const double *rowPrefixSums[HC_NUM_FACES];
+    int widths[HC_NUM_FACES], heights[HC_NUM_FACES];
+
+    for (int face = 0; face < HC_NUM_FACES; face++)
     {
-        int g = (int)RGBToUnsignedInt(&colorBuf[3 * i]); // Which gatherer quad.
-        if (g < 0 || g >= m->totalGatherers || g == backgroundColorInt) continue;
+        rowPrefixSums[face] = (face == 0) ? topRowPrefixSums : sideRowPrefixSums;
+        widths[face] = hemicubeRes;
+        heights[face] = (face == 0) ? hemicubeRes : hemicubeRes / 2;
+    }
+    FF_ReduceItemBuffers(&ffReducer, row, HC_NUM_FACES, itemBufs, rowPrefixSums, widths, heights);
+}
 
-        float dF = deltaFormFactors[i];  // Delta form factor.
 
-        /**********************************************************
-        ****************** WRITE YOUR CODE HERE ******************
-        **********************************************************/
-        QM_GathererQuad* gathererQuad = m->gatherers[g];
-        float mult = dF / gathererQuad->area;
-        gathererQuad->radiosity[0] += mult * shotPower[0] * gathererQuad->surface->reflectivity[0];
-        gathererQuad->radiosity[1] += mult * shotPower[1] * gathererQuad->surface->reflectivity[1];
-        gathererQuad->radiosity[2] += mult * shotPower[2] * gathererQuad->surface->reflectivity[2];
 
-        QM_ShooterQuad* shooterQuad = gathererQuad->shooter;
-        shooterQuad->unshotPower[0] += dF * shotPower[0] * gathererQuad->surface->reflectivity[0];
-        shooterQuad->unshotPower[1] += dF * shotPower[1] * gathererQuad->surface->reflectivity[1];
-        shooterQuad->unshotPower[2] += dF * shotPower[2] * gathererQuad->surface->reflectivity[2];
+static double UpdateRadiosities(const QM_Model *m, PQ_MaxHeap *queue, const float shotPower[3], const FF_Row *row)
+    // Use the form factors from the shooter to the gatherer quads to update their radiosities,
+    // and update the unshot power of their parent shooter quads in the shooter priority queue.
+    // Returns the change of the total of the keys of the shooter quads.
+{
+    double addedPower = 0.0;
+
+    for (int e = 0; e < row->numEntries; e++)
+    {
+        int g = row->gatherers[e];
+        float F = row->formFactors[e];  // Sum of the delta form factors of the pixels that see the gatherer.
+        const float *reflectivity = m->gathererReflectivities[g];
+
+        float reflectedPower[3] = { F * shotPower[0] * reflectivity[0],
+                                    F * shotPower[1] * reflectivity[1],
+                                    F * shotPower[2] * reflectivity[2] };
+
+        float invArea = m->gathererInvAreas[g];
+        float *radiosity = m->radiosities[g];
+        radiosity[0] += reflectedPower[0] * invArea;
+        radiosity[1] += reflectedPower[1] * invArea;
+        radiosity[2] += reflectedPower[2] * invArea;
+
+        int s = m->gathererShooters[g];
+        float *unshotPower = m->unshotPowers[s];
+        float oldKey = RGBUnshotPower(unshotPower);
+        unshotPower[0] += reflectedPower[0];
+        unshotPower[1] += reflectedPower[1];
+        unshotPower[2] += reflectedPower[2];
+        float newKey = RGBUnshotPower(unshotPower);
+        PQ_Update(queue, s, newKey);
+
+        addedPower += newKey - oldKey;
     }
+    return addedPower;
 }
 
 
 
 /////////////////////////////////////////////////////////////////////////////
-// The display callback function.
-// This is where the progressive refinement radiosity computation is performed.
+// Shoot the unshot power of a shooter quad to all the gatherer quads
+// it can see, using a hemicube placed at the centroid of the shooter.
 /////////////////////////////////////////////////////////////////////////////
 
-static void ComputeRadiosity(void)
+static inline int FaceHeight(int face)
+// The number of pixel rows of a hemicube face.
+{
+    return (face == 0) ? hemicubeRes : hemicubeRes / 2;
+}
+
+
+static inline int AtlasFaceRow(int face)
+// The first row of a hemicube face in the atlas. The top face comes first, then the side faces.
+{
+    return (face == 0) ? 0 : hemicubeRes + (face - 1) * (hemicubeRes / 2);
+}
+
+
+
+static void RenderOpenGLHemicubeFace(const QM_ShooterQuad *shooterQuad, int face, int viewportY)
+// Render one face of the hemicube of a shooter quad with OpenGL into the offscreen framebuffer.
+{
+    float hemicubeWidth = ComputeHemicubeWidth(shooterQuad);
+
+    if (face == 0)
+        SetupHemicubeTopView(shooterQuad, viewportY, hemicubeWidth / 2.0f, 2.0f * model.radius);
+    else
+        SetupHemicubeSideView(face, shooterQuad, viewportY, hemicubeWidth / 2.0f, 2.0f * model.radius);
+    glCallList(gathererQuadsDList);
+}
+
+
+
+static void StartOpenGLReadback(int unit, QM_ShooterQuad *const shooterQuads[])
+// Render and start reading back a unit of work of the OpenGL backends: the hemicube atlas
+// of shooter number unit, or face (unit % 5) of shooter number (unit / 5).
+{
+    int height;
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    if (hemicubeAtlas)
+    {
+        for (int face = 0; face < HC_NUM_FACES; face++)
+            RenderOpenGLHemicubeFace(shooterQuads[unit], face, AtlasFaceRow(face));
+        height = 3 * hemicubeRes;
+    }
+    else
+    {
+        RenderOpenGLHemicubeFace(shooterQuads[unit / HC_NUM_FACES], unit % HC_NUM_FACES, 0);
+        height = FaceHeight(unit % HC_NUM_FACES);
+    }
+
+    if (readbackBuffers > 0)
+    {
+        GLC_ReadPixelsToBuffer(readbackPBOs[unit % readbackBuffers], 0, 0, hemicubeRes, height,
+                               hemicubeAtlas ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE);
+        glFlush();
+    }
+    else if (hemicubeAtlas)
+    {
+        // With zero alpha, each RGBA pixel is the item ID in little-endian byte order.
+        glReadPixels(0, 0, hemicubeRes, height, GL_RGBA, GL_UNSIGNED_BYTE, (void *)atlasItemBuf);
+    }
+    else
+    {
+        glFinish();
+        ReadColorBuffer(colorBuf, 0, 0, hemicubeRes, height);
+        ColorBufferToItemBuffer(itemBufs[unit % HC_NUM_FACES], colorBuf, hemicubeRes * height);
+    }
+}
+
+
+
+static void FinishOpenGLReadback(int unit)
+// Wait for the readback of a unit of work started by StartOpenGLReadback(), and reduce it
+// into the form factor row of its shooter once its whole hemicube has been read back.
+{
+    GLuint pbo = (readbackBuffers > 0) ? readbackPBOs[unit % readbackBuffers] : 0;
+
+    if (hemicubeAtlas)
+    {
+        // The atlas is reduced as a single item buffer. The background is
+        // skipped by the reducer, as it is not a gatherer ID.
+        const GLuint *items = atlasItemBuf;
+        if (pbo != 0) items = (const GLuint *)GLC_MapPixelPackBuffer(pbo);
+        int height = 3 * hemicubeRes;
+        FF_ReduceItemBuffers(&ffReducer, &shooterRows[unit], 1, &items, &atlasRowPrefixSums, &hemicubeRes, &height);
+        if (pbo != 0) GLC_UnmapPixelPackBuffer(pbo);
+        return;
+    }
+
+    int face = unit % HC_NUM_FACES;
+    if (pbo != 0)
+    {
+        const GLubyte *pixels = (const GLubyte *)GLC_MapPixelPackBuffer(pbo);
+        ColorBufferToItemBuffer(itemBufs[face], pixels, hemicubeRes * FaceHeight(face));
+        GLC_UnmapPixelPackBuffer(pbo);
+    }
+    if (face == HC_NUM_FACES - 1)
+        ReduceHemicube(&shooterRows[unit / HC_NUM_FACES], itemBufs);
+}
+
+
+
+static void ComputeRowsWithOpenGL(int numShooters, QM_ShooterQuad *const shooterQuads[])
+// Render the hemicube faces of a batch of shooters with OpenGL, and reduce them into their form factor rows.
+// With pixel pack buffers, the readbacks are pipelined: the readback of a face or atlas is started
+// right after it is rendered, and the CPU only reduces it once the next ones have been issued,
+// so that OpenGL keeps rendering while the CPU works.
+{
+    int numUnits = hemicubeAtlas ? numShooters : numShooters * HC_NUM_FACES;
+    int lag = (readbackBuffers > 0) ? readbackBuffers - 1 : 0;  // Number of readbacks in flight.
+
+    for (int j = 0; j < numUnits + lag; j++)
+    {
+        if (j < numUnits) StartOpenGLReadback(j, shooterQuads);
+        if (j - lag >= 0) FinishOpenGLReadback(j - lag);
+    }
+}
+
+
+
+static void RenderSoftwareHemicube(HC_Hemicube *hc, const QM_ShooterQuad *shooterQuad)
+// Render the hemicube of a shooter quad on the CPU.
+{
+    float hemicubeWidth = ComputeHemicubeWidth(shooterQuad);
+    float upVector[3];
+    VecDiff(upVector, shooterQuad->v[1], shooterQuad->v[0]);
+
+    HC_RenderHemicube(hc, &hcScene, shooterQuad->centroid, shooterQuad->normal, upVector,
+                      hemicubeWidth / 2.0f, 2.0f * model.radius);
+}
+
+
+
+static void ComputeRowsWithSoftwareHemicube(int numShooters, QM_ShooterQuad *const shooterQuads[])
+// Render the hemicubes of a batch of shooters on the CPU, and reduce them into their form factor rows.
+// A single hemicube has its faces and tiles rendered in parallel; a batch of them has
+// one hemicube rendered per worker thread.
+{
+    TP_ParallelFor(numShooters, [&](int k, int) {
+        RenderSoftwareHemicube(&hemicubes[k], shooterQuads[k]);
+        ReduceHemicube(&shooterRows[k], hemicubes[k].items);
+    });
+}
+
+
+
+static void ComputeRowsWithRays(int numShooters, QM_ShooterQuad *const shooterQuads[])
+// Cast cosine-weighted rays from the centroids of a batch of shooters, and reduce the hits into
+// their form factor rows. The rays of a single shooter are cast in parallel; a batch of shooters
+// has one shooter's rays cast per worker thread.
+{
+    TP_ParallelFor(numShooters, [&](int k, int) {
+        const QM_ShooterQuad *shooterQuad = shooterQuads[k];
+        float upVector[3];
+        VecDiff(upVector, shooterQuad->v[1], shooterQuad->v[0]);
+
+        // Ignore hits on the quads around the shooter's centroid at grazing angles.
+        RC_CastCosineRays(&rayBvh, rayHitBufs[k], rayGridRes, shooterQuad->centroid, shooterQuad->normal,
+                          upVector, 1e-5f * model.radius, (rayShotCount + k) * 0x9E3779B9u);
+
+        const unsigned int *hits = rayHitBufs[k];
+        FF_ReduceItemBuffers(&ffReducer, &shooterRows[k], 1, &hits, &rayRowPrefixSums, &rayGridRes, &rayGridRes);
+    });
+    rayShotCount += numShooters;
+}
+
+
+
+static void ComputeRowsWithAnalyticFormFactors(int numShooters, QM_ShooterQuad *const shooterQuads[])
+// Compute the form factors from the centroids of a batch of shooters to every gatherer analytically
+// into their form factor rows. The gatherers of a single shooter are processed in parallel;
+// a batch of shooters has one shooter processed per worker thread.
+{
+    const int CHUNK_GATHERERS = 256;
+    int numChunks = (model.totalGatherers + CHUNK_GATHERERS - 1) / CHUNK_GATHERERS;
+
+    TP_ParallelFor(numShooters, [&](int k, int) {
+        const QM_ShooterQuad *shooterQuad = shooterQuads[k];
+        float *formFactors = analyticFormFactors[k];
+        unsigned int seed = (rayShotCount + k) * 0x9E3779B9u;
+
+        TP_ParallelFor(numChunks, [&](int chunk, int) {
+            int end = Min2((chunk + 1) * CHUNK_GATHERERS, model.totalGatherers);
+            for (int g = chunk * CHUNK_GATHERERS; g < end; g++)
+            {
+                float quad[4][3];
+                QM_GathererVertices(model.gatherers[g], quad);
+                float F = FF_PolygonToPointFormFactor(shooterQuad->centroid, shooterQuad->normal, 4, quad);
+                if (F > 0.0f)
+                    F *= RC_QuadVisibility(&rayBvh, shooterQuad->centroid, quad, (unsigned int)g,
+                                           shadowGridRes, 1e-5f * model.radius, seed + g * 0x85EBCA6Bu);
+                formFactors[g] = F;
+            }
+        });
+
+        FF_RowClear(&shooterRows[k]);
+        for (int g = 0; g < model.totalGatherers; g++)
+            if (formFactors[g] > 0.0f) FF_RowAppend(&shooterRows[k], g, formFactors[g]);
+    });
+    rayShotCount += numShooters;
+}
+
+
+
+static void ComputeFormFactorRows(int numShooters, QM_ShooterQuad *const shooterQuads[])
+// Compute the form factors from each shooter of a batch to the gatherer quads into shooterRows[],
+// with the chosen backend.
+{
+    if (UsesOpenGL())
+        ComputeRowsWithOpenGL(numShooters, shooterQuads);
+    else if (hemicubeBackend == BACKEND_RAY)
+        ComputeRowsWithRays(numShooters, shooterQuads);
+    else if (hemicubeBackend == BACKEND_ANALYTIC)
+        ComputeRowsWithAnalyticFormFactors(numShooters, shooterQuads);
+    else
+        ComputeRowsWithSoftwareHemicube(numShooters, shooterQuads);
+}
+
+
+
+static void ComputeVertexRadiosities(void)
+// Compute the vertex radiosities of the gatherer quads in parallel, for all the methods.
+{
+    QM_AllocVertexRadiosities(&model);
+    const int CHUNK_GATHERERS = 1024;
+    int numChunks = (model.totalGatherers + CHUNK_GATHERERS - 1) / CHUNK_GATHERERS;
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        QM_ComputeVertexRadiosities(&model, chunk * CHUNK_GATHERERS, Min2((chunk + 1) * CHUNK_GATHERERS, model.totalGatherers));
+    });
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// The progressive refinement radiosity computation.
+/////////////////////////////////////////////////////////////////////////////
+
+static double ComputeTotalUnshotPower(const QM_Model *m)
+// Sum the magnitudes of the RGB unshot power of all the shooter quads.
+{
+    double total = 0.0;
+    for (int q = 0; q < m->totalShooters; q++) total += RGBUnshotPower(m->unshotPowers[q]);
+    return total;
+}
+
+
+
+static double ComputeAverageReflectivity(const QM_Model *m, double averageReflectivity[3])
+// Compute the area-weighted average RGB reflectivity of the gatherer quads. Returns their total area.
+{
+    double totalArea = 0.0, sum[3] = { 0.0, 0.0, 0.0 };
+    for (int g = 0; g < m->totalGatherers; g++)
+    {
+        totalArea += m->gathererAreas[g];
+        for (int c = 0; c < 3; c++) sum[c] += m->gathererAreas[g] * m->gathererReflectivities[g][c];
+    }
+    for (int c = 0; c < 3; c++) averageReflectivity[c] = (totalArea > 0.0) ? sum[c] / totalArea : 0.0;
+    return totalArea;
+}
+
+
+
+static void SumUnshotPower(const QM_Model *m, double sum[3])
+// Sum the unshot power of all the shooter quads for each channel.
+{
+    sum[0] = sum[1] = sum[2] = 0.0;
+    for (int q = 0; q < m->totalShooters; q++)
+        for (int c = 0; c < 3; c++) sum[c] += m->unshotPowers[q][c];
+}
+
+
+
+static void MeasureReflectance(const double shotPower[3], const double reflectedPower[3],
+                               const double averageReflectivity[3], double reflectance[3])
+// The fraction of the power shot so far that was reflected back into the scene. Unlike the
+// average reflectivity, it accounts for the light that leaves an open scene.
+{
+    for (int c = 0; c < 3; c++)
+        reflectance[c] = (shotPower[c] > 0.0) ? Max2(0.0, reflectedPower[c] / shotPower[c]) : averageReflectivity[c];
+}
+
+
+
+static void ComputeAmbientUnshotRadiosity(const QM_Model *m, double totalArea, const double averageReflectivity[3],
+                                          const double reflectance[3], float ambient[3])
+// Estimate the unshot radiosity that each patch will eventually receive: the area average of the
+// unshot power, times the interreflection factor 1 / (1 - reflectance). In a closed scene, the
+// reflectance is the average reflectivity, and the reflected power is spread over the patches in
+// proportion to their reflectivity; otherwise only that fraction of it is.
+{
+    double sum[3];
+    SumUnshotPower(m, sum);
+
+    for (int c = 0; c < 3; c++)
+    {
+        double R = Min2(reflectance[c], 0.99);
+        double interreflection = (averageReflectivity[c] > 0.0) ? R / averageReflectivity[c] / (1.0 - R) : 0.0;
+        ambient[c] = (totalArea > 0.0) ? (float)Max2(0.0, sum[c] / totalArea * interreflection) : 0.0f;
+    }
+}
+
+
+
+static void AddAmbientTerm(QM_Model *m, const double shotPower[3], const double reflectedPower[3])
+// Add the ambient term to the radiosity of every gatherer quad: its reflectivity times the
+// estimated unshot radiosity of the scene. The unshot power is left as it is.
 {
-    // Allocate temporary memory for reading in the colorbuffer.
-    GLubyte *colorBuf = (GLubyte *)CheckedMalloc(sizeof(GLubyte) * 3 * winWidthHeight * winWidthHeight);
+    double averageReflectivity[3], reflectance[3];
+    double totalArea = ComputeAverageReflectivity(m, averageReflectivity);
+    MeasureReflectance(shotPower, reflectedPower, averageReflectivity, reflectance);
+    float ambient[3];
+    ComputeAmbientUnshotRadiosity(m, totalArea, averageReflectivity, reflectance, ambient);
+
+    double sumAmbient = 0.0, sumRadiosity = 0.0;
+    for (int g = 0; g < m->totalGatherers; g++)
+    {
+        const float *R = m->gathererReflectivities[g];
+        float *B = m->radiosities[g];
+        for (int c = 0; c < 3; c++) B[c] += R[c] * ambient[c];
+        sumAmbient += m->gathererAreas[g] * (R[0] * ambient[0] + R[1] * ambient[1] + R[2] * ambient[2]);
+        sumRadiosity += m->gathererAreas[g] * (B[0] + B[1] + B[2]);
+    }
+
+    printf("Ambient term: unshot radiosity (%.6f, %.6f, %.6f), %.2f%% of the mean radiosity written out.\n",
+           ambient[0], ambient[1], ambient[2], (sumRadiosity > 0.0) ? 100.0 * sumAmbient / sumRadiosity : 0.0);
+}
+
+
+
+static const char *CheckTermination(int iterationCount, double elapsedSeconds, double *totalUnshotPower,
+                                    double totalEmittedPower)
+// Returns a description of the termination condition that has been met, or NULL if
+// the computation should go on. The running total of the unshot power is recomputed
+// from scratch before it is used to stop, so that rounding errors cannot stop it early.
+{
+    if (maxIterations > 0 && iterationCount >= maxIterations)
+        return "maximum number of iterations reached";
+
+    if (maxSeconds > 0.0 && elapsedSeconds >= maxSeconds)
+        return "wall-clock time budget used up";
 
-    for (int iterationCount = 0; iterationCount < maxIterations; iterationCount++)
+    if (*totalUnshotPower <= residualEpsilon * totalEmittedPower)
     {
+        *totalUnshotPower = ComputeTotalUnshotPower(&model);
+        if (*totalUnshotPower <= 0.0) return "no unshot power left";
+        if (*totalUnshotPower <= residualEpsilon * totalEmittedPower) return "residual unshot power below epsilon";
+    }
+    return NULL;
+}
+
+
+
+static void ComputeRadiosity(void)
+{
+    double startTime = GetCurrRealTime();
+    double totalEmittedPower = ComputeTotalUnshotPower(&model);
+    double totalUnshotPower = totalEmittedPower;
+    const char *stopReason = NULL;
+    int iterationCount = 0;
+    int shotCount = 0;
+
+    double averageReflectivity[3];
+    double totalArea = ComputeAverageReflectivity(&model, averageReflectivity);
+
+    // The power shot so far, and the power reflected back, which is the unshot power now,
+    // minus that at the start, plus the power shot.
+    double shotPower[3] = { 0.0, 0.0, 0.0 }, startUnshotPower[3], reflectedPower[3];
+    SumUnshotPower(&model, startUnshotPower);
+
+    QM_ShooterQuad **batchShooters = (QM_ShooterQuad **)CheckedMalloc(sizeof(QM_ShooterQuad *) * batchSize);
+    float (*batchUnshotPowers)[3] = (float (*)[3])CheckedMalloc(sizeof(float) * 3 * batchSize);
+    QM_ShooterQuad **missedShooters = (QM_ShooterQuad **)CheckedMalloc(sizeof(QM_ShooterQuad *) * batchSize);
+    FF_Row *cachedRows = (FF_Row *)CheckedMalloc(sizeof(FF_Row) * batchSize);
+    const FF_Row **batchRows = (const FF_Row **)CheckedMalloc(sizeof(const FF_Row *) * batchSize);
+
+    for (;; iterationCount++)
+    {
+        stopReason = CheckTermination(iterationCount, GetCurrRealTime() - startTime, &totalUnshotPower, totalEmittedPower);
+        if (stopReason != NULL) break;
+
         // Find a shooter quad to shoot power.
-        printf("Iteration %d\n", iterationCount);
+        printf("Iteration %d, residual %.6f\n", iterationCount,
+               (totalEmittedPower > 0.0) ? totalUnshotPower / totalEmittedPower : 0.0);
+
+        float ambient[3] = { 0.0f, 0.0f, 0.0f };
+        if (overshootFactor > 0.0)
+        {
+            double unshotPower[3], reflectance[3];
+            SumUnshotPower(&model, unshotPower);
+            for (int c = 0; c < 3; c++) reflectedPower[c] = unshotPower[c] - startUnshotPower[c] + shotPower[c];
+            MeasureReflectance(shotPower, reflectedPower, averageReflectivity, reflectance);
+            ComputeAmbientUnshotRadiosity(&model, totalArea, averageReflectivity, reflectance, ambient);
+        }
+
+        // Take the batch of shooters with the highest unshot power out of the queue.
+        int numShooters = 0;
+        while (numShooters < batchSize)
+        {
+            int s = FindShooterQuadWithHighestUnshotPower(&shooterQueue);
+            QM_ShooterQuad *shooterQuad = model.shooters[s];
+            if (numShooters > 0 && PQ_Key(&shooterQueue, s) <= 0.0f) break;
+
+            // After shooting power, the shooter quad's unshot power becomes zero. With overshooting,
+            // a shooter with positive unshot power also shoots the power it is estimated to get back
+            // from the rest of the scene, and is left with that much negative unshot power.
+            float *P = model.unshotPowers[s];
+            float oldKey = RGBUnshotPower(P);
+            bool overshoot = P[0] + P[1] + P[2] > 0.0f;
+            batchShooters[numShooters] = shooterQuad;
+            for (int c = 0; c < 3; c++)
+            {
+                float extra = overshoot ? (float)overshootFactor * shooterQuad->surface->reflectivity[c] *
+                                          shooterQuad->area * ambient[c] : 0.0f;
+                batchUnshotPowers[numShooters][c] = P[c] + extra;
+                shotPower[c] += P[c] + extra;
+                P[c] = -extra;
+            }
+
+            // Keep the shooter out of the rest of the batch.
+            PQ_Update(&shooterQueue, s, 0.0f);
+            totalUnshotPower += RGBUnshotPower(P) - oldKey;
+            numShooters++;
+        }
+        for (int k = 0; k < numShooters; k++)
+            PQ_Update(&shooterQueue, batchShooters[k]->index, RGBUnshotPower(model.unshotPowers[batchShooters[k]->index]));
+        shotCount += numShooters;
+
+        // Set up a hemicube at the centroid of each shooter, and shoot.
+        // Shooters whose rows are cached are not rendered again.
+        int numMissed = 0;
+        for (int k = 0; k < numShooters; k++)
+        {
+            if (rowCacheMegabytes > 0.0 && LC_Lookup(&rowCache, batchShooters[k]->index, &cachedRows[k]))
+                batchRows[k] = &cachedRows[k];
+            else
+            {
+                batchRows[k] = &shooterRows[numMissed];
+                missedShooters[numMissed++] = batchShooters[k];
+            }
+        }
+        if (numMissed > 0) ComputeFormFactorRows(numMissed, missedShooters);
 
-        int s = FindShooterQuadWithHighestUnshotPower(&model);
-        QM_ShooterQuad *shooterQuad = model.shooters[s];
-        float unshotPower[3] = { shooterQuad->unshotPower[0], shooterQuad->unshotPower[1], shooterQuad->unshotPower[2] };
+        for (int k = 0; k < numShooters; k++)
+            totalUnshotPower += UpdateRadiosities(&model, &shooterQueue, batchUnshotPowers[k], batchRows[k]);
 
-        // After shooting power, the shooter quad's unshot power becomes zero.
-        shooterQuad->unshotPower[0] = shooterQuad->unshotPower[1] = shooterQuad->unshotPower[2] = 0.0f;
+        // Inserting may evict the cached rows used above, so it comes after the updates.
+        if (rowCacheMegabytes > 0.0)
+            for (int j = 0; j < numMissed; j++) LC_Insert(&rowCache, missedShooters[j]->index, &shooterRows[j]);
+    }
 
-        // Set up a hemicube at the centroid of the shooter.
+    free(batchShooters);
+    free(batchUnshotPowers);
+    free(missedShooters);
+    free(cachedRows);
+    free(batchRows);
+
+    printf("Radiosity computation completed in %.3f seconds after %d iterations and %d shots: %s (residual %.6f).\n",
+           GetCurrRealTime() - startTime, iterationCount, shotCount, stopReason,
+           (totalEmittedPower > 0.0) ? totalUnshotPower / totalEmittedPower : 0.0);
+    if (rowCacheMegabytes > 0.0)
+        printf("Row cache: %lld hits of %lld lookups (%.1f%%), %d rows held in %.2f MB, %lld evictions.\n",
+               rowCache.numHits, rowCache.numLookups,
+               (rowCache.numLookups > 0) ? 100.0 * rowCache.numHits / rowCache.numLookups : 0.0,
+               rowCache.numCached, rowCache.bytesHeld / (1024.0 * 1024.0), rowCache.numEvictions);
+    if (addAmbientTerm)
+    {
+        double unshotPower[3];
+        SumUnshotPower(&model, unshotPower);
+        for (int c = 0; c < 3; c++) reflectedPower[c] = unshotPower[c] - startUnshotPower[c] + shotPower[c];
+        AddAmbientTerm(&model, shotPower, reflectedPower);
+    }
 
-        float hemicubeWidth = ComputeHemicubeWidth(shooterQuad);
+    printf("Computing vertex radiosities...\n");
+    ComputeVertexRadiosities();
 
-        // Top face.
-        SetupHemicubeTopView(shooterQuad, hemicubeWidth / 2.0f, 2.0f * model.radius);
-        glCallList(gathererQuadsDList);
-        glFinish();
-        ReadColorBuffer(colorBuf, true, 0, 0, winWidthHeight, winWidthHeight);
-        UpdateRadiosities(&model, unshotPower, colorBuf, topDeltaFormFactors, winWidthHeight, winWidthHeight);
+    printf("Writing output model file...\n");
+    QM_WriteGatherersToFile(outputModelFilename, &model);
+}
 
-        // Side faces.
-        for (int face = 1; face <= 4; face++)
+
+
+static void ComputeHierarchicalRadiosity(void)
+{
+    double startTime = GetCurrRealTime();
+    printf("Linking elements with %d threads...\n", TP_NumWorkers());
+    HR_BuildLinks(&hierarchy);
+    printf("%d links between %d elements made in %.3f seconds.\n", hierarchy.numLinks, hierarchy.numElements,
+           GetCurrRealTime() - startTime);
+
+    // The refinement threshold is relative to the brightest emitter.
+    float maxEmission = 0.0f;
+    for (int s = 0; s < model.numSurfaces; s++)
+    {
+        const float *E = model.surfaces[s].emission;
+        maxEmission = Max2(maxEmission, (E[0] + E[1] + E[2]) / 3.0f);
+    }
+    float bfEpsilon = linkBFEpsilon * maxEmission;
+
+    double totalEmittedPower = ComputeTotalUnshotPower(&model);
+    double change = totalEmittedPower;
+    const char *stopReason = NULL;
+    int iterationCount = 0;
+
+    for (;; iterationCount++)
+    {
+        if (maxIterations > 0 && iterationCount >= maxIterations)
+            stopReason = "maximum number of iterations reached";
+        else if (maxSeconds > 0.0 && GetCurrRealTime() - startTime >= maxSeconds)
+            stopReason = "wall-clock time budget used up";
+        else if (change <= residualEpsilon * totalEmittedPower)
+            stopReason = (change <= 0.0) ? "radiosities converged" : "radiosity change below epsilon";
+        if (stopReason != NULL) break;
+
+        change = HR_Iterate(&hierarchy);
+        int numRefined = HR_RefineLinks(&hierarchy, bfEpsilon);
+        printf("Iteration %d, change %.6f, %d links refined into %d links\n", iterationCount,
+               (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0, numRefined, hierarchy.numLinks);
+
+        // Refined links change the solution, so the computation is not over.
+        if (numRefined > 0 && change <= 0.0) change = 1e-30;
+    }
+
+    printf("Radiosity computation completed in %.3f seconds after %d iterations with %d links: %s (change %.6f).\n",
+           GetCurrRealTime() - startTime, iterationCount, hierarchy.numLinks, stopReason,
+           (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0);
+
+    HR_StoreGathererRadiosities(&hierarchy, &model);
+
+    printf("Computing vertex radiosities...\n");
+    ComputeVertexRadiosities();
+
+    printf("Writing output model file...\n");
+    QM_WriteGatherersToFile(outputModelFilename, &model);
+}
+
+
+
+static void ComputeStochasticRadiosity(void)
+{
+    double startTime = GetCurrRealTime();
+    double totalEmittedPower = ComputeTotalUnshotPower(&model);
+    double totalUnshotPower = totalEmittedPower;
+    const char *stopReason = NULL;
+    int iterationCount = 0;
+    int raysLeft = stochasticRays;
+
+    // The power shot over all the iterations is about the emitted power / (1 - the average
+    // reflectivity), so giving each iteration a share of the rays in proportion to its unshot
+    // power makes every ray carry about the same power.
+    double averageRGBReflectivity[3];
+    ComputeAverageReflectivity(&model, averageRGBReflectivity);
+    double averageReflectivity = (averageRGBReflectivity[0] + averageRGBReflectivity[1] + averageRGBReflectivity[2]) / 3.0;
+    double totalShotPower = totalEmittedPower / (1.0 - Min2(averageReflectivity, 0.99));
+
+    double shotPower[3] = { 0.0, 0.0, 0.0 }, reflectedPower[3] = { 0.0, 0.0, 0.0 };
+
+    printf("Shooting %d rays with %d threads...\n", stochasticRays, TP_NumWorkers());
+
+    for (;; iterationCount++)
+    {
+        stopReason = CheckTermination(iterationCount, GetCurrRealTime() - startTime, &totalUnshotPower, totalEmittedPower);
+        double share = (totalShotPower > 0.0) ? totalUnshotPower / totalShotPower : 1.0;
+        if (stopReason == NULL && raysLeft <= 0) stopReason = "ray budget used up";
+        if (stopReason == NULL && share * stochasticRays < 1.0) stopReason = "unshot power below the power of a ray";
+        if (stopReason != NULL) break;
+
+        int numRays = (int)Min2((double)raysLeft, ceil(share * stochasticRays));
+        printf("Iteration %d, residual %.6f, %d rays\n", iterationCount,
+               (totalEmittedPower > 0.0) ? totalUnshotPower / totalEmittedPower : 0.0, numRays);
+
+        // Each iteration shoots all the unshot power, and what is reflected becomes the new unshot power.
+        double unshotPower[3];
+        SumUnshotPower(&model, unshotPower);
+        totalUnshotPower = SJ_Iterate(&sjSolver, &model, numRays);
+        raysLeft -= numRays;
+        for (int c = 0; c < 3; c++) shotPower[c] += unshotPower[c];
+        SumUnshotPower(&model, unshotPower);
+        for (int c = 0; c < 3; c++) reflectedPower[c] += unshotPower[c];
+    }
+
+    printf("Radiosity computation completed in %.3f seconds after %d iterations and %d rays: %s (residual %.6f).\n",
+           GetCurrRealTime() - startTime, iterationCount, stochasticRays - raysLeft, stopReason,
+           (totalEmittedPower > 0.0) ? totalUnshotPower / totalEmittedPower : 0.0);
+    printf("Estimated relative standard error of the radiosities: %.6f\n", SJ_RelativeStandardError(&sjSolver, &model));
+    if (addAmbientTerm) AddAmbientTerm(&model, shotPower, reflectedPower);
+
+    printf("Computing vertex radiosities...\n");
+    ComputeVertexRadiosities();
+
+    printf("Writing output model file...\n");
+    QM_WriteGatherersToFile(outputModelFilename, &model);
+}
+
+
+
+static double SweepGatherers(int shooter, const int firstGatherer[], const float (*shooterPowers)[4],
+                             float newShooterPower[4])
+// Gather the radiosity of the gatherer quads of a shooter from the power of all the shooters,
+// and sum their new RGB power into newShooterPower.
+// Returns the change of the RGB power of the shooter.
+{
+    double power[3] = { 0.0, 0.0, 0.0 };
+    for (int g = firstGatherer[shooter]; g < firstGatherer[shooter + 1]; g++)
+    {
+        const float *E = model.gathererEmissions[g];
+        const float *R = model.gathererReflectivities[g];
+        float *B = model.radiosities[g];
+        float received[4];
+        FM_MultiplyRow(&ffMatrix, g, shooterPowers, received);
+
+        float invArea = model.gathererInvAreas[g];
+        for (int c = 0; c < 3; c++)
         {
-            SetupHemicubeSideView(face, shooterQuad, hemicubeWidth / 2.0f, 2.0f * model.radius);
-            glCallList(gathererQuadsDList);
-            glFinish();
-            ReadColorBuffer(colorBuf, true, 0, 0, winWidthHeight, winWidthHeight / 2);
-            UpdateRadiosities(&model, unshotPower, colorBuf, sideDeltaFormFactors, winWidthHeight, winWidthHeight / 2);
+            B[c] = E[c] + R[c] * received[c] * invArea;
+            power[c] += model.gathererAreas[g] * B[c];
         }
     }
 
-    free(colorBuf);
-    printf("Radiosity computation completed.\n");
+    double change = 0.0;
+    for (int c = 0; c < 3; c++)
+    {
+        change += fabs(power[c] - shooterPowers[shooter][c]);
+        newShooterPower[c] = (float)power[c];
+    }
+    newShooterPower[3] = 0.0f;
+    return change;
+}
+
+
+
+static unsigned long long FormFactorCacheKey(void)
+// Returns the key of the form factor matrix of the model for the chosen backend and its settings.
+{
+    long long settings[5] = { (long long)hemicubeBackend, hemicubeRes, hemicubeAtlas ? 1 : 0,
+                              raysPerShooter, shadowRaysPerGatherer };
+    unsigned long long key = QM_GeometryHash(&model);
+    for (int i = 0; i < 5; i++) key = (key ^ (unsigned long long)settings[i]) * 0x100000001B3ull;
+    return key;
+}
+
+
+
+static void ComputeMatrixRadiosity(void)
+{
+    double startTime = GetCurrRealTime();
+    double totalEmittedPower = ComputeTotalUnshotPower(&model);
+    int numShooters = model.totalShooters;
+
+    // Compute the form factors of all the shooters once, unless InitModel() mapped them from the cache file.
+    if (!formFactorsCached)
+    {
+        printf("Computing form factors of %d shooters...\n", numShooters);
+        FM_Builder builder = FM_BuilderInit(model.totalGatherers, numShooters);
+        for (int s0 = 0; s0 < numShooters; s0 += batchSize)
+        {
+            int n = Min2(batchSize, numShooters - s0);
+            ComputeFormFactorRows(n, &model.shooters[s0]);
+            for (int k = 0; k < n; k++) FM_BuilderAddColumn(&builder, s0 + k, &shooterRows[k]);
+        }
+        ffMatrix = FM_BuilderFinish(&builder);
+        FM_BuilderCleanUp(&builder);
+        printf("Form factor matrix of %.0f entries (%.2f MB) computed in %.3f seconds.\n", (double)ffMatrix.numEntries,
+               FM_MatrixBytes(&ffMatrix) / (1024.0 * 1024.0), GetCurrRealTime() - startTime);
+
+        if (formFactorCacheFilename != NULL)
+        {
+            printf("Writing form factor cache file...\n");
+            FM_MatrixSave(&ffMatrix, formFactorCacheFilename, FormFactorCacheKey());
+        }
+    }
+
+    // The gatherers of each shooter are consecutive, as QM_Subdivide() makes them shooter by shooter.
+    int *firstGatherer = (int *)CheckedMalloc(sizeof(int) * (numShooters + 1));
+    int g = 0;
+    for (int s = 0; s < numShooters; s++)
+    {
+        firstGatherer[s] = g;
+        while (g < model.totalGatherers && model.gatherers[g]->shooter->index == s) g++;
+    }
+    firstGatherer[numShooters] = g;
+
+    // Start from the emitted power of the shooters, which the gatherers have as radiosity.
+    float (*shooterPowers)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+    float (*newShooterPowers)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+    for (int s = 0; s < numShooters; s++)
+    {
+        shooterPowers[s][0] = shooterPowers[s][1] = shooterPowers[s][2] = shooterPowers[s][3] = 0.0f;
+        for (int i = firstGatherer[s]; i < firstGatherer[s + 1]; i++)
+            for (int c = 0; c < 3; c++) shooterPowers[s][c] += model.gathererAreas[i] * model.radiosities[i][c];
+    }
+
+    const int CHUNK_SHOOTERS = 16;
+    const int MAX_COARSE_SWEEPS = 1000;
+    int numChunks = (numShooters + CHUNK_SHOOTERS - 1) / CHUNK_SHOOTERS;
+    double *chunkChanges = (double *)CheckedMalloc(sizeof(double) * (numChunks > 0 ? numChunks : 1));
+
+    double solveStartTime = GetCurrRealTime();
+    double change = totalEmittedPower;
+    const char *stopReason = NULL;
+    int sweepCount = 0;
+
+    if (multigridSolve)
+    {
+        MG_CoarseMatrix coarse = MG_CoarseMatrixInit(&ffMatrix, firstGatherer, numShooters);
+        printf("Coarse matrix of %d entries between %d shooters made in %.3f seconds.\n",
+               coarse.rowStart[numShooters], numShooters, GetCurrRealTime() - solveStartTime);
+
+        // Every gatherer of a shooter is on the shooter's surface.
+        float (*emittedPowers)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+        float (*reflectivities)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+        for (int s = 0; s < numShooters; s++)
+        {
+            const QM_Surface *surface = model.shooters[s]->surface;
+            for (int c = 0; c < 3; c++)
+            {
+                emittedPowers[s][c] = shooterPowers[s][c];
+                reflectivities[s][c] = surface->reflectivity[c];
+            }
+            emittedPowers[s][3] = reflectivities[s][3] = 0.0f;
+        }
+
+        // Solve well below the tolerance of the gatherer-level sweeps, which add little to it.
+        double coarseStartTime = GetCurrRealTime();
+        int coarseSweeps = MG_Solve(&coarse, emittedPowers, reflectivities, shooterPowers,
+                                    1e-5 * totalEmittedPower, MAX_COARSE_SWEEPS);
+        printf("Coarse system solved with %d Gauss-Seidel sweeps in %.3f seconds.\n",
+               coarseSweeps, GetCurrRealTime() - coarseStartTime);
+
+        free(emittedPowers);
+        free(reflectivities);
+        MG_CoarseMatrixCleanUp(&coarse);
+    }
+
+    for (;; sweepCount++)
+    {
+        if (maxIterations > 0 && sweepCount >= maxIterations)
+            stopReason = "maximum number of iterations reached";
+        else if (maxSeconds > 0.0 && GetCurrRealTime() - startTime >= maxSeconds)
+            stopReason = "wall-clock time budget used up";
+        else if (change <= residualEpsilon * totalEmittedPower)
+            stopReason = (change <= 0.0) ? "radiosities converged" : "power change below epsilon";
+        if (stopReason != NULL) break;
+
+        change = 0.0;
+        if (gaussSeidelSweeps)
+        {
+            for (int s = 0; s < numShooters; s++)
+                change += SweepGatherers(s, firstGatherer, shooterPowers, shooterPowers[s]);
+        }
+        else
+        {
+            TP_ParallelFor(numChunks, [&](int chunk, int) {
+                int end = Min2((chunk + 1) * CHUNK_SHOOTERS, numShooters);
+                chunkChanges[chunk] = 0.0;
+                for (int s = chunk * CHUNK_SHOOTERS; s < end; s++)
+                    chunkChanges[chunk] += SweepGatherers(s, firstGatherer, shooterPowers, newShooterPowers[s]);
+            });
+            for (int chunk = 0; chunk < numChunks; chunk++) change += chunkChanges[chunk];
+            float (*swap)[4] = shooterPowers;
+            shooterPowers = newShooterPowers;
+            newShooterPowers = swap;
+        }
+        printf("Sweep %d, change %.6f\n", sweepCount, (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0);
+    }
+
+    printf("Radiosity computation completed in %.3f seconds after %d %s sweeps in %.3f seconds: %s (change %.6f).\n",
+           GetCurrRealTime() - startTime, sweepCount, gaussSeidelSweeps ? "Gauss-Seidel" : "Jacobi",
+           GetCurrRealTime() - solveStartTime, stopReason, (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0);
+
+    free(firstGatherer);
+    free(shooterPowers);
+    free(newShooterPowers);
+    free(chunkChanges);
 
     printf("Computing vertex radiosities...\n");
-    QM_ComputeVertexRadiosities(&model);
+    ComputeVertexRadiosities();
 
     printf("Writing output model file...\n");
     QM_WriteGatherersToFile(outputModelFilename, &model);
+}
 
-    printf("DONE.\nPress ENTER to exit program.\n");
-    char ch;
-    scanf("%c", &ch);
-    exit(0);
+
+
+static void ComputeLowRankRadiosity(void)
+{
+    double startTime = GetCurrRealTime();
+    double totalEmittedPower = ComputeTotalUnshotPower(&model);
+    int numShooters = model.totalShooters, numGatherers = model.totalGatherers;
+
+    printf("Computing form factor blocks with %d threads...\n", TP_NumWorkers());
+    lrOperator = LR_OperatorInit(&model, &rayBvh, acaEpsilon, (int)ceil(sqrt((double)shadowRaysPerGatherer)),
+                                 1e-5f * model.radius);
+    printf("%d dense and %d low-rank blocks (average rank %.2f) between %d clusters computed in %.3f seconds.\n",
+           lrOperator.numDenseBlocks, lrOperator.numLowRankBlocks,
+           (lrOperator.numLowRankBlocks > 0) ? (double)lrOperator.sumRanks / lrOperator.numLowRankBlocks : 0.0,
+           lrOperator.numClusters, GetCurrRealTime() - startTime);
+    printf("%.0f values (%.2f MB) stored and %.0f form factors evaluated, of %.0f in total.\n",
+           (double)lrOperator.numValues, LR_OperatorBytes(&lrOperator) / (1024.0 * 1024.0),
+           (double)lrOperator.numEvaluated, (double)numShooters * numGatherers);
+
+    // Start from the emitted power of the shooters, which the gatherers have as radiosity.
+    float (*shooterPowers)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+    float (*newShooterPowers)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numShooters > 0 ? numShooters : 1));
+    float (*received)[4] = (float (*)[4])CheckedMalloc(sizeof(float) * 4 * (numGatherers > 0 ? numGatherers : 1));
+    for (int s = 0; s < numShooters; s++) shooterPowers[s][0] = shooterPowers[s][1] = shooterPowers[s][2] = shooterPowers[s][3] = 0.0f;
+    for (int g = 0; g < numGatherers; g++)
+        for (int c = 0; c < 3; c++) shooterPowers[model.gathererShooters[g]][c] += model.gathererAreas[g] * model.radiosities[g][c];
+
+    double solveStartTime = GetCurrRealTime();
+    double change = totalEmittedPower;
+    const char *stopReason = NULL;
+    int sweepCount = 0;
+
+    for (;; sweepCount++)
+    {
+        if (maxIterations > 0 && sweepCount >= maxIterations)
+            stopReason = "maximum number of iterations reached";
+        else if (maxSeconds > 0.0 && GetCurrRealTime() - startTime >= maxSeconds)
+            stopReason = "wall-clock time budget used up";
+        else if (change <= residualEpsilon * totalEmittedPower)
+            stopReason = (change <= 0.0) ? "radiosities converged" : "power change below epsilon";
+        if (stopReason != NULL) break;
+
+        // Jacobi sweep: gather the radiosities from the powers of the previous sweep.
+        LR_Multiply(&lrOperator, shooterPowers, received);
+        for (int s = 0; s < numShooters; s++)
+            newShooterPowers[s][0] = newShooterPowers[s][1] = newShooterPowers[s][2] = newShooterPowers[s][3] = 0.0f;
+        for (int g = 0; g < numGatherers; g++)
+        {
+            const float *E = model.gathererEmissions[g];
+            const float *R = model.gathererReflectivities[g];
+            float *B = model.radiosities[g];
+            for (int c = 0; c < 3; c++)
+            {
+                B[c] = E[c] + R[c] * received[g][c] * model.gathererInvAreas[g];
+                newShooterPowers[model.gathererShooters[g]][c] += model.gathererAreas[g] * B[c];
+            }
+        }
+
+        change = 0.0;
+        for (int s = 0; s < numShooters; s++)
+            for (int c = 0; c < 3; c++) change += fabs(newShooterPowers[s][c] - shooterPowers[s][c]);
+        float (*swap)[4] = shooterPowers;
+        shooterPowers = newShooterPowers;
+        newShooterPowers = swap;
+        printf("Sweep %d, change %.6f\n", sweepCount, (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0);
+    }
+
+    printf("Radiosity computation completed in %.3f seconds after %d Jacobi sweeps in %.3f seconds: %s (change %.6f).\n",
+           GetCurrRealTime() - startTime, sweepCount, GetCurrRealTime() - solveStartTime, stopReason,
+           (totalEmittedPower > 0.0) ? change / totalEmittedPower : 0.0);
+
+    free(shooterPowers);
+    free(newShooterPowers);
+    free(received);
+
+    printf("Computing vertex radiosities...\n");
+    ComputeVertexRadiosities();
+
+    printf("Writing output model file...\n");
+    QM_WriteGatherersToFile(outputModelFilename, &model);
 }
 
 
 
+static void ComputeSolution(void)
+// Run the chosen radiosity method, and write the output model file.
+{
+    if (solverMethod == METHOD_HIERARCHICAL)
+        ComputeHierarchicalRadiosity();
+    else if (solverMethod == METHOD_STOCHASTIC)
+        ComputeStochasticRadiosity();
+    else if (solverMethod == METHOD_MATRIX)
+        ComputeMatrixRadiosity();
+    else if (solverMethod == METHOD_LOWRANK)
+        ComputeLowRankRadiosity();
+    else
+        ComputeRadiosity();
+}
+
+
 
 /////////////////////////////////////////////////////////////////////////////
-// The reshape callback function.
+// The display callback function of the GLUT backend.
 /////////////////////////////////////////////////////////////////////////////
 
-static void MyReshape(int w, int h)
+static void CleanUpRadiosityComputation(void);
+static void CleanUpOpenGL(void);
+
+static void MyDisplay(void)
 {
-    if (w != winWidthHeight || h != winWidthHeight)
-        ShowFatalError(__FILE__, __LINE__, "Window size has been changed");
+    ComputeSolution();
+    CleanUpRadiosityComputation();
+    CleanUpOpenGL();
+    TP_CleanUp();
+    printf("DONE.\n");
+    exit(0);
 }
 
 
@@ -390,6 +1480,10 @@ static void MyReshape(int w, int h)
 
 static void InitOpenGL(void)
 {
+    // Render into an offscreen framebuffer of the hemicube resolution.
+    GLC_LoadFunctions();
+    hemicubeFramebuffer = GLC_CreateFramebuffer(hemicubeRes, hemicubeAtlas ? 3 * hemicubeRes : hemicubeRes);
+
     // Set background color.
     glClearColor(backgroundColor[0], backgroundColor[1], backgroundColor[2], backgroundColor[3]);
 
@@ -400,16 +1494,8 @@ static void InitOpenGL(void)
     glDisable(GL_BLEND);
     glDisable(GL_LIGHTING);
     glDisable(GL_CULL_FACE);
-}
-
-
-
-/////////////////////////////////////////////////////////////////////////////
-// Initialize for the progressive refinement radiosity computation.
-/////////////////////////////////////////////////////////////////////////////
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
-static void InitRadiosityComputation(void)
-{
     // Check that we have 24-bit RGB colorbuffer for item buffering.
     GLint Rbits, Gbits, Bbits;
     glGetIntegerv(GL_RED_BITS, &Rbits);
@@ -419,43 +1505,446 @@ static void InitRadiosityComputation(void)
 
     if (Rbits != 8 || Gbits != 8 || Bbits != 8)
         ShowFatalError(__FILE__, __LINE__, "Colorbuffer is not 24-bit RGB");
+}
 
+
+
+static void CleanUpOpenGL(void)
+{
+    if (gathererQuadsDList != 0) glDeleteLists(gathererQuadsDList, 1);
+    gathererQuadsDList = 0;
+    if (readbackPBOs != NULL)
+        for (int i = 0; i < readbackBuffers; i++) GLC_DestroyPixelPackBuffer(&readbackPBOs[i]);
+    free(readbackPBOs);
+    readbackPBOs = NULL;
+    GLC_DestroyFramebuffer(&hemicubeFramebuffer);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Initialize for the progressive refinement radiosity computation.
+/////////////////////////////////////////////////////////////////////////////
+
+static void InitModel(void)
+// Read and subdivide the model, and set up its solver state. The matrix method maps its form
+// factors from the cache file here, before any backend is set up, so that a hit skips the setup.
+{
     // Read input model file.
     printf("Reading input model file...\n");
     model = QM_ReadFile(inputModelFilename);
 
     // Subdivide the original quads to shooter quads and gatherer quads.
     printf("Subdividing original quads...\n");
+    model.useHugePages = useHugePages;
     QM_Subdivide(&model);
+    printf("%d shooter quads and %d gatherer quads, with %d T-junctions between gatherer quads, in %.2f MB.\n",
+           model.totalShooters, model.totalGatherers, model.numTJunctions, model.arenaBytes / (1024.0 * 1024.0));
+
+    if (solverMethod == METHOD_MATRIX && formFactorCacheFilename != NULL)
+    {
+        double startTime = GetCurrRealTime();
+        formFactorsCached = FM_MatrixMap(&ffMatrix, formFactorCacheFilename, FormFactorCacheKey(),
+                                         model.totalGatherers, model.totalShooters);
+        if (formFactorsCached)
+            printf("Form factor matrix of %.0f entries (%.2f MB) mapped from \"%s\" in %.3f seconds.\n",
+                   (double)ffMatrix.numEntries, FM_MatrixBytes(&ffMatrix) / (1024.0 * 1024.0), formFactorCacheFilename,
+                   GetCurrRealTime() - startTime);
+    }
+
+    // Initialize the unshot power of the shooter quads and the radiosity of the gatherer quads.
+    QM_ResetSolverState(&model);
+    shooterQueue = MakeShooterQueue(&model);
+}
 
-    // Make OpenGL display list for the gatherer quads.
-    printf("Making OpenGL display list for gatherer patches...\n");
-    gathererQuadsDList = MakeGathererQuadsDisplayList(&model);
 
-    // Pre-compute the delta form factors for the fixed window resolution.
+static bool NeedsOpenGL(void)
+// Returns whether the run needs an OpenGL context: the gl and egl backends do, unless the
+// form factors were mapped from the cache file.
+{
+    return UsesOpenGL() && !formFactorsCached;
+}
+
+
+static void InitRadiosityComputation(void)
+// Set up the backend that computes the form factors. InitModel() must be called first.
+{
+    if (formFactorsCached) return;
+
+    if (UsesOpenGL())
+    {
+        // Gatherer IDs are drawn as 24-bit colors, and white is the background.
+        if (model.totalGatherers >= backgroundColorInt)
+            ShowFatalError(__FILE__, __LINE__, "Too many gatherer quads for 24-bit item buffers");
+
+        // Make OpenGL display list for the gatherer quads.
+        printf("Making OpenGL display list for gatherer patches...\n");
+        gathererQuadsDList = MakeGathererQuadsDisplayList(&model);
+
+        colorBuf = (GLubyte *)CheckedMalloc(sizeof(GLubyte) * 3 * hemicubeRes * hemicubeRes);
+        itemBufs[0] = (GLuint *)CheckedMalloc(sizeof(GLuint) * hemicubeRes * hemicubeRes);
+        for (int face = 1; face <= 4; face++)
+            itemBufs[face] = (GLuint *)CheckedMalloc(sizeof(GLuint) * hemicubeRes * hemicubeRes / 2);
+
+        if (hemicubeAtlas)
+            atlasItemBuf = (GLuint *)CheckedMalloc(sizeof(GLuint) * 3 * hemicubeRes * hemicubeRes);
+
+        // A face is read back as RGB bytes, and the atlas of 3 x hemicubeRes rows as 32-bit RGBA.
+        int readbackBytes = hemicubeAtlas ? (int)sizeof(GLuint) * 3 * hemicubeRes * hemicubeRes
+                                          : 3 * hemicubeRes * hemicubeRes;
+        readbackPBOs = (GLuint *)CheckedMalloc(sizeof(GLuint) * (readbackBuffers > 0 ? readbackBuffers : 1));
+        for (int i = 0; i < readbackBuffers; i++)
+            readbackPBOs[i] = GLC_CreatePixelPackBuffer(readbackBytes);
+    }
+    else if (hemicubeBackend == BACKEND_RAY || hemicubeBackend == BACKEND_ANALYTIC || solverMethod == METHOD_HIERARCHICAL ||
+             solverMethod == METHOD_STOCHASTIC || solverMethod == METHOD_LOWRANK)
+    {
+        printf("Building BVH of gatherer patches with %d threads...\n", TP_NumWorkers());
+        double buildStartTime = GetCurrRealTime();
+        // The BVH keeps its own copy of the vertices in leaf order, so the scene is only needed
+        // while building it; keeping both would double the vertex memory of the ray backends.
+        HC_Scene bvhScene = HC_SceneInit(&model);
+        rayBvh = RC_BvhInit(bvhScene.numQuads, bvhScene.quads);
+        HC_SceneCleanUp(&bvhScene);
+        printf("BVH of %d nodes and %d levels built in %.3f seconds.\n", rayBvh.numNodes, rayBvh.depth,
+               GetCurrRealTime() - buildStartTime);
+
+        if (solverMethod == METHOD_HIERARCHICAL)
+        {
+            hierarchy = HR_HierarchyInit(&model, &rayBvh, linkFormFactorEpsilon,
+                                         (int)ceil(sqrt((double)shadowRaysPerGatherer)), 1e-5f * model.radius);
+        }
+        else if (solverMethod == METHOD_STOCHASTIC)
+        {
+            sjSolver = SJ_SolverInit(&model, &rayBvh, 1e-5f * model.radius);
+        }
+        else if (solverMethod == METHOD_LOWRANK)
+        {
+            // The blocks are computed by ComputeLowRankRadiosity(), so that their time is reported.
+        }
+        else if (hemicubeBackend == BACKEND_ANALYTIC)
+        {
+            shadowGridRes = (int)ceil(sqrt((double)shadowRaysPerGatherer));
+            analyticFormFactors = (float **)CheckedMalloc(sizeof(float *) * batchSize);
+            for (int k = 0; k < batchSize; k++)
+                analyticFormFactors[k] = (float *)CheckedMalloc(sizeof(float) * (model.totalGatherers > 0 ? model.totalGatherers : 1));
+        }
+        else
+        {
+            rayGridRes = (int)ceil(sqrt((double)raysPerShooter));
+            rayHitBufs = (unsigned int **)CheckedMalloc(sizeof(unsigned int *) * batchSize);
+            for (int k = 0; k < batchSize; k++)
+                rayHitBufs[k] = (unsigned int *)CheckedMalloc(sizeof(unsigned int) * rayGridRes * rayGridRes);
+
+            float *rayFormFactors = (float *)CheckedMalloc(sizeof(float) * rayGridRes * rayGridRes);
+            for (int i = 0; i < rayGridRes * rayGridRes; i++) rayFormFactors[i] = 1.0f / (rayGridRes * rayGridRes);
+            rayRowPrefixSums = (double *)CheckedMalloc(sizeof(double) * (rayGridRes + 1) * rayGridRes);
+            FF_ComputeRowPrefixSums(rayRowPrefixSums, rayFormFactors, rayGridRes, rayGridRes);
+            free(rayFormFactors);
+        }
+    }
+    else
+    {
+        printf("Setting up software hemicube renderer with %d threads...\n", TP_NumWorkers());
+        hcScene = HC_SceneInit(&model);
+        hemicubes = (HC_Hemicube *)CheckedMalloc(sizeof(HC_Hemicube) * batchSize);
+        for (int k = 0; k < batchSize; k++) hemicubes[k] = HC_HemicubeInit(hemicubeRes);
+    }
+
+    ffReducer = FF_ReducerInit(model.totalGatherers);
+    shooterRows = (FF_Row *)CheckedMalloc(sizeof(FF_Row) * batchSize);
+    for (int k = 0; k < batchSize; k++) shooterRows[k] = FF_RowInit();
+    rowCache = LC_CacheInit(model.totalShooters, (size_t)(rowCacheMegabytes * 1024.0 * 1024.0));
+
+    // Pre-compute the delta form factors for the fixed hemicube resolution.
     printf("Pre-compute delta form factors...\n");
-    topDeltaFormFactors = (float *)CheckedMalloc(sizeof(float) * winWidthHeight * winWidthHeight);
-    sideDeltaFormFactors = (float *)CheckedMalloc(sizeof(float) * winWidthHeight * winWidthHeight / 2);
-    PreComputeTopFaceDeltaFormFactors(topDeltaFormFactors, winWidthHeight);
-    PreComputeSideFaceDeltaFormFactors(sideDeltaFormFactors, winWidthHeight);
+    topDeltaFormFactors = (float *)CheckedMalloc(sizeof(float) * hemicubeRes * hemicubeRes);
+    sideDeltaFormFactors = (float *)CheckedMalloc(sizeof(float) * hemicubeRes * hemicubeRes / 2);
+    PreComputeTopFaceDeltaFormFactors(topDeltaFormFactors, hemicubeRes);
+    PreComputeSideFaceDeltaFormFactors(sideDeltaFormFactors, hemicubeRes);
 
-    // Initialize the unshot power of the shooter quads.
-    for (int s = 0; s < model.totalShooters; s++)
+    topRowPrefixSums = (double *)CheckedMalloc(sizeof(double) * (hemicubeRes + 1) * hemicubeRes);
+    sideRowPrefixSums = (double *)CheckedMalloc(sizeof(double) * (hemicubeRes + 1) * hemicubeRes / 2);
+    FF_ComputeRowPrefixSums(topRowPrefixSums, topDeltaFormFactors, hemicubeRes, hemicubeRes);
+    FF_ComputeRowPrefixSums(sideRowPrefixSums, sideDeltaFormFactors, hemicubeRes, hemicubeRes / 2);
+
+    if (UsesOpenGL() && hemicubeAtlas)
     {
-        QM_ShooterQuad *shooterQuad = model.shooters[s];
-        shooterQuad->unshotPower[0] = shooterQuad->area * shooterQuad->surface->emission[0];
-        shooterQuad->unshotPower[1] = shooterQuad->area * shooterQuad->surface->emission[1];
-        shooterQuad->unshotPower[2] = shooterQuad->area * shooterQuad->surface->emission[2];
+        // Lay out the prefix sums of the faces like the faces in the atlas.
+        int rowLength = hemicubeRes + 1;
+        atlasRowPrefixSums = (double *)CheckedMalloc(sizeof(double) * rowLength * 3 * hemicubeRes);
+        for (int face = 0; face < HC_NUM_FACES; face++)
+            CopyArrayN(&atlasRowPrefixSums[AtlasFaceRow(face) * rowLength],
+                       (face == 0) ? topRowPrefixSums : sideRowPrefixSums, rowLength * FaceHeight(face));
     }
+}
 
-    // Initialize the radiosity of the gatherer quads.
-    for (int g = 0; g < model.totalGatherers; g++)
+
+
+static void CleanUpRadiosityComputation(void)
+{
+    free(colorBuf);
+    for (int face = 0; face < HC_NUM_FACES; face++) free(itemBufs[face]);
+    if (shooterRows != NULL)
+        for (int k = 0; k < batchSize; k++) FF_RowCleanUp(&shooterRows[k]);
+    free(shooterRows);
+    FF_ReducerCleanUp(&ffReducer);
+    LC_CacheCleanUp(&rowCache);
+    free(topDeltaFormFactors);
+    free(sideDeltaFormFactors);
+    free(topRowPrefixSums);
+    free(sideRowPrefixSums);
+    free(atlasRowPrefixSums);
+    free(atlasItemBuf);
+    if (hemicubes != NULL)
+        for (int k = 0; k < batchSize; k++) HC_HemicubeCleanUp(&hemicubes[k]);
+    free(hemicubes);
+    HC_SceneCleanUp(&hcScene);
+    if (rayHitBufs != NULL)
+        for (int k = 0; k < batchSize; k++) free(rayHitBufs[k]);
+    free(rayHitBufs);
+    free(rayRowPrefixSums);
+    if (analyticFormFactors != NULL)
+        for (int k = 0; k < batchSize; k++) free(analyticFormFactors[k]);
+    free(analyticFormFactors);
+    HR_HierarchyCleanUp(&hierarchy);
+    SJ_SolverCleanUp(&sjSolver);
+    FM_MatrixCleanUp(&ffMatrix);
+    LR_OperatorCleanUp(&lrOperator);
+    RC_BvhCleanUp(&rayBvh);
+    PQ_CleanUp(&shooterQueue);
+    QM_ModelCleanUp(&model);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read the options from the command line.
+/////////////////////////////////////////////////////////////////////////////
+
+static void PrintUsage(const char *progName)
+{
+    printf("Usage: %s [options]\n", progName);
+    printf("  -backend cpu|gl|egl|ray|analytic  Renderer for the form factors (default cpu): software\n");
+    printf("                    hemicube rasterizer, OpenGL hemicube in a GLUT window, headless OpenGL\n");
+    printf("                    hemicube with EGL, rays cast through a BVH on the CPU, or exact\n");
+    printf("                    unoccluded form factors scaled by shadow-ray visibility.\n");
+    printf("  -method progressive|hierarchical|stochastic|matrix|lowrank  Progressive refinement shooting\n");
+    printf("                    with the form factors of the backend (default), hierarchical radiosity\n");
+    printf("                    gathering over links refined through the quad hierarchy, stochastic Jacobi\n");
+    printf("                    shooting of all the unshot power with random rays (cpu, ray or analytic\n");
+    printf("                    backend), sweeps over a sparse matrix of the form factors of the backend,\n");
+    printf("                    or sweeps over blocks of analytic form factors between clusters of quads,\n");
+    printf("                    with the blocks between distant clusters compressed to low rank.\n");
+    printf("  -sweep jacobi|gaussseidel  Sweeps of the matrix method (default %s).\n", gaussSeidelSweeps ? "gaussseidel" : "jacobi");
+    printf("  -acaeps E         Relative accuracy of the low-rank blocks of the low-rank method (default %g).\n", acaEpsilon);
+    printf("  -multigrid 0|1    Solve the coarse system of the shooters before the sweeps of the matrix\n");
+    printf("                    method, so that they reach -epsilon in about 1 sweep (default %d).\n", multigridSolve ? 1 : 0);
+    printf("  -ffcache FILE     Cache file of the form factor matrix of the matrix method. A later run\n");
+    printf("                    with the same geometry and form factor settings maps it instead of\n");
+    printf("                    computing the form factors again (default none).\n");
+    printf("  -hrffeps F        Form factor above which hierarchical radiosity links finer elements (default %g).\n", linkFormFactorEpsilon);
+    printf("  -hrbfeps F        Hierarchical radiosity refines links that carry more than F times the\n");
+    printf("                    highest emission between iterations (default %g).\n", linkBFEpsilon);
+    printf("  -samples N        Total number of rays of the stochastic method (default %d).\n", stochasticRays);
+    printf("  -res N            Hemicube resolution, even number (default %d).\n", hemicubeRes);
+    printf("  -atlas 0|1        Render the 5 faces of each hemicube into one atlas and read it back at once\n");
+    printf("                    (gl and egl backends, default %d).\n", hemicubeAtlas ? 1 : 0);
+    printf("  -pbo N            Number of pixel pack buffers for pipelined readback of the gl and egl\n");
+    printf("                    backends, 0 = synchronous readback (default %d).\n", readbackBuffers);
+    printf("  -rays N           Number of rays per shooter of the ray backend (default %d).\n", raysPerShooter);
+    printf("  -shadowrays N     Number of shadow rays per gatherer of the analytic backend, or per link\n");
+    printf("                    of hierarchical radiosity (default %d).\n", shadowRaysPerGatherer);
+    printf("  -overshoot W      Overshooting factor of progressive refinement: shooters also shoot W times\n");
+    printf("                    the power they are estimated to get back, 0 = none (default %g).\n", overshootFactor);
+    printf("  -ambient 0|1      Add an ambient term for the light not shot yet to the radiosities written\n");
+    printf("                    out by the progressive and stochastic methods (default %d).\n", addAmbientTerm ? 1 : 0);
+    printf("  -rowcache MB      Memory budget of the cache of the form factor rows of the shooters of\n");
+    printf("                    progressive refinement, 0 = no cache (default %g).\n", rowCacheMegabytes);
+    printf("  -hugepages 0|1    Ask for huge pages for the subdivided model (default %d).\n", useHugePages ? 1 : 0);
+    printf("  -threads N        Number of worker threads, 0 = all hardware threads (default 0).\n");
+    printf("  -batch K          Shoot the K shooters with the highest unshot power in each iteration,\n");
+    printf("                    rendering their hemicubes concurrently (cpu backend), or pipelining\n");
+    printf("                    their faces (gl and egl backends, default 1).\n");
+    printf("  -maxiter N        Stop after N iterations, 0 = no limit (default %d).\n", maxIterations);
+    printf("  -maxtime S        Stop after S seconds of wall-clock time, 0 = no limit (default 0).\n");
+    printf("  -epsilon E        Stop when the unshot power, or the change of the power in a sweep of the\n");
+    printf("                    matrix and low-rank methods, is below E times the emitted power, 0 = never\n");
+    printf("                    (default 0, or %g for the matrix and low-rank methods).\n", DEFAULT_SWEEP_EPSILON);
+}
+
+
+static void ParseCommandLine(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
     {
-        QM_GathererQuad *gathererQuad = model.gatherers[g];
-        gathererQuad->radiosity[0] = gathererQuad->surface->emission[0];
-        gathererQuad->radiosity[1] = gathererQuad->surface->emission[1];
-        gathererQuad->radiosity[2] = gathererQuad->surface->emission[2];
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-help") == 0 || strcmp(arg, "-h") == 0)
+        {
+            PrintUsage(argv[0]);
+            exit(0);
+        }
+        else if (strcmp(arg, "-backend") == 0 && val != NULL)
+        {
+            if (strcmp(val, "cpu") == 0) hemicubeBackend = BACKEND_CPU;
+            else if (strcmp(val, "gl") == 0) hemicubeBackend = BACKEND_GL;
+            else if (strcmp(val, "egl") == 0) hemicubeBackend = BACKEND_EGL;
+            else if (strcmp(val, "ray") == 0) hemicubeBackend = BACKEND_RAY;
+            else if (strcmp(val, "analytic") == 0) hemicubeBackend = BACKEND_ANALYTIC;
+            else ShowFatalError(__FILE__, __LINE__, "Unknown hemicube backend \"%s\"", val);
+            i++;
+        }
+        else if (strcmp(arg, "-method") == 0 && val != NULL)
+        {
+            if (strcmp(val, "progressive") == 0) solverMethod = METHOD_PROGRESSIVE;
+            else if (strcmp(val, "hierarchical") == 0) solverMethod = METHOD_HIERARCHICAL;
+            else if (strcmp(val, "stochastic") == 0) solverMethod = METHOD_STOCHASTIC;
+            else if (strcmp(val, "matrix") == 0) solverMethod = METHOD_MATRIX;
+            else if (strcmp(val, "lowrank") == 0) solverMethod = METHOD_LOWRANK;
+            else ShowFatalError(__FILE__, __LINE__, "Unknown radiosity method \"%s\"", val);
+            i++;
+        }
+        else if (strcmp(arg, "-hrffeps") == 0 && val != NULL)
+        {
+            linkFormFactorEpsilon = (float)atof(val);
+            if (linkFormFactorEpsilon <= 0.0f) ShowFatalError(__FILE__, __LINE__, "Link form factor epsilon must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-hrbfeps") == 0 && val != NULL)
+        {
+            linkBFEpsilon = (float)atof(val);
+            if (linkBFEpsilon <= 0.0f) ShowFatalError(__FILE__, __LINE__, "Link refinement epsilon must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-acaeps") == 0 && val != NULL)
+        {
+            acaEpsilon = (float)atof(val);
+            if (acaEpsilon <= 0.0f) ShowFatalError(__FILE__, __LINE__, "ACA epsilon must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-multigrid") == 0 && val != NULL)
+        {
+            multigridSolve = (atoi(val) != 0);
+            i++;
+        }
+        else if (strcmp(arg, "-sweep") == 0 && val != NULL)
+        {
+            if (strcmp(val, "jacobi") == 0) gaussSeidelSweeps = false;
+            else if (strcmp(val, "gaussseidel") == 0) gaussSeidelSweeps = true;
+            else ShowFatalError(__FILE__, __LINE__, "Unknown sweep \"%s\"", val);
+            i++;
+        }
+        else if (strcmp(arg, "-ffcache") == 0 && val != NULL)
+        {
+            formFactorCacheFilename = val;
+            i++;
+        }
+        else if (strcmp(arg, "-samples") == 0 && val != NULL)
+        {
+            stochasticRays = atoi(val);
+            if (stochasticRays <= 0) ShowFatalError(__FILE__, __LINE__, "Number of rays must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-res") == 0 && val != NULL)
+        {
+            hemicubeRes = atoi(val);
+            if (hemicubeRes <= 0 || hemicubeRes % 2 != 0)
+                ShowFatalError(__FILE__, __LINE__, "Hemicube resolution must be a positive even number");
+            i++;
+        }
+        else if (strcmp(arg, "-atlas") == 0 && val != NULL)
+        {
+            hemicubeAtlas = (atoi(val) != 0);
+            i++;
+        }
+        else if (strcmp(arg, "-pbo") == 0 && val != NULL)
+        {
+            readbackBuffers = atoi(val);
+            if (readbackBuffers < 0) ShowFatalError(__FILE__, __LINE__, "Number of pixel pack buffers cannot be negative");
+            i++;
+        }
+        else if (strcmp(arg, "-rays") == 0 && val != NULL)
+        {
+            raysPerShooter = atoi(val);
+            if (raysPerShooter <= 0) ShowFatalError(__FILE__, __LINE__, "Number of rays must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-shadowrays") == 0 && val != NULL)
+        {
+            shadowRaysPerGatherer = atoi(val);
+            if (shadowRaysPerGatherer <= 0) ShowFatalError(__FILE__, __LINE__, "Number of shadow rays must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-overshoot") == 0 && val != NULL)
+        {
+            overshootFactor = atof(val);
+            if (overshootFactor < 0.0) ShowFatalError(__FILE__, __LINE__, "Overshooting factor cannot be negative");
+            i++;
+        }
+        else if (strcmp(arg, "-ambient") == 0 && val != NULL)
+        {
+            addAmbientTerm = (atoi(val) != 0);
+            i++;
+        }
+        else if (strcmp(arg, "-rowcache") == 0 && val != NULL)
+        {
+            rowCacheMegabytes = atof(val);
+            if (rowCacheMegabytes < 0.0) ShowFatalError(__FILE__, __LINE__, "Row cache budget cannot be negative");
+            i++;
+        }
+        else if (strcmp(arg, "-hugepages") == 0 && val != NULL)
+        {
+            useHugePages = (atoi(val) != 0);
+            i++;
+        }
+        else if (strcmp(arg, "-threads") == 0 && val != NULL)
+        {
+            numThreads = atoi(val);
+            i++;
+        }
+        else if (strcmp(arg, "-batch") == 0 && val != NULL)
+        {
+            batchSize = atoi(val);
+            if (batchSize <= 0) ShowFatalError(__FILE__, __LINE__, "Batch size must be positive");
+            i++;
+        }
+        else if (strcmp(arg, "-maxiter") == 0 && val != NULL)
+        {
+            maxIterations = atoi(val);
+            if (maxIterations < 0) ShowFatalError(__FILE__, __LINE__, "Maximum number of iterations cannot be negative");
+            i++;
+        }
+        else if (strcmp(arg, "-maxtime") == 0 && val != NULL)
+        {
+            maxSeconds = atof(val);
+            if (maxSeconds < 0.0) ShowFatalError(__FILE__, __LINE__, "Time budget cannot be negative");
+            i++;
+        }
+        else if (strcmp(arg, "-epsilon") == 0 && val != NULL)
+        {
+            residualEpsilon = atof(val);
+            if (residualEpsilon < 0.0) ShowFatalError(__FILE__, __LINE__, "Residual epsilon cannot be negative");
+            i++;
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            ShowFatalError(__FILE__, __LINE__, "Invalid command-line option \"%s\"", arg);
+        }
     }
+
+    if (residualEpsilon < 0.0)
+        residualEpsilon = (solverMethod == METHOD_MATRIX || solverMethod == METHOD_LOWRANK) ? DEFAULT_SWEEP_EPSILON : 0.0;
+
+    if (maxIterations == 0 && maxSeconds == 0.0 && residualEpsilon == 0.0)
+        ShowFatalError(__FILE__, __LINE__, "At least one of -maxiter, -maxtime and -epsilon must be set");
+
+    if ((solverMethod == METHOD_HIERARCHICAL || solverMethod == METHOD_STOCHASTIC || solverMethod == METHOD_LOWRANK) &&
+        (hemicubeBackend == BACKEND_GL || hemicubeBackend == BACKEND_EGL))
+        ShowFatalError(__FILE__, __LINE__, "Hierarchical, stochastic and low-rank radiosity do not use the OpenGL backends");
 }
 
 
@@ -467,36 +1956,47 @@ static void InitRadiosityComputation(void)
 
 int main(int argc, char** argv)
 {
-    // Initialize GLUT and create the drawing window.
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGB | GLUT_SINGLE | GLUT_DEPTH);
-    glutInitWindowSize(winWidthHeight, winWidthHeight); // Window must be square and size is fixed.
-    glutCreateWindow("Radiosity Solver");
+    ParseCommandLine(argc, argv);
+    TP_Init(numThreads);
+    InitModel();
 
-    // Required for macOS.
-    int winWidth = glutGet(GLUT_WINDOW_WIDTH);
-    int winHeight = glutGet(GLUT_WINDOW_HEIGHT);
-    printf("Initial Window Size = %d x %d\n", winWidth, winHeight);
-    if (winWidth != winHeight || winWidth % 2 != 0)
-        ShowFatalError(__FILE__, __LINE__, "Window size is not square or its width is not even");
-    winWidthHeight = winWidth;
+    if (!NeedsOpenGL() || hemicubeBackend == BACKEND_EGL)
+    {
+        // No window is needed. Run the whole computation right away.
+        bool headlessContext = NeedsOpenGL();
+        if (headlessContext)
+        {
+            GLC_CreateHeadlessContext();
+            InitOpenGL();
+        }
 
+        InitRadiosityComputation();
+        ComputeSolution();
+        CleanUpRadiosityComputation();
 
-    printf("\nIMPORTANT:\n");
-    printf("Do not minimize, move, resize, or cover the drawing window.\n\n");
-    printf("Press ENTER in this console window to start the radiosity computation.\n");
-    char ch;
-    scanf("%c", &ch);
+        if (headlessContext)
+        {
+            CleanUpOpenGL();
+            GLC_DestroyHeadlessContext();
+        }
+        TP_CleanUp();
+        printf("DONE.\n");
+        return 0;
+    }
 
+    // Initialize GLUT and create the window that provides the OpenGL context.
+    glutInit(&argc, argv);
+    glutInitDisplayMode(GLUT_RGB | GLUT_SINGLE | GLUT_DEPTH);
+    glutInitWindowSize(winWidthHeight, winWidthHeight);
+    glutCreateWindow("Radiosity Solver");
 
     InitOpenGL();
 
-    // Initialize for the progressive refinement radiosity computation.
+    // Set up the OpenGL backend.
     InitRadiosityComputation();
 
-    // Register the callback functions.
-    glutDisplayFunc(ComputeRadiosity);
-    glutReshapeFunc(MyReshape);
+    // Register the callback function.
+    glutDisplayFunc(MyDisplay);
 
     // Enter GLUT event loop.
     glutMainLoop();
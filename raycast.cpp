@@ -0,0 +1,734 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "common.h"
+#include "vector3.h"
+#include "threadpool.h"
+#include "raycast.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RC_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+#define NUM_BINS        16      // Number of bins per axis for evaluating SAH splits.
+#define MAX_LEAF_PRIMS  8       // Leaves with more primitives are always split.
+#define TRAVERSAL_COST  1.0f    // Cost of visiting a node, relative to intersecting a quad.
+#define STACK_SIZE      128     // Traversal stack size, which limits the depth of the BVH.
+#define PACKET_SIZE     4       // Number of rays traced together.
+
+
+// Per-primitive data used while building.
+typedef struct RC_BuildPrims {
+    std::vector<float> bmin, bmax, centroid;    // 3 floats per primitive.
+    std::vector<int> indices;                   // Primitive order, partitioned by the build.
+}
+RC_BuildPrims;
+
+
+// A subtree whose building is deferred to a parallel task.
+typedef struct RC_Subtree {
+    int node, first, count;
+}
+RC_Subtree;
+
+
+
+static inline float BoxHalfArea(const float bmin[3], const float bmax[3])
+{
+    float dx = bmax[0] - bmin[0], dy = bmax[1] - bmin[1], dz = bmax[2] - bmin[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+
+static inline void EmptyBox(float bmin[3], float bmax[3])
+{
+    bmin[0] = bmin[1] = bmin[2] = 1e30f;
+    bmax[0] = bmax[1] = bmax[2] = -1e30f;
+}
+
+
+static inline void GrowBox(float bmin[3], float bmax[3], const float pmin[3], const float pmax[3])
+{
+    for (int a = 0; a < 3; a++)
+    {
+        bmin[a] = Min2(bmin[a], pmin[a]);
+        bmax[a] = Max2(bmax[a], pmax[a]);
+    }
+}
+
+
+static inline int BinOf(float c, float cmin, float binScale)
+{
+    int b = (int)((c - cmin) * binScale);
+    return Clamp(b, 0, NUM_BINS - 1);
+}
+
+
+
+static void BuildNode(RC_BuildPrims *bp, std::vector<RC_Node> &nodes, int nodeIndex, int first, int count,
+                      int grainSize, std::vector<RC_Subtree> *deferred)
+// Build the subtree of primitives bp->indices[first .. first + count - 1] at nodes[nodeIndex].
+// If deferred is not NULL, subtrees of at most grainSize primitives are only added to it.
+{
+    int *indices = &bp->indices[0];
+    float bmin[3], bmax[3], cmin[3], cmax[3];
+    EmptyBox(bmin, bmax);
+    EmptyBox(cmin, cmax);
+    for (int i = first; i < first + count; i++)
+    {
+        int p = indices[i];
+        GrowBox(bmin, bmax, &bp->bmin[3 * p], &bp->bmax[3 * p]);
+        GrowBox(cmin, cmax, &bp->centroid[3 * p], &bp->centroid[3 * p]);
+    }
+    CopyArray3(nodes[nodeIndex].bmin, bmin);
+    CopyArray3(nodes[nodeIndex].bmax, bmax);
+    nodes[nodeIndex].first = first;
+    nodes[nodeIndex].count = count;
+
+    if (count <= 2) return;
+    if (deferred != NULL && count <= grainSize)
+    {
+        RC_Subtree st = { nodeIndex, first, count };
+        deferred->push_back(st);
+        return;
+    }
+
+    // Find the best split of the bins along each axis.
+    float bestCost = 1e30f;
+    int bestAxis = -1, bestSplit = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        float extent = cmax[a] - cmin[a];
+        if (extent <= 0.0f) continue;
+        float binScale = NUM_BINS / extent;
+
+        int binCount[NUM_BINS] = { 0 };
+        float binMin[NUM_BINS][3], binMax[NUM_BINS][3];
+        for (int b = 0; b < NUM_BINS; b++) EmptyBox(binMin[b], binMax[b]);
+        for (int i = first; i < first + count; i++)
+        {
+            int p = indices[i];
+            int b = BinOf(bp->centroid[3 * p + a], cmin[a], binScale);
+            binCount[b]++;
+            GrowBox(binMin[b], binMax[b], &bp->bmin[3 * p], &bp->bmax[3 * p]);
+        }
+
+        // Sweep from the right to get the cost of the right side of each split.
+        float rightCost[NUM_BINS];
+        float rmin[3], rmax[3];
+        EmptyBox(rmin, rmax);
+        int rightCount = 0;
+        for (int b = NUM_BINS - 1; b > 0; b--)
+        {
+            GrowBox(rmin, rmax, binMin[b], binMax[b]);
+            rightCount += binCount[b];
+            rightCost[b] = (rightCount > 0) ? rightCount * BoxHalfArea(rmin, rmax) : 0.0f;
+        }
+
+        float lmin[3], lmax[3];
+        EmptyBox(lmin, lmax);
+        int leftCount = 0;
+        for (int split = 1; split < NUM_BINS; split++)
+        {
+            GrowBox(lmin, lmax, binMin[split - 1], binMax[split - 1]);
+            leftCount += binCount[split - 1];
+            if (leftCount == 0 || leftCount == count) continue;
+            float cost = leftCount * BoxHalfArea(lmin, lmax) + rightCost[split];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = a;
+                bestSplit = split;
+            }
+        }
+    }
+
+    int mid;
+    if (bestAxis >= 0)
+    {
+        float leafCost = (float)count;
+        float splitCost = TRAVERSAL_COST + bestCost / BoxHalfArea(bmin, bmax);
+        if (splitCost >= leafCost && count <= MAX_LEAF_PRIMS) return;
+
+        // Partition the primitives by their bin.
+        float binScale = NUM_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+        int i = first, j = first + count - 1;
+        while (i <= j)
+        {
+            if (BinOf(bp->centroid[3 * indices[i] + bestAxis], cmin[bestAxis], binScale) < bestSplit)
+                i++;
+            else
+            {
+                int t = indices[i]; indices[i] = indices[j]; indices[j] = t;
+                j--;
+            }
+        }
+        mid = i;
+    }
+    else
+    {
+        // All the centroids coincide; split in half if the leaf would be too large.
+        if (count <= MAX_LEAF_PRIMS) return;
+        mid = first + count / 2;
+    }
+
+    int left = (int)nodes.size();
+    nodes.resize(left + 2);
+    nodes[nodeIndex].first = left;
+    nodes[nodeIndex].count = 0;
+    BuildNode(bp, nodes, left, first, mid - first, grainSize, deferred);
+    BuildNode(bp, nodes, left + 1, mid, first + count - mid, grainSize, deferred);
+}
+
+
+
+RC_Bvh RC_BvhInit(int numQuads, const float (*quads)[4][3])
+// Build a BVH of the quads.
+{
+    RC_Bvh bvh;
+    bvh.numPrims = numQuads;
+    bvh.prims = (float (*)[4][3])CheckedMalloc(sizeof(float) * 12 * (numQuads > 0 ? numQuads : 1));
+    bvh.items = (unsigned int *)CheckedMalloc(sizeof(unsigned int) * (numQuads > 0 ? numQuads : 1));
+    bvh.numNodes = 0;
+    bvh.nodes = NULL;
+    bvh.depth = 0;
+    if (numQuads == 0) return bvh;
+
+    // Bounding boxes and centroids of the quads.
+    RC_BuildPrims bp;
+    bp.bmin.resize(3 * numQuads);
+    bp.bmax.resize(3 * numQuads);
+    bp.centroid.resize(3 * numQuads);
+    bp.indices.resize(numQuads);
+
+    const int CHUNK_PRIMS = 4096;
+    TP_ParallelFor((numQuads + CHUNK_PRIMS - 1) / CHUNK_PRIMS, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_PRIMS, numQuads);
+        for (int p = chunk * CHUNK_PRIMS; p < end; p++)
+        {
+            EmptyBox(&bp.bmin[3 * p], &bp.bmax[3 * p]);
+            for (int v = 0; v < 4; v++) GrowBox(&bp.bmin[3 * p], &bp.bmax[3 * p], quads[p][v], quads[p][v]);
+            for (int a = 0; a < 3; a++) bp.centroid[3 * p + a] = 0.5f * (bp.bmin[3 * p + a] + bp.bmax[3 * p + a]);
+            bp.indices[p] = p;
+        }
+    });
+
+    // Build the top of the tree serially, deferring the subtrees below the grain size.
+    int grainSize = Max2(numQuads / (8 * TP_NumWorkers()), 256);
+    std::vector<RC_Node> nodes(1);
+    std::vector<RC_Subtree> deferred;
+    BuildNode(&bp, nodes, 0, 0, numQuads, grainSize, &deferred);
+
+    // Build the deferred subtrees in parallel, each into its own node array with its root at 0.
+    int numDeferred = (int)deferred.size();
+    std::vector< std::vector<RC_Node> > subtreeNodes(numDeferred);
+    TP_ParallelFor(numDeferred, [&](int s, int) {
+        subtreeNodes[s].resize(1);
+        BuildNode(&bp, subtreeNodes[s], 0, deferred[s].first, deferred[s].count, 0, NULL);
+    });
+
+    // Append the subtrees, replacing their placeholder nodes by their roots.
+    for (int s = 0; s < numDeferred; s++)
+    {
+        std::vector<RC_Node> &sub = subtreeNodes[s];
+        int base = (int)nodes.size() - 1;   // Local node i > 0 goes to base + i.
+        for (size_t i = 0; i < sub.size(); i++)
+            if (sub[i].count == 0) sub[i].first += base;
+        nodes[deferred[s].node] = sub[0];
+        nodes.insert(nodes.end(), sub.begin() + 1, sub.end());
+    }
+
+    bvh.numNodes = (int)nodes.size();
+    bvh.nodes = (RC_Node *)CheckedMalloc(sizeof(RC_Node) * bvh.numNodes);
+    CopyArrayN(bvh.nodes, &nodes[0], bvh.numNodes);
+
+    // Children always come after their parent, so the depths can be found in one pass.
+    std::vector<int> depth(bvh.numNodes, 1);
+    for (int n = 0; n < bvh.numNodes; n++)
+    {
+        bvh.depth = Max2(bvh.depth, depth[n]);
+        if (bvh.nodes[n].count == 0) depth[bvh.nodes[n].first] = depth[bvh.nodes[n].first + 1] = depth[n] + 1;
+    }
+    if (bvh.depth >= STACK_SIZE)
+        ShowFatalError(__FILE__, __LINE__, "BVH is too deep (%d levels)", bvh.depth);
+
+    // Store the quads in leaf order.
+    for (int i = 0; i < numQuads; i++)
+    {
+        int p = bp.indices[i];
+        CopyArray3(bvh.prims[i][0], quads[p][0]);
+        for (int v = 1; v < 4; v++) VecDiff(bvh.prims[i][v], quads[p][v], quads[p][0]);
+        bvh.items[i] = (unsigned int)p;
+    }
+    return bvh;
+}
+
+
+void RC_BvhCleanUp(RC_Bvh *bvh)
+{
+    if (bvh == NULL) return;
+    free(bvh->nodes);
+    free(bvh->prims);
+    free(bvh->items);
+    bvh->nodes = NULL;
+    bvh->prims = NULL;
+    bvh->items = NULL;
+    bvh->numNodes = bvh->numPrims = bvh->depth = 0;
+}
+
+
+
+static inline bool IntersectBox(const float org[3], const float invDir[3], float tMin, float tMax, const RC_Node *node)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float t0 = (node->bmin[a] - org[a]) * invDir[a];
+        float t1 = (node->bmax[a] - org[a]) * invDir[a];
+        tMin = Max2(tMin, Min2(t0, t1));
+        tMax = Min2(tMax, Max2(t0, t1));
+    }
+    return tMin <= tMax;
+}
+
+
+static inline void IntersectTriangle(const float org[3], const float dir[3], float tMin, float *tMax, unsigned int *hitItem,
+                                     const float v0[3], const float e1[3], const float e2[3], unsigned int item)
+// Moller-Trumbore intersection of the ray with triangle (v0, v0 + e1, v0 + e2).
+{
+    float p[3], s[3], q[3];
+    VecCrossProd(p, dir, e2);
+    float det = VecDotProd(e1, p);
+    if (det == 0.0f) return;
+    float invDet = 1.0f / det;
+
+    VecDiff(s, org, v0);
+    float u = VecDotProd(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f) return;
+    VecCrossProd(q, s, e1);
+    float v = VecDotProd(dir, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) return;
+    float t = VecDotProd(e2, q) * invDet;
+    if (t <= tMin || t >= *tMax) return;
+
+    *tMax = t;
+    *hitItem = item;
+}
+
+
+
+#ifdef RC_USE_SSE2
+
+// A packet of rays.
+typedef struct RC_Packet {
+    __m128 org[3];          // Origins.
+    __m128 dir[3];          // Directions.
+    __m128 invDir[3];       // Reciprocals of the directions.
+    __m128 tMin, tMax;      // Distance interval of each ray.
+    __m128i item;           // Item hit by each ray so far.
+}
+RC_Packet;
+
+
+static inline int IntersectBoxPacket(const RC_Packet *pk, const RC_Node *node)
+// Returns the mask of the rays of the packet that hit the bounding box of the node.
+{
+    __m128 tNear = pk->tMin, tFar = pk->tMax;
+    for (int a = 0; a < 3; a++)
+    {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->bmin[a]), pk->org[a]), pk->invDir[a]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->bmax[a]), pk->org[a]), pk->invDir[a]);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+    }
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+
+
+static inline void IntersectTrianglePacket(RC_Packet *pk, const float v0[3], const float e1[3], const float e2[3],
+                                           unsigned int item)
+// Moller-Trumbore intersection of the rays of the packet with triangle (v0, v0 + e1, v0 + e2).
+{
+    __m128 e1x = _mm_set1_ps(e1[0]), e1y = _mm_set1_ps(e1[1]), e1z = _mm_set1_ps(e1[2]);
+    __m128 e2x = _mm_set1_ps(e2[0]), e2y = _mm_set1_ps(e2[1]), e2z = _mm_set1_ps(e2[2]);
+
+    // p = dir x e2.
+    __m128 px = _mm_sub_ps(_mm_mul_ps(pk->dir[1], e2z), _mm_mul_ps(pk->dir[2], e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(pk->dir[2], e2x), _mm_mul_ps(pk->dir[0], e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(pk->dir[0], e2y), _mm_mul_ps(pk->dir[1], e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // s = org - v0, q = s x e1.
+    __m128 sx = _mm_sub_ps(pk->org[0], _mm_set1_ps(v0[0]));
+    __m128 sy = _mm_sub_ps(pk->org[1], _mm_set1_ps(v0[1]));
+    __m128 sz = _mm_sub_ps(pk->org[2], _mm_set1_ps(v0[2]));
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(pk->dir[0], qx), _mm_mul_ps(pk->dir[1], qy)),
+                                     _mm_mul_ps(pk->dir[2], qz)), invDet);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+    // A zero determinant gives infinite or NaN values, which fail these tests.
+    __m128 zero = _mm_setzero_ps();
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, pk->tMin), _mm_cmplt_ps(t, pk->tMax)));
+    if (_mm_movemask_ps(hit) == 0) return;
+
+    pk->tMax = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, pk->tMax));
+    __m128i hitInt = _mm_castps_si128(hit);
+    pk->item = _mm_or_si128(_mm_and_si128(hitInt, _mm_set1_epi32((int)item)), _mm_andnot_si128(hitInt, pk->item));
+}
+
+
+static void TracePacket(const RC_Bvh *bvh, RC_Packet *pk, const float meanDir[3])
+// Find the nearest quad hit by each ray of the packet.
+// meanDir is used to visit the nearer child of each node first.
+{
+    int stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const RC_Node *node = &bvh->nodes[stack[--sp]];
+        if (IntersectBoxPacket(pk, node) == 0) continue;
+
+        if (node->count > 0)
+        {
+            for (int i = node->first; i < node->first + node->count; i++)
+            {
+                const float (*q)[3] = bvh->prims[i];
+                IntersectTrianglePacket(pk, q[0], q[1], q[2], bvh->items[i]);
+                IntersectTrianglePacket(pk, q[0], q[2], q[3], bvh->items[i]);
+            }
+            continue;
+        }
+
+        // Push the far child first, judging by the separation of the child boxes along the packet direction.
+        const RC_Node *left = &bvh->nodes[node->first];
+        const RC_Node *right = left + 1;
+        float sep = 0.0f;
+        for (int a = 0; a < 3; a++)
+            sep += meanDir[a] * ((right->bmin[a] + right->bmax[a]) - (left->bmin[a] + left->bmax[a]));
+        if (sep >= 0.0f)
+        {
+            stack[sp++] = node->first + 1;
+            stack[sp++] = node->first;
+        }
+        else
+        {
+            stack[sp++] = node->first;
+            stack[sp++] = node->first + 1;
+        }
+    }
+}
+
+#else
+
+static unsigned int TraceRay(const RC_Bvh *bvh, const float org[3], const float dir[3], const float invDir[3], float tMin)
+// Returns the item of the nearest quad hit by the ray.
+{
+    int stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    float tMax = 1e30f;
+    unsigned int item = RC_MISS_ITEM;
+
+    while (sp > 0)
+    {
+        const RC_Node *node = &bvh->nodes[stack[--sp]];
+        if (!IntersectBox(org, invDir, tMin, tMax, node)) continue;
+
+        if (node->count > 0)
+        {
+            for (int i = node->first; i < node->first + node->count; i++)
+            {
+                const float (*q)[3] = bvh->prims[i];
+                IntersectTriangle(org, dir, tMin, &tMax, &item, q[0], q[1], q[2], bvh->items[i]);
+                IntersectTriangle(org, dir, tMin, &tMax, &item, q[0], q[2], q[3], bvh->items[i]);
+            }
+            continue;
+        }
+
+        const RC_Node *left = &bvh->nodes[node->first];
+        const RC_Node *right = left + 1;
+        float sep = 0.0f;
+        for (int a = 0; a < 3; a++)
+            sep += dir[a] * ((right->bmin[a] + right->bmax[a]) - (left->bmin[a] + left->bmax[a]));
+        if (sep >= 0.0f)
+        {
+            stack[sp++] = node->first + 1;
+            stack[sp++] = node->first;
+        }
+        else
+        {
+            stack[sp++] = node->first;
+            stack[sp++] = node->first + 1;
+        }
+    }
+    return item;
+}
+
+#endif
+
+
+
+static inline unsigned int HashUInt(unsigned int x)
+// A 32-bit integer hash with good avalanche.
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+
+static inline float HashToUnitFloat(unsigned int h)
+// Map a hash to [0, 1).
+{
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static inline void SquareToCosineHemisphere(float d[3], float u, float v)
+// Map a point of the unit square to a direction (x, y, z) over the hemisphere z >= 0, with
+// density proportional to z. Uses the concentric map of the square to the disk, which keeps
+// neighbouring points of the square next to each other.
+{
+    float a = 2.0f * u - 1.0f, b = 2.0f * v - 1.0f;
+    float r, phi;
+    if (a == 0.0f && b == 0.0f)
+    {
+        r = 0.0f;
+        phi = 0.0f;
+    }
+    else if (fabsf(a) > fabsf(b))
+    {
+        r = a;
+        phi = (float)(M_PI / 4.0) * (b / a);
+    }
+    else
+    {
+        r = b;
+        phi = (float)(M_PI / 2.0) - (float)(M_PI / 4.0) * (a / b);
+    }
+    d[0] = r * cosf(phi);
+    d[1] = r * sinf(phi);
+    d[2] = sqrtf(Max2(0.0f, 1.0f - d[0] * d[0] - d[1] * d[1]));
+}
+
+
+static inline float SafeReciprocal(float x)
+// Reciprocal of a direction component, avoiding infinities in the box tests.
+{
+    const float TINY = 1e-30f;
+    if (fabsf(x) < TINY) x = (x < 0.0f) ? -TINY : TINY;
+    return 1.0f / x;
+}
+
+
+
+void RC_CastCosineRays(const RC_Bvh *bvh, unsigned int hits[], int raysPerSide, const float origin[3],
+                       const float normal[3], const float up[3], float minDist, unsigned int seed)
+// Cast (raysPerSide x raysPerSide) cosine-weighted rays from origin over the hemisphere
+// around normal, and store the item ID of the nearest quad each ray hits in hits[].
+{
+    // Orthonormal frame with z along the normal and y along up.
+    float zAxis[3], yAxis[3], xAxis[3], t[3];
+    VecNormalize(zAxis, normal);
+    VecScale(t, VecDotProd(up, zAxis), zAxis);
+    VecDiff(t, up, t);
+    VecNormalize(yAxis, t);
+    VecCrossProd(xAxis, yAxis, zAxis);
+
+    float cellSize = 1.0f / raysPerSide;
+
+    TP_ParallelFor(raysPerSide, [&](int y, int) {
+        unsigned int *rowHits = &hits[y * raysPerSide];
+
+        if (bvh->numNodes == 0)
+        {
+            for (int x = 0; x < raysPerSide; x++) rowHits[x] = RC_MISS_ITEM;
+            return;
+        }
+
+        for (int x0 = 0; x0 < raysPerSide; x0 += PACKET_SIZE)
+        {
+            int numRays = Min2(PACKET_SIZE, raysPerSide - x0);
+            float dirs[PACKET_SIZE][3];
+            float meanDir[3] = { 0.0f, 0.0f, 0.0f };
+
+            for (int i = 0; i < PACKET_SIZE; i++)
+            {
+                // Unused lanes repeat the last ray.
+                int x = x0 + Min2(i, numRays - 1);
+                unsigned int h = HashUInt(seed ^ HashUInt((unsigned int)(y * raysPerSide + x)));
+                float u = (x + HashToUnitFloat(h)) * cellSize;
+                float v = (y + HashToUnitFloat(HashUInt(h))) * cellSize;
+
+                float d[3];
+                SquareToCosineHemisphere(d, u, v);
+                for (int a = 0; a < 3; a++)
+                {
+                    dirs[i][a] = d[0] * xAxis[a] + d[1] * yAxis[a] + d[2] * zAxis[a];
+                    meanDir[a] += dirs[i][a];
+                }
+            }
+
+#ifdef RC_USE_SSE2
+            RC_Packet pk;
+            for (int a = 0; a < 3; a++)
+            {
+                pk.org[a] = _mm_set1_ps(origin[a]);
+                pk.dir[a] = _mm_setr_ps(dirs[0][a], dirs[1][a], dirs[2][a], dirs[3][a]);
+                pk.invDir[a] = _mm_setr_ps(SafeReciprocal(dirs[0][a]), SafeReciprocal(dirs[1][a]),
+                                           SafeReciprocal(dirs[2][a]), SafeReciprocal(dirs[3][a]));
+            }
+            pk.tMin = _mm_set1_ps(minDist);
+            pk.tMax = _mm_set1_ps(1e30f);
+            pk.item = _mm_set1_epi32((int)RC_MISS_ITEM);
+            TracePacket(bvh, &pk, meanDir);
+
+            unsigned int items[PACKET_SIZE];
+            _mm_storeu_si128((__m128i *)items, pk.item);
+            for (int i = 0; i < numRays; i++) rowHits[x0 + i] = items[i];
+#else
+            for (int i = 0; i < numRays; i++)
+            {
+                float invDir[3] = { SafeReciprocal(dirs[i][0]), SafeReciprocal(dirs[i][1]), SafeReciprocal(dirs[i][2]) };
+                rowHits[x0 + i] = TraceRay(bvh, origin, dirs[i], invDir, minDist);
+            }
+#endif
+        }
+    });
+}
+
+
+
+void RC_TraceRays(const RC_Bvh *bvh, unsigned int hits[], int numRays, const float origins[][3],
+                  const float dirs[][3], float minDist)
+// Store the item ID of the nearest quad hit by each ray in hits[].
+{
+    for (int r0 = 0; r0 < numRays; r0 += PACKET_SIZE)
+    {
+        int n = Min2(PACKET_SIZE, numRays - r0);
+        if (bvh->numNodes == 0)
+        {
+            for (int i = 0; i < n; i++) hits[r0 + i] = RC_MISS_ITEM;
+            continue;
+        }
+
+#ifdef RC_USE_SSE2
+        // Unused lanes repeat the last ray.
+        int lane[PACKET_SIZE];
+        float meanDir[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+            lane[i] = r0 + Min2(i, n - 1);
+            for (int a = 0; a < 3; a++) meanDir[a] += dirs[lane[i]][a];
+        }
+
+        RC_Packet pk;
+        for (int a = 0; a < 3; a++)
+        {
+            pk.org[a] = _mm_setr_ps(origins[lane[0]][a], origins[lane[1]][a], origins[lane[2]][a], origins[lane[3]][a]);
+            pk.dir[a] = _mm_setr_ps(dirs[lane[0]][a], dirs[lane[1]][a], dirs[lane[2]][a], dirs[lane[3]][a]);
+            pk.invDir[a] = _mm_setr_ps(SafeReciprocal(dirs[lane[0]][a]), SafeReciprocal(dirs[lane[1]][a]),
+                                       SafeReciprocal(dirs[lane[2]][a]), SafeReciprocal(dirs[lane[3]][a]));
+        }
+        pk.tMin = _mm_set1_ps(minDist);
+        pk.tMax = _mm_set1_ps(1e30f);
+        pk.item = _mm_set1_epi32((int)RC_MISS_ITEM);
+        TracePacket(bvh, &pk, meanDir);
+
+        unsigned int items[PACKET_SIZE];
+        _mm_storeu_si128((__m128i *)items, pk.item);
+        for (int i = 0; i < n; i++) hits[r0 + i] = items[i];
+#else
+        for (int i = r0; i < r0 + n; i++)
+        {
+            float invDir[3] = { SafeReciprocal(dirs[i][0]), SafeReciprocal(dirs[i][1]), SafeReciprocal(dirs[i][2]) };
+            hits[i] = TraceRay(bvh, origins[i], dirs[i], invDir, minDist);
+        }
+#endif
+    }
+}
+
+
+
+static bool Occluded(const RC_Bvh *bvh, const float org[3], const float dir[3], float tMin, float tMax,
+                     unsigned int ignoreItem)
+// Returns whether the ray hits any quad other than ignoreItem between tMin and tMax.
+{
+    if (bvh->numNodes == 0) return false;
+
+    float invDir[3] = { SafeReciprocal(dir[0]), SafeReciprocal(dir[1]), SafeReciprocal(dir[2]) };
+    int stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const RC_Node *node = &bvh->nodes[stack[--sp]];
+        if (!IntersectBox(org, invDir, tMin, tMax, node)) continue;
+
+        if (node->count > 0)
+        {
+            for (int i = node->first; i < node->first + node->count; i++)
+            {
+                if (bvh->items[i] == ignoreItem) continue;
+                const float (*q)[3] = bvh->prims[i];
+                float t = tMax;
+                unsigned int item = RC_MISS_ITEM;
+                IntersectTriangle(org, dir, tMin, &t, &item, q[0], q[1], q[2], bvh->items[i]);
+                IntersectTriangle(org, dir, tMin, &t, &item, q[0], q[2], q[3], bvh->items[i]);
+                if (item != RC_MISS_ITEM) return true;
+            }
+            continue;
+        }
+
+        stack[sp++] = node->first + 1;
+        stack[sp++] = node->first;
+    }
+    return false;
+}
+
+
+
+float RC_QuadVisibility(const RC_Bvh *bvh, const float from[3], const float quad[4][3], unsigned int item,
+                        int samplesPerSide, float minDist, unsigned int seed)
+// Estimate the fraction of the quad that is visible from point from, by casting shadow rays to
+// (samplesPerSide x samplesPerSide) jittered points on it.
+{
+    int numVisible = 0;
+    for (int sy = 0; sy < samplesPerSide; sy++)
+        for (int sx = 0; sx < samplesPerSide; sx++)
+        {
+            unsigned int h = HashUInt(seed ^ HashUInt((unsigned int)(sy * samplesPerSide + sx)));
+            float s = (sx + HashToUnitFloat(h)) / samplesPerSide;
+            float t = (sy + HashToUnitFloat(HashUInt(h))) / samplesPerSide;
+
+            // Bilinear interpolation of the vertices.
+            float dir[3];
+            for (int a = 0; a < 3; a++)
+            {
+                float p = (1.0f - s) * (1.0f - t) * quad[0][a] + s * (1.0f - t) * quad[1][a] +
+                          s * t * quad[2][a] + (1.0f - s) * t * quad[3][a];
+                dir[a] = p - from[a];
+            }
+
+            // The ray stops just short of the point on the quad.
+            float dist = VecLen(dir);
+            if (dist <= minDist || !Occluded(bvh, from, dir, minDist / dist, 1.0f - 1e-4f, item)) numVisible++;
+        }
+    return (float)numVisible / (samplesPerSide * samplesPerSide);
+}
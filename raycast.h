@@ -0,0 +1,68 @@
+#ifndef _RAYCAST_H_
+#define _RAYCAST_H_
+
+// Ray-cast form factors.
+// Rays are cast from a shooter in cosine-weighted directions over its hemisphere, and traced
+// through a bounding volume hierarchy (BVH) of the gatherer quads. As the ray density is
+// proportional to the cosine at the shooter, the fraction of the rays that hit a gatherer
+// estimates its form factor from the shooter's centroid, which is the same quantity the
+// hemicube approximates.
+// Shadow rays through the same BVH estimate the visibility of a quad from a point.
+// The BVH is built with binned surface area heuristic (SAH) splits, with the subtrees built
+// in parallel on the thread pool. Rays are traced in packets of 4 with SSE2 where available.
+
+
+#define RC_MISS_ITEM    0xFFFFFFFFu // Item ID of rays that do not hit any quad.
+
+
+typedef struct RC_Node {
+    float bmin[3];          // Bounding box of the node.
+    int first;              // Interior node: index of the left child, the right child follows it.
+                            // Leaf node: index of the first primitive.
+    float bmax[3];
+    int count;              // Number of primitives of a leaf node, 0 for an interior node.
+}
+RC_Node;
+
+
+typedef struct RC_Bvh {
+    int numNodes;           // Number of nodes. Node 0 is the root.
+    RC_Node *nodes;
+    int numPrims;           // Number of primitives (quads), in the order the leaves refer to them.
+    float (*prims)[4][3];   // Vertex 0 and the edges from vertex 0 to vertices 1, 2 and 3 of each quad.
+    unsigned int *items;    // Item ID of each primitive.
+    int depth;              // Number of levels of nodes.
+}
+RC_Bvh;
+
+
+
+extern RC_Bvh RC_BvhInit(int numQuads, const float (*quads)[4][3]);
+// Build a BVH of the quads. The item ID of each quad is its index in quads[].
+// Must be called after TP_Init().
+
+extern void RC_BvhCleanUp(RC_Bvh *bvh);
+
+extern void RC_CastCosineRays(const RC_Bvh *bvh, unsigned int hits[], int raysPerSide, const float origin[3],
+                              const float normal[3], const float up[3], float minDist, unsigned int seed);
+// Cast (raysPerSide x raysPerSide) cosine-weighted rays from origin over the hemisphere
+// around normal, and store the item ID of the nearest quad each ray hits in hits[].
+// Ray (x, y) samples a random point in cell (x, y) of a grid over the unit square, which is mapped
+// to the hemisphere so that neighbouring cells have neighbouring directions. up gives the
+// direction of increasing y, and does not need to be perpendicular to normal.
+// Hits closer than minDist are ignored. seed selects the random points.
+// The rows of rays are cast in parallel on the thread pool.
+
+extern void RC_TraceRays(const RC_Bvh *bvh, unsigned int hits[], int numRays, const float origins[][3],
+                         const float dirs[][3], float minDist);
+// Store the item ID of the nearest quad hit by each ray in hits[]. Hits closer than minDist are ignored.
+// The rays are traced on the calling thread, so that the caller can trace rays on each worker.
+// Rays that are next to each other in the arrays should be coherent, as they are traced together.
+
+extern float RC_QuadVisibility(const RC_Bvh *bvh, const float from[3], const float quad[4][3], unsigned int item,
+                               int samplesPerSide, float minDist, unsigned int seed);
+// Estimate the fraction of the quad that is visible from point from, by casting shadow rays to
+// (samplesPerSide x samplesPerSide) jittered points on it. item is the quad's own item ID,
+// which does not occlude it. Occluders closer than minDist to from are ignored.
+
+#endif
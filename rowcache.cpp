@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "rowcache.h"
+
+
+
+static inline size_t RowBytes(int numEntries)
+{
+    return numEntries * (sizeof(int) + sizeof(float));
+}
+
+
+static void Unlink(LC_Cache *c, int shooter)
+// Take a cached shooter out of the list.
+{
+    if (c->prev[shooter] >= 0) c->next[c->prev[shooter]] = c->next[shooter];
+    else c->head = c->next[shooter];
+    if (c->next[shooter] >= 0) c->prev[c->next[shooter]] = c->prev[shooter];
+    else c->tail = c->prev[shooter];
+}
+
+
+static void PushFront(LC_Cache *c, int shooter)
+// Make a cached shooter the most recently used.
+{
+    c->prev[shooter] = -1;
+    c->next[shooter] = c->head;
+    if (c->head >= 0) c->prev[c->head] = shooter;
+    c->head = shooter;
+    if (c->tail < 0) c->tail = shooter;
+}
+
+
+static void Evict(LC_Cache *c, int shooter)
+{
+    Unlink(c, shooter);
+    c->bytesHeld -= RowBytes(c->numEntries[shooter]);
+    free(c->gatherers[shooter]);
+    free(c->formFactors[shooter]);
+    c->gatherers[shooter] = NULL;
+    c->formFactors[shooter] = NULL;
+    c->numEntries[shooter] = -1;
+    c->numCached--;
+}
+
+
+
+LC_Cache LC_CacheInit(int numShooters, size_t byteBudget)
+{
+    LC_Cache c;
+    c.numShooters = numShooters;
+    c.byteBudget = byteBudget;
+    c.bytesHeld = 0;
+    c.numCached = 0;
+    int n = (numShooters > 0) ? numShooters : 1;
+    c.numEntries = (int *)CheckedMalloc(sizeof(int) * n);
+    c.gatherers = (int **)CheckedMalloc(sizeof(int *) * n);
+    c.formFactors = (float **)CheckedMalloc(sizeof(float *) * n);
+    c.prev = (int *)CheckedMalloc(sizeof(int) * n);
+    c.next = (int *)CheckedMalloc(sizeof(int) * n);
+    for (int s = 0; s < numShooters; s++)
+    {
+        c.numEntries[s] = -1;
+        c.gatherers[s] = NULL;
+        c.formFactors[s] = NULL;
+        c.prev[s] = c.next[s] = -1;
+    }
+    c.head = c.tail = -1;
+    c.numLookups = c.numHits = c.numEvictions = 0;
+    return c;
+}
+
+
+void LC_CacheCleanUp(LC_Cache *c)
+{
+    if (c == NULL || c->numEntries == NULL) return;
+    for (int s = 0; s < c->numShooters; s++)
+    {
+        free(c->gatherers[s]);
+        free(c->formFactors[s]);
+    }
+    free(c->numEntries);
+    free(c->gatherers);
+    free(c->formFactors);
+    free(c->prev);
+    free(c->next);
+    c->numEntries = NULL;
+    c->gatherers = NULL;
+    c->formFactors = NULL;
+    c->prev = c->next = NULL;
+    c->head = c->tail = -1;
+    c->bytesHeld = 0;
+    c->numCached = 0;
+}
+
+
+
+bool LC_Lookup(LC_Cache *c, int shooter, FF_Row *row)
+// If the row of the shooter is cached, make it the most recently used and set row to refer to it.
+{
+    c->numLookups++;
+    if (c->numEntries[shooter] < 0) return false;
+
+    c->numHits++;
+    Unlink(c, shooter);
+    PushFront(c, shooter);
+    row->numEntries = row->capacity = c->numEntries[shooter];
+    row->gatherers = c->gatherers[shooter];
+    row->formFactors = c->formFactors[shooter];
+    return true;
+}
+
+
+void LC_Insert(LC_Cache *c, int shooter, const FF_Row *row)
+// Cache a copy of the row of a shooter that is not cached, evicting the least recently used rows as needed.
+{
+    size_t bytes = RowBytes(row->numEntries);
+    if (c->numEntries[shooter] >= 0 || bytes > c->byteBudget) return;
+
+    while (c->bytesHeld + bytes > c->byteBudget)
+    {
+        Evict(c, c->tail);
+        c->numEvictions++;
+    }
+
+    int n = (row->numEntries > 0) ? row->numEntries : 1;
+    c->gatherers[shooter] = (int *)CheckedMalloc(sizeof(int) * n);
+    c->formFactors[shooter] = (float *)CheckedMalloc(sizeof(float) * n);
+    memcpy(c->gatherers[shooter], row->gatherers, sizeof(int) * row->numEntries);
+    memcpy(c->formFactors[shooter], row->formFactors, sizeof(float) * row->numEntries);
+    c->numEntries[shooter] = row->numEntries;
+    c->bytesHeld += bytes;
+    c->numCached++;
+    PushFront(c, shooter);
+}
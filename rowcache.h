@@ -0,0 +1,44 @@
+#ifndef _ROWCACHE_H_
+#define _ROWCACHE_H_
+
+#include <stddef.h>
+#include "formfactor.h"
+
+// Least-recently-used cache of the form factor rows of shooters.
+// In progressive refinement, a shooter is often picked again once enough reflected power
+// has built up on it. Its form factors are the same as the last time, so a cached copy of its
+// row replaces rendering its hemicube again. The rows are copied at their exact size, and the
+// least recently used ones are evicted to keep the total size within a byte budget.
+
+
+typedef struct LC_Cache {
+    int numShooters;
+    size_t byteBudget;      // Largest total size of the cached rows.
+    size_t bytesHeld;       // Total size of the cached rows.
+    int numCached;          // Number of cached rows.
+    int *numEntries;        // Number of entries of the cached row of each shooter, or -1 if not cached.
+    int **gatherers;        // Cached rows of the shooters.
+    float **formFactors;
+    int *prev, *next;       // Doubly linked list of the cached shooters, from the most recently used.
+    int head, tail;         // Most and least recently used cached shooters, or -1.
+
+    long long numLookups;   // Statistics.
+    long long numHits;
+    long long numEvictions;
+}
+LC_Cache;
+
+
+
+extern LC_Cache LC_CacheInit(int numShooters, size_t byteBudget);
+extern void LC_CacheCleanUp(LC_Cache *c);
+
+extern bool LC_Lookup(LC_Cache *c, int shooter, FF_Row *row);
+// If the row of the shooter is cached, make it the most recently used, set row to refer to it
+// and return true. The row stays valid until the next LC_Insert(). Otherwise return false.
+
+extern void LC_Insert(LC_Cache *c, int shooter, const FF_Row *row);
+// Cache a copy of the row of a shooter that is not cached, evicting the least recently used
+// rows as needed. Rows larger than the whole budget are not cached.
+
+#endif
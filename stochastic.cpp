@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "common.h"
+#include "vector3.h"
+#include "threadpool.h"
+#include "stochastic.h"
+
+
+#define CHUNK_RAYS      1024    // Number of rays cast by each task.
+#define CHUNK_SHOOTERS  64      // Number of shooters whose gatherers are updated by each task.
+#define BATCH_RAYS      64      // Number of rays traced together by a task.
+
+
+
+static inline unsigned int HashUInt(unsigned int x)
+// A 32-bit integer hash with good avalanche.
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+
+static inline float HashToUnitFloat(unsigned int h)
+// Map a hash to [0, 1).
+{
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+
+
+SJ_Solver SJ_SolverInit(const QM_Model *m, const RC_Bvh *bvh, float minDist)
+{
+    SJ_Solver s;
+    s.bvh = bvh;
+    s.minDist = minDist;
+    s.numShooters = m->totalShooters;
+    s.numGatherers = m->totalGatherers;
+    s.numWorkers = TP_NumWorkers();
+    s.numShots = 0;
+
+    // The gatherers of each shooter are consecutive, as QM_Subdivide() makes them shooter by shooter.
+    s.firstGatherer = (int *)CheckedMalloc(sizeof(int) * (s.numShooters + 1));
+    int g = 0;
+    for (int q = 0; q < s.numShooters; q++)
+    {
+        s.firstGatherer[q] = g;
+        while (g < s.numGatherers && m->gatherers[g]->shooter->index == q) g++;
+    }
+    s.firstGatherer[s.numShooters] = g;
+    if (g != s.numGatherers)
+        ShowFatalError(__FILE__, __LINE__, "Gatherer quads are not grouped by shooter quad");
+
+    s.cumulativePower = (double *)CheckedMalloc(sizeof(double) * (s.numShooters + 1));
+    s.sums = (double (*)[4])CheckedMalloc(sizeof(double) * 4 * s.numWorkers * (s.numGatherers > 0 ? s.numGatherers : 1));
+    s.variance = (double *)CheckedMalloc(sizeof(double) * (s.numGatherers > 0 ? s.numGatherers : 1));
+    for (int i = 0; i < s.numGatherers; i++) s.variance[i] = 0.0;
+    return s;
+}
+
+
+void SJ_SolverCleanUp(SJ_Solver *s)
+{
+    if (s == NULL) return;
+    free(s->firstGatherer);
+    free(s->cumulativePower);
+    free(s->sums);
+    free(s->variance);
+    s->firstGatherer = NULL;
+    s->cumulativePower = NULL;
+    s->sums = NULL;
+    s->variance = NULL;
+}
+
+
+
+static int FindShooter(const SJ_Solver *s, double power)
+// Returns the shooter whose range of the running sums of the unshot power contains power.
+{
+    int lo = 0, hi = s->numShooters - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s->cumulativePower[mid + 1] <= power) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+static void SampleRay(float origin[3], float dir[3], const QM_ShooterQuad *shooterQuad, unsigned int h)
+// Pick a uniformly distributed point on the shooter quad, and a cosine-weighted direction
+// over the hemisphere around its normal.
+{
+    float r1 = HashToUnitFloat(h = HashUInt(h));
+    float r2 = HashToUnitFloat(h = HashUInt(h));
+    float r3 = HashToUnitFloat(h = HashUInt(h));
+    float r4 = HashToUnitFloat(h = HashUInt(h));
+    float r5 = HashToUnitFloat(HashUInt(h));
+
+    // Pick one of the 2 triangles of the quad in proportion to its area, then a point on it.
+    const float (*v)[3] = shooterQuad->v;
+    float n1[3], n2[3];
+    VecTriNormal(n1, v[0], v[1], v[2]);
+    VecTriNormal(n2, v[0], v[2], v[3]);
+    float area1 = VecLen(n1), area2 = VecLen(n2);
+    const float *b = v[1], *c = v[2];
+    if (r1 * (area1 + area2) >= area1)
+    {
+        b = v[2];
+        c = v[3];
+    }
+    float su = sqrtf(r2);
+    for (int a = 0; a < 3; a++)
+        origin[a] = (1.0f - su) * v[0][a] + su * (1.0f - r3) * b[a] + su * r3 * c[a];
+
+    // Orthonormal frame around the normal.
+    const float *n = shooterQuad->normal;
+    float t[3] = { 1.0f, 0.0f, 0.0f }, xAxis[3], yAxis[3];
+    if (fabsf(n[0]) > 0.5f)
+    {
+        t[0] = 0.0f;
+        t[1] = 1.0f;
+    }
+    VecCrossProd(xAxis, t, n);
+    VecNormalize(xAxis, xAxis);
+    VecCrossProd(yAxis, n, xAxis);
+
+    float r = sqrtf(r4), phi = (float)(2.0 * M_PI) * r5;
+    float x = r * cosf(phi), y = r * sinf(phi), z = sqrtf(Max2(0.0f, 1.0f - r4));
+    for (int a = 0; a < 3; a++) dir[a] = x * xAxis[a] + y * yAxis[a] + z * n[a];
+}
+
+
+
+double SJ_Iterate(SJ_Solver *s, QM_Model *m, int numRays)
+// Shoot the unshot power of all the shooter quads with numRays rays.
+{
+    s->cumulativePower[0] = 0.0;
+    for (int q = 0; q < s->numShooters; q++)
+    {
+        const float *P = m->unshotPowers[q];
+        s->cumulativePower[q + 1] = s->cumulativePower[q] + Max2(0.0f, P[0] + P[1] + P[2]);
+    }
+    double totalPower = s->cumulativePower[s->numShooters];
+    if (totalPower <= 0.0 || numRays <= 0) return totalPower;
+
+    double powerPerRay = totalPower / numRays;
+    unsigned int seed = HashUInt(s->numShots++ * 0x9E3779B9u);
+
+    // Clear the accumulators.
+    int numChunks = (s->numGatherers + CHUNK_RAYS - 1) / CHUNK_RAYS;
+    TP_ParallelFor(numChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_RAYS, s->numGatherers);
+        for (int w = 0; w < s->numWorkers; w++)
+            for (int g = chunk * CHUNK_RAYS; g < end; g++)
+            {
+                double *sum = s->sums[w * s->numGatherers + g];
+                sum[0] = sum[1] = sum[2] = sum[3] = 0.0;
+            }
+    });
+
+    // Cast the rays. Ray i is stratified to the i-th of numRays equal slices of the total
+    // unshot power, so consecutive rays mostly come from the same shooter.
+    numChunks = (numRays + CHUNK_RAYS - 1) / CHUNK_RAYS;
+    TP_ParallelFor(numChunks, [&](int chunk, int worker) {
+        double (*sums)[4] = &s->sums[worker * s->numGatherers];
+        int end = Min2((chunk + 1) * CHUNK_RAYS, numRays);
+
+        for (int i0 = chunk * CHUNK_RAYS; i0 < end; i0 += BATCH_RAYS)
+        {
+            int n = Min2(BATCH_RAYS, end - i0);
+            float origins[BATCH_RAYS][3], dirs[BATCH_RAYS][3];
+            int shooters[BATCH_RAYS];
+            unsigned int hits[BATCH_RAYS];
+
+            for (int k = 0; k < n; k++)
+            {
+                unsigned int h = HashUInt(seed ^ (unsigned int)(i0 + k));
+                double power = (i0 + k + HashToUnitFloat(h)) * powerPerRay;
+                shooters[k] = FindShooter(s, Min2(power, totalPower));
+                SampleRay(origins[k], dirs[k], m->shooters[shooters[k]], HashUInt(h));
+            }
+            RC_TraceRays(s->bvh, hits, n, origins, dirs, s->minDist);
+
+            for (int k = 0; k < n; k++)
+            {
+                if (hits[k] >= (unsigned int)s->numGatherers) continue;
+                const float *P = m->unshotPowers[shooters[k]];
+                const float *reflectivity = m->gathererReflectivities[hits[k]];
+
+                // The ray carries the shooter's color, scaled to powerPerRay in total.
+                double scale = powerPerRay / (P[0] + P[1] + P[2]);
+                double *sum = sums[hits[k]];
+                double reflected = 0.0;
+                for (int c = 0; c < 3; c++)
+                {
+                    double r = scale * P[c] * reflectivity[c];
+                    sum[c] += r;
+                    reflected += r;
+                }
+                double dB = reflected / (3.0 * m->gathererAreas[hits[k]]);
+                sum[3] += dB * dB;
+            }
+        }
+    });
+
+    // Merge the accumulators into the gatherers, shooter by shooter, and make the reflected
+    // power the new unshot power.
+    double newTotalPower = 0.0;
+    int numShooterChunks = (s->numShooters + CHUNK_SHOOTERS - 1) / CHUNK_SHOOTERS;
+    double *chunkPower = (double *)CheckedMalloc(sizeof(double) * (numShooterChunks > 0 ? numShooterChunks : 1));
+
+    TP_ParallelFor(numShooterChunks, [&](int chunk, int) {
+        int end = Min2((chunk + 1) * CHUNK_SHOOTERS, s->numShooters);
+        chunkPower[chunk] = 0.0;
+        for (int q = chunk * CHUNK_SHOOTERS; q < end; q++)
+        {
+            double unshot[3] = { 0.0, 0.0, 0.0 };
+            for (int g = s->firstGatherer[q]; g < s->firstGatherer[q + 1]; g++)
+            {
+                double total[4] = { 0.0, 0.0, 0.0, 0.0 };
+                for (int w = 0; w < s->numWorkers; w++)
+                    for (int c = 0; c < 4; c++) total[c] += s->sums[w * s->numGatherers + g][c];
+
+                for (int c = 0; c < 3; c++)
+                {
+                    m->radiosities[g][c] += (float)(total[c] / m->gathererAreas[g]);
+                    unshot[c] += total[c];
+                }
+
+                // Variance of the sum of numRays independent per-ray increments.
+                double meanIncrement = (total[0] + total[1] + total[2]) / (3.0 * m->gathererAreas[g]);
+                s->variance[g] += Max2(0.0, total[3] - meanIncrement * meanIncrement / numRays);
+            }
+
+            float *P = m->unshotPowers[q];
+            for (int c = 0; c < 3; c++) P[c] = (float)unshot[c];
+            chunkPower[chunk] += unshot[0] + unshot[1] + unshot[2];
+        }
+    });
+
+    for (int chunk = 0; chunk < numShooterChunks; chunk++) newTotalPower += chunkPower[chunk];
+    free(chunkPower);
+    return newTotalPower;
+}
+
+
+
+double SJ_RelativeStandardError(const SJ_Solver *s, const QM_Model *m)
+// Estimate the area-weighted RMS standard error of the mean RGB radiosity of the gatherer quads,
+// relative to their area-weighted mean.
+{
+    double totalArea = 0.0, sumVariance = 0.0, sumRadiosity = 0.0;
+    for (int g = 0; g < s->numGatherers; g++)
+    {
+        const float *B = m->radiosities[g];
+        totalArea += m->gathererAreas[g];
+        sumVariance += m->gathererAreas[g] * s->variance[g];
+        sumRadiosity += m->gathererAreas[g] * (B[0] + B[1] + B[2]) / 3.0;
+    }
+    if (sumRadiosity <= 0.0) return 0.0;
+    return sqrt(sumVariance / totalArea) / (sumRadiosity / totalArea);
+}
@@ -0,0 +1,51 @@
+#ifndef _STOCHASTIC_H_
+#define _STOCHASTIC_H_
+
+#include "quadmodel.h"
+#include "raycast.h"
+
+// Stochastic Jacobi radiosity.
+// Each iteration shoots the unshot power of all the shooter quads at once with a number of
+// random rays. The shooter of each ray is chosen with probability proportional to its unshot
+// power, the origin is uniform over the shooter, and the direction is cosine-weighted, so that
+// each ray carries the same amount of power and the gatherer it hits receives an unbiased
+// estimate of its share. The power reflected by the gatherers becomes the unshot power of the
+// next iteration.
+// The rays are cast in parallel on the thread pool, with per-worker accumulators that are
+// summed after the rays of an iteration have all been cast, so no locks or atomics are needed.
+
+
+typedef struct SJ_Solver {
+    const RC_Bvh *bvh;      // BVH of the model's gatherer quads.
+    float minDist;          // Hits closer than this to the origin of a ray are ignored.
+    int numShooters;
+    int numGatherers;
+    int *firstGatherer;     // Gatherers of shooter s are firstGatherer[s] to (firstGatherer[s + 1] - 1).
+    double *cumulativePower;    // Running sums of the RGB unshot power of the shooters.
+    int numWorkers;
+    double (*sums)[4];      // Per-worker accumulators of numGatherers elements: the RGB power
+                            // received by each gatherer, and the sum of the squares of its
+                            // per-ray mean RGB radiosity increments.
+    double *variance;       // Estimated variance of the mean RGB radiosity of each gatherer.
+    unsigned int numShots;  // Number of iterations so far, which seeds the rays of each iteration.
+}
+SJ_Solver;
+
+
+
+extern SJ_Solver SJ_SolverInit(const QM_Model *m, const RC_Bvh *bvh, float minDist);
+// bvh must be a BVH of the model's gatherer quads, and must stay valid while the solver is used.
+// Must be called after TP_Init().
+
+extern void SJ_SolverCleanUp(SJ_Solver *s);
+
+extern double SJ_Iterate(SJ_Solver *s, QM_Model *m, int numRays);
+// Shoot the unshot power of all the shooter quads with numRays rays, adding the reflected power
+// to the radiosity of the gatherer quads hit, and replace the unshot power of each shooter quad
+// by the power its gatherer quads have reflected. Returns the total RGB unshot power.
+
+extern double SJ_RelativeStandardError(const SJ_Solver *s, const QM_Model *m);
+// Estimate the area-weighted RMS standard error of the mean RGB radiosity of the gatherer quads,
+// relative to their area-weighted mean.
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include "common.h"
+#include "threadpool.h"
+
+
+static std::vector<std::thread> workers;
+static std::mutex poolMutex;
+static std::condition_variable workAvailable;
+static std::condition_variable workDone;
+
+// The current parallel-for job.
+static const std::function<void(int, int)> *jobFunc = NULL;
+static int jobNumTasks = 0;
+static std::atomic<int> jobNextTask(0);
+static int jobWorkersBusy = 0;
+static unsigned int jobGeneration = 0;
+static bool poolStopping = false;
+
+// Index of the worker running on the current thread, or -1 if the thread
+// is not currently executing a task.
+static thread_local int currWorker = -1;
+
+
+
+static void RunTasks(const std::function<void(int, int)> &func, int numTasks, int worker)
+// Grab tasks from the current job until there is none left.
+{
+    currWorker = worker;
+    for (;;)
+    {
+        int task = jobNextTask.fetch_add(1);
+        if (task >= numTasks) break;
+        func(task, worker);
+    }
+    currWorker = -1;
+}
+
+
+
+static void WorkerMain(int worker)
+{
+    unsigned int seenGeneration = 0;
+
+    for (;;)
+    {
+        const std::function<void(int, int)> *func;
+        int numTasks;
+        {
+            std::unique_lock<std::mutex> lock(poolMutex);
+            workAvailable.wait(lock, [&] { return poolStopping || jobGeneration != seenGeneration; });
+            if (poolStopping) return;
+            seenGeneration = jobGeneration;
+            if (jobFunc == NULL) continue;  // Woke up after the job was already finished.
+            func = jobFunc;
+            numTasks = jobNumTasks;
+            jobWorkersBusy++;
+        }
+
+        RunTasks(*func, numTasks, worker);
+
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            jobWorkersBusy--;
+            if (jobWorkersBusy == 0) workDone.notify_all();
+        }
+    }
+}
+
+
+
+void TP_Init(int numThreads)
+// Start the pool with numThreads workers in total (including the calling thread).
+// If numThreads <= 0, the number of hardware threads is used.
+{
+    TP_CleanUp();
+
+    if (numThreads <= 0) numThreads = (int)std::thread::hardware_concurrency();
+    if (numThreads <= 0) numThreads = 1;
+
+    poolStopping = false;
+    for (int w = 1; w < numThreads; w++)
+        workers.push_back(std::thread(WorkerMain, w));
+}
+
+
+
+void TP_CleanUp(void)
+// Stop and join all the worker threads.
+{
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        poolStopping = true;
+    }
+    workAvailable.notify_all();
+    for (size_t w = 0; w < workers.size(); w++) workers[w].join();
+    workers.clear();
+    poolStopping = false;
+}
+
+
+
+int TP_NumWorkers(void)
+// Returns the number of workers, including the calling thread.
+{
+    return 1 + (int)workers.size();
+}
+
+
+
+int TP_CurrentWorker(void)
+// Returns the index of the worker running the calling code, or 0 outside of any task.
+{
+    return (currWorker >= 0) ? currWorker : 0;
+}
+
+
+
+void TP_ParallelFor(int numTasks, const std::function<void(int task, int worker)> &func)
+// Call func(task, worker) for every task in [0, numTasks), spreading the tasks over
+// the workers, and return when all of them are done.
+{
+    if (numTasks <= 0) return;
+
+    // Nested call, a single task, or no helper threads: run everything right here.
+    if (currWorker >= 0 || numTasks == 1 || workers.empty())
+    {
+        int worker = (currWorker >= 0) ? currWorker : 0;
+        for (int t = 0; t < numTasks; t++) func(t, worker);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        jobFunc = &func;
+        jobNumTasks = numTasks;
+        jobNextTask = 0;
+        jobGeneration++;
+    }
+    workAvailable.notify_all();
+
+    RunTasks(func, numTasks, 0);
+
+    // Wait for the helpers that picked up this job to finish their last task.
+    std::unique_lock<std::mutex> lock(poolMutex);
+    workDone.wait(lock, [] { return jobWorkersBusy == 0; });
+    jobFunc = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <functional>
+
+// A small persistent pool of worker threads used by the solver to spread
+// independent pieces of work (hemicube faces, tiles, shooters, ...) over all cores.
+// The calling thread always takes part in the work as worker 0.
+
+
+extern void TP_Init(int numThreads);
+// Start the pool with numThreads workers in total (including the calling thread).
+// If numThreads <= 0, the number of hardware threads is used.
+
+extern void TP_CleanUp(void);
+// Stop and join all the worker threads.
+
+extern int TP_NumWorkers(void);
+// Returns the number of workers, including the calling thread.
+// Worker indices passed to the task function are in the range [0, TP_NumWorkers()).
+
+extern int TP_CurrentWorker(void);
+// Returns the index of the worker running the calling code, or 0 outside of any task.
+
+extern void TP_ParallelFor(int numTasks, const std::function<void(int task, int worker)> &func);
+// Call func(task, worker) for every task in [0, numTasks), spreading the tasks over
+// the workers, and return when all of them are done.
+// A TP_ParallelFor() issued from inside a task runs its tasks serially on the calling
+// worker, so that parallel code can be freely nested.
+
+#endif